@@ -0,0 +1,1227 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // syscall()
+
+#include "bootloader.h"
+#include "crc32.h"
+#include "link_sim.h"
+#include "fleet_sim.h"
+#include "framer.h"
+#include "device_sim.h"
+#include "host_link.h"
+#include "image_format.h"
+#include "image_loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define IDLE_MEASURE_MS 1000
+#define HOST_LINK_IMAGE_SIZE (256 * 1024)
+#define GANG_IMAGE_SIZE (64 * 1024)
+#define GANG_MAX_DEVICES 64
+
+// Benchmark results (the bootloader trace is compiled out)
+static FILE *report;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static void *run_thread(void *arg) {
+    (void)arg;
+    bootloader_run();
+    return NULL;
+}
+
+static void report_idle(const char *mode, uint64_t cpu_ns, uint64_t wall_ns, uint32_t wakeups) {
+    double seconds = wall_ns / 1e9;
+    fprintf(report, "  %-6s CPU %6.2f%%   wakeups/s %12.1f\n", mode,
+           100.0 * cpu_ns / wall_ns, wakeups / seconds);
+}
+
+// Idle cost of the tight process_cycle() poll loop against bootloader_run()
+static void bench_idle(const char *label, bool with_session) {
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x12, 0x34};
+    bootloader_stats_t stats;
+
+    fprintf(report, "%s:\n", label);
+
+    // Poll mode
+    bootloader_init();
+    if (with_session) {
+        bootloader_receive_packet(start, sizeof(start));
+        bootloader_process_cycle();
+    }
+    uint32_t cycles = 0;
+    uint64_t cpu0 = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t wall0 = clock_ns(CLOCK_MONOTONIC);
+    uint64_t wall_end = wall0 + IDLE_MEASURE_MS * 1000000ull;
+    while (clock_ns(CLOCK_MONOTONIC) < wall_end) {
+        bootloader_process_cycle();
+        cycles++;
+    }
+    report_idle("poll", clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu0,
+                clock_ns(CLOCK_MONOTONIC) - wall0, cycles);
+
+    // Event-driven mode
+    bootloader_init();
+    if (with_session) {
+        bootloader_receive_packet(start, sizeof(start));
+        bootloader_process_cycle();
+    }
+    pthread_t thread;
+    cpu0 = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    wall0 = clock_ns(CLOCK_MONOTONIC);
+    pthread_create(&thread, NULL, run_thread, NULL);
+    sleep_ms(IDLE_MEASURE_MS);
+    bootloader_stop();
+    pthread_join(thread, NULL);
+    bootloader_get_stats(&stats);
+    report_idle("run", clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu0,
+                clock_ns(CLOCK_MONOTONIC) - wall0, stats.wakeups);
+}
+
+// Latency of a PING queued behind a data FIFO that is already full of
+// flash writes
+static void bench_control_latency(int queued_data_packets) {
+    const int rounds = 200;
+    uint32_t handled = 0, max_us = 0;
+    uint64_t total_us = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        uint8_t start[] = {0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x12, 0x34}; // 64 KB
+        bootloader_init();
+        bootloader_receive_packet(start, sizeof(start));
+        bootloader_process_cycle();
+
+        for (int i = 1; i <= queued_data_packets; i++) {
+            uint8_t data_packet[MAX_PACKET_SIZE];
+            data_packet[0] = i;
+            data_packet[1] = PKT_DATA;
+            memset(&data_packet[2], i, MAX_PAYLOAD_SIZE);
+            bootloader_receive_packet(data_packet, sizeof(data_packet));
+        }
+
+        uint8_t ping[] = {0x80, PKT_PING};
+        bootloader_receive_packet(ping, sizeof(ping));
+        bootloader_process_cycle();
+
+        bootloader_stats_t stats;
+        bootloader_get_stats(&stats);
+        handled += stats.control_packets;
+        total_us += stats.control_latency_total_us;
+        if (stats.control_latency_max_us > max_us) {
+            max_us = stats.control_latency_max_us;
+        }
+    }
+
+    fprintf(report, "  %2d data packets queued: %3u/%d pings handled, latency avg %.1f us, max %u us\n",
+            queued_data_packets, handled, rounds,
+            handled ? (double)total_us / handled : 0.0, max_us);
+}
+
+static void report_transfer(const char *label, const dfu_transfer_result_t *r) {
+    fprintf(report, "  %-28s %-9s goodput %7.1f KiB/s  ack latency %7.0f us  sent %5u  retx %5u  drops %4u  nacks %4u  timeouts %3u\n",
+            label,
+            r->completed ? "ok" : (r->recovery_entered ? "RECOVERY" : "FAILED"),
+            r->goodput_kib_s, r->avg_ack_latency_us, r->packets_sent, r->retransmissions,
+            r->packets_dropped, r->nacks, r->timeouts);
+}
+
+// Host pacing with and without the credits advertised in each ACK
+static void bench_credit_flow_control(void) {
+    link_config_t link = { .loss_rate = 0.0, .response_loss_rate = 0.0, .seed = 51 };
+    dfu_host_config_t host = { .image_size = 64 * 1024, .retransmit_timeout_us = 50000 };
+    dfu_transfer_result_t result;
+    
+    const uint32_t windows[] = { 8, BUFFER_SIZE, 2 * BUFFER_SIZE, 8 * BUFFER_SIZE };
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        char label[64];
+        host.window = windows[i];
+        
+        host.use_credits = false;
+        link_sim_run_dfu(&link, &host, &result);
+        snprintf(label, sizeof(label), "window %3u, no credits", windows[i]);
+        report_transfer(label, &result);
+        
+        host.use_credits = true;
+        link_sim_run_dfu(&link, &host, &result);
+        snprintf(label, sizeof(label), "window %3u, credits", windows[i]);
+        report_transfer(label, &result);
+    }
+}
+
+// Lossy links in both directions: lost data causes gaps, lost ACKs cause
+// retransmitted duplicates
+static void bench_lossy_link(void) {
+    dfu_host_config_t host = { .image_size = 64 * 1024, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 20000 };
+    const double loss_rates[] = { 0.01, 0.05, 0.10 };
+    const int runs = 5;
+    
+    for (size_t i = 0; i < sizeof(loss_rates) / sizeof(loss_rates[0]); i++) {
+        int completed = 0, recoveries = 0;
+        uint32_t retransmissions = 0, nacks = 0, timeouts = 0;
+        double goodput = 0.0;
+        for (int run = 0; run < runs; run++) {
+            link_config_t link = { .loss_rate = loss_rates[i],
+                                   .response_loss_rate = loss_rates[i],
+                                   .seed = 1000 + run };
+            dfu_transfer_result_t result;
+            link_sim_run_dfu(&link, &host, &result);
+            completed += result.completed;
+            recoveries += result.recovery_entered;
+            retransmissions += result.retransmissions;
+            nacks += result.nacks;
+            timeouts += result.timeouts;
+            goodput += result.goodput_kib_s;
+        }
+        fprintf(report, "  loss %4.1f%% each way: %d/%d completed, %d recoveries, "
+                "avg goodput %6.1f KiB/s, avg retx %6.1f, nacks %5.1f, timeouts %5.1f\n",
+                loss_rates[i] * 100.0, completed, runs, recoveries,
+                goodput / runs, (double)retransmissions / runs,
+                (double)nacks / runs, (double)timeouts / runs);
+    }
+}
+
+// Parity frames per page-sized FEC group on a slow half-duplex serial link,
+// where every retransmission round trip costs air time
+static void bench_fec(double loss_rate, uint8_t parity) {
+    dfu_host_config_t host = { .image_size = 32 * 1024, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 60000 };
+    const int runs = 2;
+    int completed = 0;
+    uint32_t retransmissions = 0, parity_frames = 0, recovered = 0, timeouts = 0;
+    double goodput = 0.0;
+    for (int run = 0; run < runs; run++) {
+        link_config_t link = { .loss_rate = loss_rate, .response_loss_rate = loss_rate,
+                               .seed = 1000 + run, .bitrate = 250000, .fec_parity = parity };
+        dfu_transfer_result_t result;
+        link_sim_run_dfu(&link, &host, &result);
+        completed += result.completed;
+        retransmissions += result.retransmissions;
+        parity_frames += result.parity_frames;
+        recovered += result.fec_recovered;
+        timeouts += result.timeouts;
+        goodput += result.goodput_kib_s;
+    }
+    fprintf(report, "  loss %4.1f%%, %d parity: %d/%d completed, avg goodput %5.1f KiB/s, "
+            "avg retx %5.1f, parity %5.1f, rebuilt %4.1f, timeouts %4.1f\n",
+            loss_rate * 100.0, parity, completed, runs, goodput / runs,
+            (double)retransmissions / runs, (double)parity_frames / runs,
+            (double)recovered / runs, (double)timeouts / runs);
+}
+
+// Response channel cost of per-packet vs coalesced ACKs on a half-duplex
+// link, where the device can only answer between the host's frames
+static void bench_ack_coalescing(uint32_t bitrate, double loss_rate, bool ack_per_packet) {
+    dfu_host_config_t host = { .image_size = 64 * 1024, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 60000 };
+    const int runs = 3;
+    int completed = 0;
+    uint32_t frames = 0, bytes = 0, timeouts = 0;
+    double goodput = 0.0;
+    for (int run = 0; run < runs; run++) {
+        link_config_t link = { .loss_rate = loss_rate, .response_loss_rate = loss_rate,
+                               .seed = 1000 + run, .bitrate = bitrate,
+                               .ack_per_packet = ack_per_packet };
+        dfu_transfer_result_t result;
+        link_sim_run_dfu(&link, &host, &result);
+        completed += result.completed;
+        frames += result.response_frames;
+        bytes += result.response_bytes;
+        timeouts += result.timeouts;
+        goodput += result.goodput_kib_s;
+    }
+    fprintf(report, "  %4u kbit/s, loss %3.1f%%, %-10s: %d/%d completed, avg goodput %5.1f KiB/s, "
+            "response frames %5.1f, %5.1f bytes/KiB, timeouts %4.1f\n",
+            bitrate / 1000, loss_rate * 100.0, ack_per_packet ? "per packet" : "coalesced",
+            completed, runs, goodput / runs, (double)frames / runs,
+            (double)bytes / runs / (host.image_size / 1024), (double)timeouts / runs);
+}
+
+// Data lane cost per packet on a mixed stream that never reaches the flash:
+// long-form pings, duplicate data, an unsupported type and gap queries for
+// another node, in an open session
+static void bench_dispatch(void) {
+    const int rounds = 200000;
+    bootloader_init();
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x01, 0x00, 0x00, 0x12, 0x34};
+    bootloader_receive_packet(start, sizeof(start));
+    uint8_t first[] = {0x01, PKT_DATA, 0xAA, 0xBB, 0xCC, 0xDD};
+    bootloader_receive_packet(first, sizeof(first));
+    for (int i = 0; i < 10; i++) {
+        bootloader_process_cycle();
+        sleep_ms(1); // Packet 1 written, so it is a duplicate from now on
+    }
+    
+    uint8_t ping[] = {0x10, PKT_PING, 0, 0, 0, 0, 0, 0, 0, 0}; // Too long for the control lane
+    uint8_t version[] = {0x11, PKT_GET_VERSION};
+    uint8_t gap_query[] = {0x00, PKT_GAP_QUERY, 0x63, 0x00, 0x00};
+    const struct { const uint8_t *data; size_t length; } stream[] = {
+        { ping, sizeof(ping) }, { first, sizeof(first) },
+        { version, sizeof(version) }, { gap_query, sizeof(gap_query) },
+    };
+    const int per_round = BUFFER_SIZE;
+    
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < per_round; i++) {
+            bootloader_receive_packet(stream[i % 4].data, stream[i % 4].length);
+        }
+        bootloader_process_cycle();
+    }
+    uint64_t elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    fprintf(report, "  %d packets: %.1f ns/packet (receive, dispatch, response), "
+            "state %d, dropped %u\n", rounds * per_round,
+            (double)elapsed_ns / ((double)rounds * per_round), stats.state, stats.packets_dropped);
+}
+
+// A counter over this thread and the ones it starts from now on, or -1 if
+// the kernel or the machine does not have it
+static int open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+// The dispatch stream again, but from a producer thread on USB while
+// bootloader_run() drains it on another: the two-thread ingress path, with
+// the queue indices and the bootloader's hot fields shared between them
+static void bench_ingress_cache(void) {
+    const uint32_t packets = 400000;
+    const struct { uint32_t type; uint64_t config; const char *name; } events[] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache misses" },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1d read misses" },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task clock" },
+    };
+    int fds[3];
+    for (int i = 0; i < 3; i++) {
+        fds[i] = open_counter(events[i].type, events[i].config);
+    }
+    
+    bootloader_init();
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x01, 0x00, 0x00, 0x12, 0x34};
+    bootloader_receive_packet_from(TRANSPORT_USB, start, sizeof(start));
+    uint8_t first[] = {0x01, PKT_DATA, 0xAA, 0xBB, 0xCC, 0xDD};
+    bootloader_receive_packet_from(TRANSPORT_USB, first, sizeof(first));
+    for (int i = 0; i < 10; i++) {
+        bootloader_process_cycle();
+        sleep_ms(1); // Packet 1 written, so it is a duplicate from now on
+    }
+    uint8_t ping[] = {0x10, PKT_PING, 0, 0, 0, 0, 0, 0, 0, 0}; // Too long for the control lane
+    uint8_t version[] = {0x11, PKT_GET_VERSION};
+    uint8_t gap_query[] = {0x00, PKT_GAP_QUERY, 0x63, 0x00, 0x00};
+    const struct { const uint8_t *data; size_t length; } stream[] = {
+        { ping, sizeof(ping) }, { first, sizeof(first) },
+        { version, sizeof(version) }, { gap_query, sizeof(gap_query) },
+    };
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    uint32_t processed0 = stats.packets_processed;
+    
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_thread, NULL);
+    uint32_t overruns = 0;
+    for (uint32_t n = 0; n < packets; n++) {
+        while (!bootloader_receive_packet_from(TRANSPORT_USB, stream[n % 4].data,
+                                               stream[n % 4].length)) {
+            overruns++;
+            sched_yield(); // Queue full: let the consumer catch up
+        }
+    }
+    do {
+        sched_yield();
+        bootloader_get_stats(&stats);
+    } while (stats.packets_processed - processed0 < packets);
+    bootloader_stop();
+    pthread_join(thread, NULL);
+    uint64_t elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    
+    fprintf(report, "  %u packets: %.1f ns/packet wall, ", packets, (double)elapsed_ns / packets);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] < 0) {
+            fprintf(report, "%s n/a, ", events[i].name);
+        } else if (events[i].type == PERF_TYPE_SOFTWARE) {
+            fprintf(report, "%s %.1f ns/packet, ", events[i].name,
+                    (double)read_counter(fds[i]) / packets);
+        } else {
+            fprintf(report, "%s %.2f/packet, ", events[i].name,
+                    (double)read_counter(fds[i]) / packets);
+        }
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    fprintf(report, "%u overruns\n", overruns);
+}
+
+// Producers hammering the transports that do not own the session
+typedef struct {
+    transport_t transport;
+    pthread_t thread;
+    uint32_t offered;
+    uint32_t rejected;
+} flooder_t;
+
+static volatile bool flood_stop;
+
+static void *flood_thread(void *arg) {
+    flooder_t *flooder = arg;
+    uint8_t packet[MAX_PACKET_SIZE];
+    bootloader_stats_t stats;
+    
+    // Start once the session is up so the flood hits it mid-transfer
+    do {
+        bootloader_get_stats(&stats);
+        sched_yield();
+    } while (stats.state != STATE_DFU_ACTIVE && !flood_stop);
+    
+    memset(packet, 0xEE, sizeof(packet));
+    packet[1] = PKT_DATA;
+    while (!flood_stop) {
+        packet[0] = (uint8_t)flooder->offered;
+        flooder->offered++;
+        if (!bootloader_receive_packet_from(flooder->transport, packet, sizeof(packet))) {
+            flooder->rejected++;
+            sched_yield(); // Queue full: let the consumer catch up
+        }
+    }
+    return NULL;
+}
+
+// A DFU session on UART while USB and/or CAN producers flood their queues
+static void bench_multi_transport(int flooders) {
+    link_config_t link = { .loss_rate = 0.0, .response_loss_rate = 0.0, .seed = 57,
+                           .transport = TRANSPORT_UART };
+    dfu_host_config_t host = { .image_size = 64 * 1024, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 50000 };
+    flooder_t flood[TRANSPORT_COUNT - 1];
+    dfu_transfer_result_t result;
+    
+    flood_stop = false;
+    for (int i = 0; i < flooders; i++) {
+        memset(&flood[i], 0, sizeof(flood[i]));
+        flood[i].transport = (transport_t)(TRANSPORT_USB + i);
+        pthread_create(&flood[i].thread, NULL, flood_thread, &flood[i]);
+    }
+    link_sim_run_dfu(&link, &host, &result);
+    flood_stop = true;
+    uint32_t offered = 0, rejected = 0;
+    for (int i = 0; i < flooders; i++) {
+        pthread_join(flood[i].thread, NULL);
+        offered += flood[i].offered;
+        rejected += flood[i].rejected;
+    }
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    fprintf(report, "  %d flooding producer%s  %-9s goodput %7.1f KiB/s  processed UART/USB/CAN %5u/%6u/%6u"
+            "  flood offered %7u, overruns %7u\n",
+            flooders, flooders == 1 ? " " : "s",
+            result.completed ? "ok" : (result.recovery_entered ? "RECOVERY" : "FAILED"),
+            result.goodput_kib_s, stats.transport_packets[TRANSPORT_UART],
+            stats.transport_packets[TRANSPORT_USB], stats.transport_packets[TRANSPORT_CAN],
+            offered, rejected);
+}
+
+// The slots the RX arena replaced: one full-size packet each
+typedef struct {
+    size_t length;
+    bool valid;
+    bool held;
+    uint8_t data[MAX_PACKET_SIZE];
+} fixed_rx_slot_t;
+
+// Bursts of mixed traffic on USB, one bootloader cycle apart: short
+// requests - version queries, gap queries for another node, long-form
+// pings - and one data packet in eight, which an idle device refuses
+static void bench_rx_arena(uint32_t mean_burst, bool fixed_slots) {
+    const int bursts = 20000;
+    bootloader_init();
+    bootloader_set_fixed_rx_slots(fixed_slots);
+    uint8_t data[MAX_PACKET_SIZE] = {0x01, PKT_DATA};
+    uint8_t version[] = {0x00, PKT_GET_VERSION};
+    uint8_t gap_query[] = {0x00, PKT_GAP_QUERY, 0x63, 0x00, 0x00};
+    uint8_t ping[] = {0x00, PKT_PING, 0, 0, 0, 0, 0, 0, 0, 0}; // Too long for the control lane
+    const struct { const uint8_t *data; size_t length; } mix[8] = {
+        { data, sizeof(data) }, { version, sizeof(version) }, { gap_query, sizeof(gap_query) },
+        { ping, sizeof(ping) }, { version, sizeof(version) }, { gap_query, sizeof(gap_query) },
+        { ping, sizeof(ping) }, { version, sizeof(version) },
+    };
+    
+    uint32_t x = 99, offered = 0, dropped = 0;
+    for (int burst = 0; burst < bursts; burst++) {
+        x = x * 1103515245u + 12345u;
+        uint32_t count = (x >> 16) % (2 * mean_burst + 1);
+        for (uint32_t i = 0; i < count; i++) {
+            x = x * 1103515245u + 12345u;
+            const uint8_t *packet = mix[(x >> 16) % 8].data;
+            size_t length = mix[(x >> 16) % 8].length;
+            offered++;
+            dropped += !bootloader_receive_packet_from(TRANSPORT_USB, packet, length);
+        }
+        bootloader_process_cycle(); // Drains the queue, in recovery mode too
+    }
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    fprintf(report, "  bursts of %2u on average, %-12s: %6.2f%% dropped of %u, %5u bytes in use at most\n",
+            mean_burst, fixed_slots ? "fixed slots" : "arena", dropped * 100.0 / offered, offered,
+            stats.transport_rx_peak[TRANSPORT_USB]);
+}
+
+#define FRAMER_STREAM_FRAMES BUFFER_SIZE // One queue's worth per round
+#define FRAMER_ROUNDS 2000
+
+static uint8_t framer_stream[FRAMER_STREAM_FRAMES * FRAME_MAX_ENCODED_SIZE(MAX_PACKET_SIZE)];
+
+// A queue's worth of full data frames with random payloads, zeros included
+static size_t build_frame_stream(uint32_t seed) {
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t length = 0;
+    for (int i = 0; i < FRAMER_STREAM_FRAMES; i++) {
+        packet[0] = (uint8_t)(i + 1);
+        packet[1] = PKT_DATA;
+        for (int j = PACKET_HEADER_SIZE; j < MAX_PACKET_SIZE; j++) {
+            seed = seed * 1103515245u + 12345u;
+            packet[j] = (seed >> 16) % 8 == 0 ? 0x00 : (uint8_t)(seed >> 8);
+        }
+        length += framer_encode(packet, sizeof(packet), &framer_stream[length],
+                                sizeof(framer_stream) - length);
+    }
+    return length;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Decode throughput by delivery granularity. The queue is drained between
+// rounds, outside the timed region; packets arriving in IDLE are NACKed.
+static void bench_framer_throughput(size_t chunk) {
+    size_t length = build_frame_stream(58);
+    framer_t framer;
+    uint64_t total_ns = 0;
+    
+    bootloader_init();
+    framer_init(&framer, TRANSPORT_UART);
+    for (int round = 0; round < FRAMER_ROUNDS; round++) {
+        uint64_t t0 = clock_ns(CLOCK_MONOTONIC);
+        for (size_t offset = 0; offset < length; offset += chunk) {
+            framer_feed(&framer, &framer_stream[offset], length - offset < chunk ? length - offset : chunk);
+        }
+        total_ns += clock_ns(CLOCK_MONOTONIC) - t0;
+        bootloader_process_cycle();
+    }
+    
+    double bytes = (double)length * FRAMER_ROUNDS;
+    fprintf(report, "  %4zu-byte chunks: %7.1f MB/s (%5.2f ns/byte), frames ok %u/%u\n",
+            chunk, bytes / (total_ns / 1e9) / 1e6, total_ns / bytes,
+            framer.frames_ok, FRAMER_STREAM_FRAMES * FRAMER_ROUNDS);
+}
+
+// Cost of each single-byte framer_feed() call, as from the RX interrupt.
+// Frame boundaries (slot reserve, CRC check, commit) set the worst case.
+static void bench_framer_per_byte(void) {
+    const int rounds = 50;
+    size_t length = build_frame_stream(59);
+    static uint32_t samples[sizeof(framer_stream) * 50];
+    size_t count = 0;
+    framer_t framer;
+    
+    // Timer overhead, subtracted from every sample
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t t0 = clock_ns(CLOCK_MONOTONIC);
+        uint64_t t1 = clock_ns(CLOCK_MONOTONIC);
+        if (t1 - t0 < overhead) overhead = t1 - t0;
+    }
+    
+    bootloader_init();
+    framer_init(&framer, TRANSPORT_UART);
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < length; i++) {
+            uint64_t t0 = clock_ns(CLOCK_MONOTONIC);
+            framer_feed(&framer, &framer_stream[i], 1);
+            uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - t0;
+            samples[count++] = elapsed > overhead ? (uint32_t)(elapsed - overhead) : 0;
+        }
+        bootloader_process_cycle();
+    }
+    
+    qsort(samples, count, sizeof(samples[0]), compare_u32);
+    fprintf(report, "  per byte: median %u ns, p99 %u ns, p99.99 %u ns, max %u ns (%zu samples)\n",
+            samples[count / 2], samples[count * 99 / 100], samples[count * 9999 / 10000],
+            samples[count - 1], count);
+}
+
+// Byte corruption on the line: bad frames are dropped and decoding picks
+// up again at the next delimiter
+static void bench_framer_corruption(double error_rate) {
+    size_t length = build_frame_stream(60);
+    framer_t framer;
+    uint32_t rng = 2024;
+    uint8_t *noisy = malloc(length);
+    
+    bootloader_init();
+    framer_init(&framer, TRANSPORT_UART);
+    for (int round = 0; round < 200; round++) {
+        memcpy(noisy, framer_stream, length);
+        for (size_t i = 0; i < length; i++) {
+            rng = rng * 1103515245u + 12345u;
+            if ((rng >> 8) < error_rate * 16777216.0) {
+                noisy[i] ^= (uint8_t)(1u << ((rng >> 4) & 7));
+            }
+        }
+        framer_feed(&framer, noisy, length);
+        bootloader_process_cycle();
+    }
+    free(noisy);
+    
+    uint32_t total = FRAMER_STREAM_FRAMES * 200;
+    fprintf(report, "  byte error rate %5.3f%%: %5u/%u frames ok, %4u CRC errors, %4u framing errors\n",
+            error_rate * 100.0, framer.frames_ok, total, framer.crc_errors, framer.framing_errors);
+}
+
+// Goodput of a DFU over ISO-TP on a CAN-FD bus for a device block size
+static void bench_isotp(uint32_t data_bitrate, uint8_t block_size, uint8_t st_min) {
+    can_bus_config_t bus = { .nominal_bitrate = 500000, .data_bitrate = data_bitrate,
+                             .block_size = block_size, .st_min = st_min };
+    link_config_t link = { .seed = 59, .transport = TRANSPORT_CAN, .can = &bus };
+    dfu_host_config_t host = { .image_size = 64 * 1024, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 50000 };
+    dfu_transfer_result_t result;
+    link_sim_run_dfu(&link, &host, &result);
+    
+    fprintf(report, "  %u Mbit/s, BS %2u, STmin 0x%02X: %-8s %7.1f KiB/s   %5u frames   %5u FC\n",
+            data_bitrate / 1000000, block_size, st_min,
+            result.completed ? "ok" : (result.recovery_entered ? "RECOVERY" : "FAILED"),
+            result.goodput_kib_s, result.can_frames, result.flow_controls);
+}
+
+// Updating a fleet on one shared bus: a device at a time over unicast, or
+// one multicast pass plus repair rounds. Data is paced to what a device
+// can program, so both are flash-bound per device.
+static void bench_fleet(int devices, double loss_rate) {
+    fleet_config_t fleet = { .devices = devices, .image_size = 32 * 1024, .loss_rate = loss_rate,
+                             .seed = 60, .packet_interval_us = 2300 };
+    dfu_host_config_t host = { .image_size = fleet.image_size, .window = BUFFER_SIZE,
+                               .use_credits = true, .retransmit_timeout_us = 20000 };
+    fleet_result_t unicast, multicast;
+    fleet_sim_run_unicast(&fleet, &host, &unicast);
+    fleet_sim_run_multicast(&fleet, &multicast);
+    
+    fprintf(report, "  %3d devices: unicast %6.2f s (%3d ok)   multicast %5.2f s (%3d ok)   %5.1fx"
+            "   %4u repairs in %u rounds, %u gap queries\n",
+            devices, unicast.seconds, unicast.devices_updated, multicast.seconds,
+            multicast.devices_updated, unicast.seconds / multicast.seconds,
+            multicast.repair_packets, multicast.repair_rounds, multicast.gap_queries);
+}
+
+// The whole host <-> device path: dfu_flash's host end against a device
+// process, over a socketpair byte stream or a shared-memory link
+static void bench_host_link(bool shared_memory, uint32_t flash_time_us) {
+    static uint8_t image[HOST_LINK_IMAGE_SIZE];
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 7);
+    }
+    
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/bench_link_%d", (int)getpid());
+    shm_link_t *shm = NULL;
+    int pair[2] = { -1, -1 };
+    if (shared_memory ? (shm = shm_link_create(path)) == NULL :
+                        socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        fprintf(report, "  link setup failed\n");
+        return;
+    }
+    
+    pid_t device = fork();
+    if (device == 0) {
+        platform_set_flash_time_us(flash_time_us);
+        if (shm) {
+            device_sim_serve_shm(shm);
+        } else {
+            close(pair[0]);
+            device_sim_start();
+            device_sim_serve(pair[1], pair[1]);
+        }
+        device_sim_stop();
+        _exit(0);
+    }
+    
+    static host_link_t link;
+    host_flash_options_t options = { BUFFER_SIZE, 50000, 10, 0x1234 };
+    if (shm) {
+        shm_link_t *host_shm = shm_link_attach(path);
+        unlink(path);
+        if (!host_shm) {
+            fprintf(report, "  shared-memory link unavailable\n");
+            kill(device, SIGKILL);
+            waitpid(device, NULL, 0);
+            return;
+        }
+        host_link_init_shm(&link, host_shm);
+    } else {
+        close(pair[1]);
+        host_link_init_stream(&link, pair[0]);
+    }
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    bool flashed = host_link_flash(&link, image, sizeof(image), &options);
+    double seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    if (shm) {
+        shm_link_detach(link.shm);
+        shm_link_detach(shm); // The mapping the device inherited
+    } else {
+        close(pair[0]);
+    }
+    waitpid(device, NULL, 0);
+    
+    fprintf(report, "  %-14s flash %4u us: %-9s %9.0f packets/s %9.1f KiB/s  %u retx\n",
+            shared_memory ? "shared memory" : "socketpair", flash_time_us,
+            flashed ? "ok" : "FAILED", link.packets_sent / seconds,
+            sizeof(image) / 1024.0 / seconds, link.retransmissions);
+}
+
+// Gang flashing: one host thread, one epoll loop, many device processes
+// each on its own socketpair, all fed from the same image
+static void bench_gang(int devices, uint32_t flash_time_us) {
+    static uint8_t image[GANG_IMAGE_SIZE];
+    static host_link_t links[GANG_MAX_DEVICES];
+    pid_t pids[GANG_MAX_DEVICES];
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 13);
+    }
+    
+    for (int i = 0; i < devices; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            fprintf(report, "  link setup failed\n");
+            return;
+        }
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(pair[0]);
+            for (int j = 0; j < i; j++) {
+                close(links[j].fd);
+            }
+            platform_set_flash_time_us(flash_time_us);
+            device_sim_start();
+            device_sim_serve(pair[1], pair[1]);
+            device_sim_stop();
+            _exit(0);
+        }
+        close(pair[1]);
+        host_link_init_stream(&links[i], pair[0]);
+    }
+    
+    host_flash_options_t options = { BUFFER_SIZE, 50000, 10, 0x1234 };
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    bool flashed = host_link_flash_all(links, devices, image, sizeof(image), &options);
+    double seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    uint32_t completion_us[GANG_MAX_DEVICES];
+    uint32_t retransmissions = 0;
+    for (int i = 0; i < devices; i++) {
+        close(links[i].fd);
+        completion_us[i] = links[i].finished_at - links[i].started_at;
+        retransmissions += links[i].retransmissions;
+    }
+    for (int i = 0; i < devices; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+    qsort(completion_us, devices, sizeof(completion_us[0]), compare_u32);
+    
+    fprintf(report, "  %2d devices, flash %4u us: %-6s %7.2f MB/s total   per device"
+            " min %6.3f / median %6.3f / max %6.3f s  %u retx\n",
+            devices, flash_time_us, flashed ? "ok" : "FAILED",
+            (double)sizeof(image) * devices / 1e6 / seconds, completion_us[0] / 1e6,
+            completion_us[devices / 2] / 1e6, completion_us[devices - 1] / 1e6, retransmissions);
+}
+
+// Weak flash cells flip a bit in some writes. With the page CRC table only
+// the bad pages are sent again; without it a whole session must be, until
+// one programs clean - each does with probability (1 - rate)^writes.
+static void bench_page_repair(double fault_rate) {
+    static uint8_t image[HOST_LINK_IMAGE_SIZE];
+    static uint32_t page_crcs[HOST_LINK_IMAGE_SIZE / FLASH_PAGE_SIZE];
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 29 + (i >> 11));
+    }
+    for (uint32_t page = 0; page < sizeof(page_crcs) / sizeof(page_crcs[0]); page++) {
+        page_crcs[page] = crc32_update(0, &image[page * FLASH_PAGE_SIZE], FLASH_PAGE_SIZE);
+    }
+    
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        fprintf(report, "  link setup failed\n");
+        return;
+    }
+    pid_t device = fork();
+    if (device == 0) {
+        close(pair[0]);
+        platform_set_flash_time_us(0);
+        platform_set_flash_fault_rate(fault_rate);
+        device_sim_start();
+        device_sim_serve(pair[1], pair[1]);
+        device_sim_stop();
+        _exit(0);
+    }
+    close(pair[1]);
+    
+    static host_link_t link;
+    host_link_init_stream(&link, pair[0]);
+    host_flash_options_t options = { BUFFER_SIZE, 50000, 10, 0x1234, page_crcs };
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    bool flashed = host_link_flash(&link, image, sizeof(image), &options);
+    double seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    close(pair[0]);
+    waitpid(device, NULL, 0);
+    
+    uint64_t session_bytes = link.bytes_out - link.repair_bytes_out;
+    uint32_t writes = (sizeof(image) + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    double clean = 1.0;
+    for (uint32_t i = 0; i < writes; i++) {
+        clean *= 1.0 - fault_rate;
+    }
+    double full_sessions = 1.0 / clean;
+    fprintf(report, "  %.4f faults/write: %-6s %6.3f s  %3u repairs, %8.1f KiB resent"
+            " | full re-download: %8.1f sessions, %10.1f KiB resent\n",
+            fault_rate, flashed ? "ok" : "FAILED", seconds, link.repair_sessions,
+            link.repair_bytes_out / 1024.0, full_sessions,
+            (full_sessions - 1) * session_bytes / 1024.0);
+}
+
+static uint8_t scrub_acked_seq;
+
+static void record_scrub_ack(transport_t transport, const uint8_t *frame, size_t length,
+                             void *ctx) {
+    (void)transport;
+    (void)ctx;
+    if (length >= 3 && frame[0] == RSP_ACK) {
+        scrub_acked_seq = frame[2];
+    }
+}
+
+// Scrubs a 1 MiB image in flash from the idle loop, a budget of time per
+// cycle, against what a launch costs if it reads the image itself
+static void bench_idle_scrub(uint32_t budget_us) {
+    const uint32_t size = MAX_APPLICATION_SIZE;
+    bootloader_init();
+    bootloader_set_scrub(0, 0);
+    platform_set_flash_time_us(0);
+    platform_set_response_hook(record_scrub_ack, NULL);
+    uint8_t packet[MAX_PACKET_SIZE] = {0x00, PKT_START_SESSION, (uint8_t)(size >> 24),
+                                       (uint8_t)(size >> 16), (uint8_t)(size >> 8),
+                                       (uint8_t)size, 0x12, 0x34};
+    bootloader_receive_packet(packet, 8);
+    bootloader_process_cycle();
+    bootloader_stats_t stats;
+    uint32_t seq = 1;
+    for (uint32_t offset = 0; offset < size; offset += MAX_PAYLOAD_SIZE, seq++) {
+        packet[0] = (uint8_t)seq;
+        packet[1] = PKT_DATA;
+        for (uint32_t i = 0; i < MAX_PAYLOAD_SIZE; i++) {
+            packet[2 + i] = (uint8_t)((offset + i) * 13 + (offset >> 12));
+        }
+        bootloader_receive_packet(packet, MAX_PACKET_SIZE);
+        do {
+            bootloader_process_cycle(); // ACKed once its slot is free again
+        } while (scrub_acked_seq != (uint8_t)seq);
+    }
+    uint8_t end[] = {(uint8_t)seq, PKT_END_SESSION};
+    bootloader_receive_packet(end, sizeof(end));
+    do {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+    } while (stats.app_launch_attempts == 0 || stats.state != STATE_IDLE);
+    
+    // The first pass records the page CRCs, the second checks against
+    // them and the third finds a bit flipped in between
+    bootloader_set_scrub(budget_us, 0);
+    uint32_t cycles = 0;
+    uint64_t longest_ns = 0, total_ns = 0;
+    for (uint32_t pass = 1; pass <= 3; pass++) {
+        if (pass == 3) {
+            platform_flip_flash_bit(APPLICATION_START + size / 2, 5);
+        }
+        do {
+            uint64_t start = clock_ns(CLOCK_MONOTONIC);
+            bootloader_process_cycle();
+            uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+            if (pass == 2) {
+                cycles++;
+                total_ns += elapsed;
+                longest_ns = elapsed > longest_ns ? elapsed : longest_ns;
+            }
+            bootloader_get_stats(&stats);
+        } while (stats.scrub_passes < pass);
+    }
+    
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    volatile uint32_t crc = crc32_update(0, flash_memory_at(APPLICATION_START), size);
+    (void)crc;
+    uint64_t launch_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    fprintf(report, "  %4u us/cycle: pass in %5u cycles, %6.2f ms, longest cycle %6.1f us"
+            " | bit flip found: %-3s | launch reading the image: %.2f ms\n",
+            budget_us, cycles, total_ns / 1e6, longest_ns / 1e3,
+            stats.bad_pages == 1 ? "yes" : "NO", launch_ns / 1e6);
+    platform_set_response_hook(NULL, NULL);
+    platform_set_flash_time_us(2000);
+}
+
+// Packs a 1 MiB image laid out like firmware - code, erased gaps, zeroed
+// data - then checks every chunk of the container, as dfu_flash does
+static void bench_image_pack(int threads) {
+    static uint8_t image[MAX_APPLICATION_SIZE];
+    static uint8_t container[IMAGE_MAX_CONTAINER_SIZE];
+    static uint8_t chunk[IMAGE_CHUNK_SIZE];
+    uint32_t x = 12345;
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        uint32_t region = i / (64 * 1024) % 8;
+        x = x * 1103515245u + 12345u;
+        image[i] = region < 5 ? (uint8_t)(x >> 16) : region < 7 ? 0xFF : 0x00;
+    }
+    
+    image_pack_options_t options = { threads, true };
+    image_pack_stats_t stats;
+    const int runs = 10;
+    size_t length = 0;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    for (int run = 0; run < runs; run++) {
+        length = image_pack(image, sizeof(image), container, &options, &stats);
+    }
+    double pack_seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9 / runs;
+    
+    image_header_t header;
+    bool intact = image_read_header(container, length, &header);
+    start = clock_ns(CLOCK_MONOTONIC);
+    for (int run = 0; run < runs && intact; run++) {
+        for (uint32_t i = 0; i < header.chunk_count && intact; i++) {
+            intact = image_unpack_chunk(container, length, &header, i, chunk) > 0;
+        }
+    }
+    double unpack_seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9 / runs;
+    
+    fprintf(report, "  %d thread(s): pack %7.1f MB/s, check+unpack %7.1f MB/s  %4.1f%% of the image"
+            " (%u RLE, %u erased chunks) %s\n",
+            threads, sizeof(image) / 1e6 / pack_seconds, sizeof(image) / 1e6 / unpack_seconds,
+            length * 100.0 / sizeof(image), stats.chunks_rle, stats.chunks_erased,
+            intact ? "ok" : "DAMAGED");
+}
+
+// Appends one record with its checksum: Intel HEX, or an S3 record
+static size_t format_record(char *out, bool srec, uint32_t address, uint8_t type,
+                            const uint8_t *data, int length) {
+    uint8_t bytes[4 + 255];
+    int count = 0;
+    if (srec) {
+        bytes[count++] = (uint8_t)(length + 5);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            bytes[count++] = (uint8_t)(address >> shift);
+        }
+    } else {
+        bytes[count++] = (uint8_t)length;
+        bytes[count++] = (uint8_t)(address >> 8);
+        bytes[count++] = (uint8_t)address;
+        bytes[count++] = type;
+    }
+    memcpy(&bytes[count], data, length);
+    count += length;
+    uint8_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += bytes[i];
+    }
+    size_t written = (size_t)sprintf(out, srec ? "S3" : ":");
+    for (int i = 0; i < count; i++) {
+        written += (size_t)sprintf(&out[written], "%02X", bytes[i]);
+    }
+    return written + (size_t)sprintf(&out[written], "%02X\r\n",
+                                     (uint8_t)(srec ? ~sum : -sum));
+}
+
+// A 1 MiB application area, two thirds of it loaded in 32-byte records
+// with a hole after every 64 KiB region, as build tools write them
+static void bench_image_load(bool srec) {
+    static char text[4 * MAX_APPLICATION_SIZE];
+    static image_load_t load;
+    size_t length = 0;
+    uint32_t x = 777;
+    uint32_t upper = 0xFFFFFFFFu;
+    for (uint32_t offset = 0; offset < MAX_APPLICATION_SIZE; offset += 32) {
+        if (offset / (64 * 1024) % 3 == 2) {
+            continue;
+        }
+        uint32_t address = APPLICATION_START + offset;
+        if (!srec && address >> 16 != upper) {
+            upper = address >> 16;
+            uint8_t base[2] = { (uint8_t)(upper >> 8), (uint8_t)upper };
+            length += format_record(&text[length], false, 0, 0x04, base, 2);
+        }
+        uint8_t data[32];
+        for (int i = 0; i < 32; i++) {
+            x = x * 1103515245u + 12345u;
+            data[i] = (uint8_t)(x >> 16);
+        }
+        length += format_record(&text[length], srec, address, 0x00, data, 32);
+    }
+    length += srec ? (size_t)sprintf(&text[length], "S7050800800072\r\n") :
+                     (size_t)sprintf(&text[length], ":00000001FF\r\n");
+    
+    const int runs = 10;
+    bool ok = true;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    for (int run = 0; run < runs; run++) {
+        ok = ok && image_load((const uint8_t *)text, length, &load);
+    }
+    double seconds = (clock_ns(CLOCK_MONOTONIC) - start) / 1e9 / runs;
+    fprintf(report, "  %-9s %5.2f MB of text: %6.1f MB/s, %.2f ms  %u bytes in %u regions %s\n",
+            srec ? "S-records" : "Intel HEX", length / 1e6, length / 1e6 / seconds,
+            seconds * 1e3, load.loaded, load.region_count, ok ? "ok" : load.error);
+}
+
+// Application, config and co-processor images: one session per region vs
+// one manifest session over all three, with and without erase-ahead
+static void bench_multi_region(uint32_t bitrate, bool one_session, bool erase_ahead) {
+    static const dfu_region_t regions[] = {
+        { REGION_COPROCESSOR, 64 * 1024 },
+        { REGION_CONFIG, 16 * 1024 },
+        { REGION_APPLICATION, 128 * 1024 },
+    };
+    link_config_t link = { .seed = 75, .bitrate = bitrate, .erase_on_demand = !erase_ahead };
+    dfu_host_config_t host = { .window = BUFFER_SIZE, .use_credits = true,
+                               .retransmit_timeout_us = 50000 };
+    uint32_t bytes = 0, erased_ahead = 0, sessions = one_session ? 1 : 3;
+    double seconds = 0.0;
+    bool completed = true;
+    for (uint32_t i = 0; i < sessions; i++) {
+        host.regions = one_session ? regions : &regions[i];
+        host.region_count = one_session ? 3 : 1;
+        dfu_transfer_result_t result;
+        link_sim_run_dfu(&link, &host, &result);
+        bootloader_stats_t stats;
+        bootloader_get_stats(&stats);
+        completed &= result.completed;
+        seconds += result.seconds;
+        erased_ahead += stats.pages_erased_ahead;
+        for (uint8_t r = 0; r < host.region_count; r++) {
+            bytes += host.regions[r].size;
+        }
+    }
+    char link_label[16] = "unlimited";
+    if (bitrate) {
+        snprintf(link_label, sizeof(link_label), "%u kbit/s", bitrate / 1000);
+    }
+    fprintf(report, "  %-12s %-20s %-12s %-6s %7.3f s  goodput %7.1f KiB/s  pages erased ahead %3u\n",
+            link_label, one_session ? "one 3-region session" : "3 sessions",
+            erase_ahead ? "erase-ahead" : "on demand", completed ? "ok" : "FAILED",
+            seconds, seconds > 0 ? bytes / 1024.0 / seconds : 0.0, erased_ahead);
+}
+
+int main(void) {
+    report = stdout;
+    setvbuf(report, NULL, _IOLBF, 0);
+
+    fprintf(report, "========================================\n");
+    fprintf(report, "  Bootloader Benchmarks\n");
+    fprintf(report, "========================================\n\n");
+
+    fprintf(report, "=== Idle CPU: poll loop vs bootloader_run() ===\n");
+    bench_idle("IDLE state", false);
+    bench_idle("DFU session open, waiting for data", true);
+    fprintf(report, "\n");
+
+    fprintf(report, "=== Control lane latency under data load ===\n");
+    bench_control_latency(BUFFER_SIZE - 1);
+    bench_control_latency(BUFFER_SIZE);
+    fprintf(report, "\n");
+
+    fprintf(report, "=== Packet dispatch (mixed control/data stream) ===\n");
+    bench_dispatch();
+    bench_dispatch();
+    bench_dispatch();
+    fprintf(report, "\n");
+
+    fprintf(report, "=== Credit-based flow control (64 KiB image, lossless link) ===\n");
+    bench_credit_flow_control();
+    fprintf(report, "\n");
+
+    fprintf(report, "=== Lossy link (64 KiB image, window %d with credits) ===\n", BUFFER_SIZE);
+    bench_lossy_link();
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== COBS framer (%d-byte data frames) ===\n", MAX_PACKET_SIZE);
+    bench_framer_throughput(1);
+    bench_framer_throughput(64);
+    bench_framer_throughput(sizeof(framer_stream));
+    bench_framer_per_byte();
+    bench_framer_corruption(0.0001);
+    bench_framer_corruption(0.001);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== ISO-TP over CAN-FD (64 KiB image, 500 kbit/s arbitration) ===\n");
+    const uint8_t block_sizes[] = { 1, 2, 4, 8, 16, 0 };
+    for (size_t i = 0; i < sizeof(block_sizes); i++) {
+        bench_isotp(1000000, block_sizes[i], 0);
+    }
+    bench_isotp(1000000, 0, 0xF5);
+    bench_isotp(2000000, 1, 0);
+    bench_isotp(2000000, 0, 0);
+    bench_isotp(5000000, 0, 0);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Fleet update: sequential unicast vs multicast (32 KiB image) ===\n");
+    fprintf(report, " 1%% frame loss per device:\n");
+    bench_fleet(4, 0.01);
+    bench_fleet(16, 0.01);
+    bench_fleet(64, 0.01);
+    fprintf(report, " 5%% frame loss per device:\n");
+    bench_fleet(16, 0.05);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== FEC on a lossy 250 kbit/s link (32 KiB image) ===\n");
+    const double fec_loss_rates[] = { 0.01, 0.05, 0.10 };
+    for (size_t i = 0; i < sizeof(fec_loss_rates) / sizeof(fec_loss_rates[0]); i++) {
+        for (uint8_t parity = 0; parity <= 3; parity++) {
+            bench_fec(fec_loss_rates[i], parity);
+        }
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== ACK coalescing on a half-duplex link (64 KiB image) ===\n");
+    const uint32_t ack_bitrates[] = { 250000, 1000000 };
+    for (size_t i = 0; i < sizeof(ack_bitrates) / sizeof(ack_bitrates[0]); i++) {
+        for (int lossy = 0; lossy <= 1; lossy++) {
+            bench_ack_coalescing(ack_bitrates[i], lossy ? 0.01 : 0.0, true);
+            bench_ack_coalescing(ack_bitrates[i], lossy ? 0.01 : 0.0, false);
+        }
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Host link: byte stream vs shared memory (%d KiB image) ===\n",
+            HOST_LINK_IMAGE_SIZE / 1024);
+    for (int run = 0; run < 3; run++) {
+        bench_host_link(false, 0);
+        bench_host_link(true, 0);
+    }
+    bench_host_link(false, 2000);
+    bench_host_link(true, 2000);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Gang flashing from one epoll loop (%d KiB image) ===\n",
+            GANG_IMAGE_SIZE / 1024);
+    const int gang_sizes[] = { 1, 4, 16, 64 };
+    for (int flash = 0; flash <= 1; flash++) {
+        for (size_t i = 0; i < sizeof(gang_sizes) / sizeof(gang_sizes[0]); i++) {
+            bench_gang(gang_sizes[i], flash ? 2000 : 0);
+        }
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Bad pages rewritten vs full re-download (%d KiB image) ===\n",
+            HOST_LINK_IMAGE_SIZE / 1024);
+    const double fault_rates[] = { 0.0001, 0.001, 0.003, 0.01 };
+    for (size_t i = 0; i < sizeof(fault_rates) / sizeof(fault_rates[0]); i++) {
+        bench_page_repair(fault_rates[i]);
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Idle scrub (1 MiB image) ===\n");
+    const uint32_t scrub_budgets[] = { 10, 50, 200 };
+    for (size_t i = 0; i < sizeof(scrub_budgets) / sizeof(scrub_budgets[0]); i++) {
+        bench_idle_scrub(scrub_budgets[i]);
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== RX arena vs fixed slots (mixed traffic, %zu vs %d bytes per transport) ===\n",
+            sizeof(fixed_rx_slot_t) * BUFFER_SIZE, RX_ARENA_SIZE);
+    const uint32_t mean_bursts[] = { 8, 16, 32, 64 };
+    for (size_t i = 0; i < sizeof(mean_bursts) / sizeof(mean_bursts[0]); i++) {
+        bench_rx_arena(mean_bursts[i], true);
+        bench_rx_arena(mean_bursts[i], false);
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Image container packaging (1 MiB image, %d-byte chunks) ===\n",
+            IMAGE_CHUNK_SIZE);
+    bench_image_pack(1);
+    bench_image_pack(2);
+    bench_image_pack(4);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Build output to sparse image (1 MiB application area) ===\n");
+    bench_image_load(false);
+    bench_image_load(true);
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Two-thread ingress: producer on USB, bootloader_run() draining ===\n");
+    bench_ingress_cache();
+    bench_ingress_cache();
+    bench_ingress_cache();
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Multi-transport stress (64 KiB session on UART) ===\n");
+    for (int flooders = 0; flooders < TRANSPORT_COUNT; flooders++) {
+        bench_multi_transport(flooders);
+    }
+    fprintf(report, "\n");
+    
+    fprintf(report, "=== Multi-region update: 128 KiB app + 16 KiB config + 64 KiB co-processor ===\n");
+    const uint32_t region_bitrates[] = { 0, 1000000 };
+    for (size_t i = 0; i < sizeof(region_bitrates) / sizeof(region_bitrates[0]); i++) {
+        for (int one_session = 0; one_session <= 1; one_session++) {
+            bench_multi_region(region_bitrates[i], one_session, false);
+            bench_multi_region(region_bitrates[i], one_session, true);
+        }
+    }
+    fprintf(report, "\n");
+
+    return 0;
+}
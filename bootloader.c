@@ -1,7 +1,25 @@
 #include "bootloader.h"
+#include "crc32.h"
+#include "merkle.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+
+#define FLASH_PAGE_COUNT (MAX_APPLICATION_SIZE / FLASH_PAGE_SIZE)
+#define REGION_PAGE_COUNT ((COPROCESSOR_START + COPROCESSOR_SIZE - APPLICATION_START) / FLASH_PAGE_SIZE)
+#define TX_QUEUE_SIZE 8
+#define TX_RETRY_US 100 // Poll interval while responses wait for a busy line
+#define SCRUB_SLICE 256 // Bytes re-read between checks of the scrub budget
+#define CACHE_LINE_SIZE 64
+
+// Starts a field or variable on a cache line. Where the compiler has no
+// way to say so, the layout still holds; only the padding is lost.
+#if defined(__GNUC__) || defined(__clang__)
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define CACHE_ALIGNED
+#endif
 
 // Application validation result
 typedef struct {
@@ -11,35 +29,208 @@ typedef struct {
     uint32_t size;
 } app_validation_t;
 
+// A packet in its transport's RX arena. Records start on a word, so the
+// payload after the 2-byte header is word-aligned and the flash controller
+// can program straight out of the record.
+typedef struct {
+    uint16_t length;  // Packet bytes
+    uint16_t size;    // Record bytes: header, packet and padding
+    bool valid;  // Record occupied, from receipt until released
+    bool held;   // Processed, but its payload is still being programmed
+    uint8_t data[];
+} packet_t;
+
+typedef char packet_payload_word_aligned[
+    offsetof(packet_t, data) == RX_RECORD_HEADER &&
+    (RX_RECORD_HEADER + PACKET_HEADER_SIZE) % 4 == 0 ? 1 : -1];
+
+// Flash write accepted but not yet handed to the flash controller.
+// The payload stays in its ring slot, or in the staging buffer if it is not
+// a whole number of words.
+typedef struct {
+    uint32_t address;
+    const uint8_t *data;
+    size_t length;
+    packet_t *slot;         // Slot to release on completion, NULL if staged
+    uint32_t erase_address; // First page to erase before writing
+    uint8_t erase_pages;    // Pages to erase from there, 0 if none
+} pending_write_t;
+
+// How the data lane treats a transport's packets: the state, refined by
+// the kind of session and whether the transport owns it
+typedef enum {
+    DISPATCH_IDLE = 0,
+    DISPATCH_DFU,        // Unicast session, on its own transport
+    DISPATCH_MULTICAST,  // Multicast session, on its own transport
+    DISPATCH_FOREIGN,    // Session traffic from another transport
+    DISPATCH_RECOVERY,
+    DISPATCH_BLOCKED,    // DFU_VERIFY, RUNNING_APP and ERROR
+    DISPATCH_MODE_COUNT
+} dispatch_mode_t;
+
+// Where each region lives: its partition
+static const struct {
+    uint32_t start;
+    uint32_t size;
+} region_map[REGION_COUNT] = {
+    [REGION_APPLICATION] = { APPLICATION_START, MAX_APPLICATION_SIZE },
+    [REGION_CONFIG] = { CONFIG_START, CONFIG_SIZE },
+    [REGION_COPROCESSOR] = { COPROCESSOR_START, COPROCESSOR_SIZE },
+};
+
+// One region of a manifest session
+typedef struct {
+    uint8_t region;     // region_t
+    uint32_t size;
+    uint32_t crc;       // CRC-32 of its bytes
+    uint32_t received;
+} session_region_t;
+
+// Response waiting for the end of the cycle
+typedef struct {
+    transport_t transport;
+    uint8_t type;      // RSP_ACK, RSP_NACK, RSP_GAPS or RSP_BAD_PAGES
+    uint8_t value;     // NACK: error code; range report: number of ranges
+    uint8_t seq;       // ACK: sequence acknowledged; NACK 0x02: sequence expected
+    bool cumulative;   // Data ACK a later one may replace
+    uint16_t missing;  // Range report: chunks missing or pages bad
+    uint16_t ranges[GAP_REPORT_MAX_RANGES * 2]; // Range report: {first, count} pairs
+} tx_response_t;
+
+// Short control packets (ping, status, abort, emergency reset) that bypass
+// the data FIFO
 typedef struct {
-    uint8_t data[MAX_PACKET_SIZE];
+    uint8_t data[CONTROL_PACKET_SIZE];
     size_t length;
+    uint32_t rx_time;
+    transport_t transport;
     bool valid;
-} packet_t;
+} control_packet_t;
 
-static struct {
-    bootloader_state_t state;
-    bootloader_state_t previous_state;
-    packet_t buffer[BUFFER_SIZE];
-    int head, tail, count;
+// Data FIFO of one transport: records laid end to end in a ring of bytes.
+// A record is only ever reserved whole, so when the room left before the
+// end is too small the ring wraps early and that end lies unused until the
+// records before it are gone. Its receive path is the only producer.
+//
+// The receive path writes only the first cache line and the main loop only
+// the second; occupancy is the difference of their running counts, so
+// under load neither side keeps taking the other's line away. Only a wrap,
+// or an empty queue starting over at 0, writes across: reserve_record()
+// then moves tail, release and wrap with the critical section held, and
+// the main loop holds it too whenever it moves them or reads them against
+// head.
+typedef struct {
+    // Producer
+    uint32_t head CACHE_ALIGNED; // Byte offset of the next record
+    uint32_t received;           // Records committed
+    uint32_t bytes_in;           // Bytes committed, unused ends included
+    uint32_t used_peak;
+    uint32_t last_rx_time;
+    uint32_t packets_dropped;
     
-    // Session management
+    // Consumer
+    uint32_t tail CACHE_ALIGNED; // Next record to process
+    uint32_t release;            // Oldest occupied record; records are freed out of order
+    uint32_t wrap;               // End of the records before a wrap to 0, 0 if none
+    uint32_t processed;          // Records processed
+    uint32_t freed;              // Records released
+    uint32_t bytes_freed;
+} ingress_queue_t;
+
+static uint32_t rx_arenas[TRANSPORT_COUNT][RX_ARENA_SIZE / 4] CACHE_ALIGNED;
+
+static struct bootloader_context {
+    // What every packet reads, on one line of its own
+    bootloader_state_t state CACHE_ALIGNED;
+    uint8_t dispatch_mode[TRANSPORT_COUNT]; // dispatch_mode_t
+    uint8_t next_transport;
+    bool session_active;
+    bool multicast;
+    bool staging_busy;
+    uint8_t seq_errors;      // Since the last packet accepted; too many start recovery
+    transport_t session_transport; // Interface the session was started on
     uint32_t expected_seq;
     uint32_t bytes_received;
     uint32_t total_size;
+    uint32_t session_base;   // Image offset the session's data starts at
+    int write_head, write_tail, write_count;
+    int tx_count;
+    uint32_t acks_deferred;  // Written packets whose ACK waits for their slot...
+    bool staged_ack_deferred; // ...or, behind those, for the staging buffer
+    uint8_t staged_seq;
+    bool flash_staged;       // Flash controller programming from the staging buffer...
+    packet_t *flash_slot;    // ...or from this ring slot
+    
+    // Per-transport data FIFOs, served round-robin
+    ingress_queue_t queues[TRANSPORT_COUNT];
+    
+    // High-priority control lane, drained before the data FIFO
+    control_packet_t control_buffer[CONTROL_BUFFER_SIZE] CACHE_ALIGNED;
+    int control_head, control_tail, control_count;
+    
+    bootloader_state_t previous_state;
+    
+    // Write-behind queue between the data FIFO and the flash controller
+    pending_write_t write_queue[WRITE_QUEUE_SIZE];
+    uint8_t staging[MAX_PAYLOAD_SIZE];
+    bool flash_error;
+    
+    // Session management
     uint32_t expected_crc;
-    bool session_active;
+    bool resync_pending;
+    bool end_acked;          // Last session ended with an ACK, for end_seq
+    uint8_t end_seq;
+    bool resync_deferred;    // Sequence NACK queued behind the deferred ACKs
+    uint8_t erased_pages[REGION_PAGE_COUNT / 8]; // Pages erased this session, from APPLICATION_START
     
-    // Statistics and error tracking
-    uint32_t packets_processed;
-    uint32_t packets_dropped;
-    uint32_t error_count;
-    uint32_t recovery_attempts;
-    uint32_t app_launch_attempts;
+    // Manifest session: the regions are sent one after the other, and erased
+    // ahead of their data whenever the flash controller would be idle
+    session_region_t regions[REGION_COUNT];
+    uint8_t region_count;    // 0 for a plain session
+    uint8_t region_index;    // Region being sent
+    uint8_t erase_index;     // Region being erased ahead...
+    uint32_t erase_offset;   // ...from this offset
+    bool erase_ahead;
+    
+    // Per-page CRCs of the image, each page checked as soon as it is
+    // programmed; a repair session rewrites a run of the pages that failed
+    uint32_t image_size;
+    uint32_t page_crcs[FLASH_PAGE_COUNT];
+    uint8_t page_crc_map[FLASH_PAGE_COUNT / 8];
+    uint32_t page_crcs_received;
+    uint32_t page_root;      // Merkle root the table must match (merkle.h)
+    bool has_page_root;
+    uint8_t pages_checked[FLASH_PAGE_COUNT / 8];
+    uint8_t bad_pages[FLASH_PAGE_COUNT / 8];
+    uint32_t bad_page_count;
+    bool repair_pending;     // Last session ended with bad pages
+    uint32_t flash_end;      // Address after the write being programmed
+    
+    // Idle scrub of the image that last validated: one pass re-reads it a
+    // slice at a time, a page CRC per page
+    uint32_t scrub_size;     // 0 until an image validates, and once rewritten
+    uint32_t scrub_offset;   // Next byte of the pass under way
+    uint32_t scrub_crc;      // Of the page being read, so far
+    bool scrub_running;
+    bool scrub_fresh;        // A pass has finished since the image validated
+    uint32_t scrub_pass_time; // ...at this tick
+    uint32_t scrub_budget_us;
+    uint32_t scrub_interval_ms;
+    
+    // Multicast session: data arrives in any order, so track it per chunk
+    uint8_t node_id;
+    uint8_t chunk_map[(MULTICAST_MAX_CHUNKS + 7) / 8];
+    uint32_t chunk_count;
+    uint32_t chunks_received;
+    
+    // Responses are queued by the handlers and sent once per cycle, so a
+    // run of data ACKs goes out as one cumulative ACK
+    tx_response_t tx_queue[TX_QUEUE_SIZE];
+    bool ack_coalescing;
+    bool fixed_rx_slots;     // Every record full-size, as packet-sized slots were
     
     // Timeouts and watchdogs
-    uint32_t state_entry_time;
-    uint32_t last_activity_time;
+    uint32_t state_entry_time;  // Activity is each queue's last_rx_time
     uint32_t session_timeout_ms;
     uint32_t app_validation_timeout_ms;
     
@@ -47,30 +238,119 @@ static struct {
     app_validation_t app_validation;
     bool force_bootloader_mode;
     
+    // Event-driven main loop
+    volatile bool run_requested;
+    
+    // Statistics and error tracking, apart from the fields they count
+    struct {
+        uint32_t packets_processed CACHE_ALIGNED;
+        uint32_t packets_dropped;
+        uint32_t error_count;
+        uint32_t recovery_attempts;
+        uint32_t app_launch_attempts;
+        uint32_t control_packets;
+        uint32_t control_latency_max_us;
+        uint64_t control_latency_total_us;
+        uint32_t duplicate_packets;
+        uint32_t responses_sent;
+        uint32_t acks_coalesced;
+        uint32_t scrub_passes;
+        uint32_t scrub_bytes;
+        uint32_t pages_erased_ahead;
+        uint32_t wakeups;
+    } stats;
 } bootloader = {0};
 
+typedef char hot_fields_fit_one_line[
+    offsetof(struct bootloader_context, queues) == CACHE_LINE_SIZE ? 1 : -1];
+
 // Forward declarations
 static void enter_state(bootloader_state_t new_state);
 static bool validate_state_transition(bootloader_state_t from, bootloader_state_t to);
 static void handle_timeout_checks(void);
 static bool validate_application(void);
 static void handle_emergency_condition(void);
-static void handle_idle_packet(packet_t *pkt, uint8_t seq, uint8_t packet_type);
-static void handle_dfu_packet(packet_t *pkt, uint8_t seq, uint8_t packet_type);
+static void update_dispatch_modes(void);
+static void on_start_session(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_multicast_start(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_data(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_control(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_end_session(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_jump_app(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_gap_query(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_multicast_data(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_page_crcs(transport_t transport, packet_t *pkt, uint8_t seq);
+static void on_repair_start(transport_t transport, packet_t *pkt, uint8_t seq);
+static uint32_t next_event_timeout_us(void);
+static bool is_control_packet(uint8_t packet_type);
+static bool receive_control_packet(transport_t transport, const uint8_t *data, size_t length);
+static void record_dropped_packet(transport_t transport);
+static void process_control_lane(void);
+static bool process_ingress_packet(transport_t transport);
+static void handle_control_packet(transport_t transport, uint8_t seq, uint8_t packet_type);
+static void run_cycle(void);
+static void send_ack(transport_t transport, uint8_t seq);
+static void send_data_ack(transport_t transport, uint8_t seq);
+static void send_nack(transport_t transport, uint8_t error_code);
+static void send_seq_nack(transport_t transport, uint8_t expected_seq);
+static void flush_responses(bool force);
+static void send_deferred_ack(uint8_t seq);
+static bool data_lane_blocked(transport_t transport);
+static bool is_duplicate_seq(uint8_t seq);
+static void queue_flash_write(uint32_t address, packet_t *pkt, size_t payload_offset);
+static void service_write_queue(void);
+static void discard_write_queue(void);
+static void release_slot(packet_t *pkt);
+static void page_programmed(uint32_t end);
+static void scrub_step(void);
+static void stop_scrub(void);
 
 void bootloader_init(void) {
     memset(&bootloader, 0, sizeof(bootloader));
+    memset(rx_arenas, 0, sizeof(rx_arenas));
     bootloader.session_timeout_ms = 30000; // 30 seconds
     bootloader.app_validation_timeout_ms = 5000; // 5 seconds
     bootloader.force_bootloader_mode = false;
+    bootloader.ack_coalescing = true;
+    bootloader.erase_ahead = true;
+    bootloader.scrub_budget_us = SCRUB_BUDGET_US;
+    bootloader.scrub_interval_ms = SCRUB_INTERVAL_MS;
     
     enter_state(STATE_IDLE);
-    printf("[BOOT] Advanced bootloader initialized (v1.2.0)\n");
+    BOOT_LOG("[BOOT] Advanced bootloader initialized (v1.2.0)\n");
+}
+
+// Call after bootloader_init()
+void bootloader_set_node_id(uint8_t node_id) {
+    bootloader.node_id = node_id;
+}
+
+// Call after bootloader_init(); off sends one ACK per packet
+void bootloader_set_ack_coalescing(bool enabled) {
+    bootloader.ack_coalescing = enabled;
+}
+
+// Call after bootloader_init(); on makes every packet take a full-size
+// record, the baseline the arena is measured against
+void bootloader_set_fixed_rx_slots(bool enabled) {
+    bootloader.fixed_rx_slots = enabled;
+}
+
+// Call after bootloader_init(); off leaves every page to be erased by the
+// first write into it, the baseline erase-ahead is measured against
+void bootloader_set_erase_ahead(bool enabled) {
+    bootloader.erase_ahead = enabled;
+}
+
+// Call after bootloader_init(); a budget of 0 turns the scrub off
+void bootloader_set_scrub(uint32_t budget_us, uint32_t interval_ms) {
+    bootloader.scrub_budget_us = budget_us;
+    bootloader.scrub_interval_ms = interval_ms;
 }
 
 static void enter_state(bootloader_state_t new_state) {
     if (!validate_state_transition(bootloader.state, new_state)) {
-        printf("[BOOT] ERROR: Invalid state transition %d -> %d\n", bootloader.state, new_state);
+        BOOT_LOG("[BOOT] ERROR: Invalid state transition %d -> %d\n", bootloader.state, new_state);
         enter_state(STATE_ERROR);
         return;
     }
@@ -82,36 +362,69 @@ static void enter_state(bootloader_state_t new_state) {
     // State entry actions
     switch (new_state) {
         case STATE_IDLE:
-            printf("[BOOT] Entered IDLE state\n");
+            BOOT_LOG("[BOOT] Entered IDLE state\n");
             bootloader.session_active = false;
+            bootloader.resync_pending = false;
+            bootloader.seq_errors = 0;
+            bootloader.acks_deferred = 0;
+            bootloader.staged_ack_deferred = false;
+            bootloader.resync_deferred = false;
+            bootloader.multicast = false;
+            discard_write_queue();
+            bootloader.flash_error = false;
             bootloader.expected_seq = 0;
             bootloader.bytes_received = 0;
             break;
             
         case STATE_DFU_ACTIVE:
-            printf("[BOOT] Entered DFU_ACTIVE state\n");
+            BOOT_LOG("[BOOT] Entered DFU_ACTIVE state\n");
             break;
             
         case STATE_DFU_VERIFY:
-            printf("[BOOT] Entered DFU_VERIFY state - validating application\n");
+            BOOT_LOG("[BOOT] Entered DFU_VERIFY state - validating application\n");
             break;
             
         case STATE_RUNNING_APP:
-            printf("[BOOT] Entered RUNNING_APP state - launching application\n");
-            bootloader.app_launch_attempts++;
+            BOOT_LOG("[BOOT] Entered RUNNING_APP state - launching application\n");
+            bootloader.stats.app_launch_attempts++;
             break;
             
         case STATE_EMERGENCY_RECOVERY:
-            printf("[BOOT] Entered EMERGENCY_RECOVERY state\n");
-            bootloader.recovery_attempts++;
+            BOOT_LOG("[BOOT] Entered EMERGENCY_RECOVERY state\n");
+            bootloader.stats.recovery_attempts++;
             bootloader.force_bootloader_mode = true;
             break;
             
         case STATE_ERROR:
-            printf("[BOOT] Entered ERROR state (previous: %d)\n", bootloader.previous_state);
-            bootloader.error_count++;
+            BOOT_LOG("[BOOT] Entered ERROR state (previous: %d)\n", bootloader.previous_state);
+            bootloader.stats.error_count++;
             break;
     }
+    update_dispatch_modes();
+}
+
+// Recomputed whenever the state or the session's owner changes, so the
+// data lane looks the mode up instead of testing them per packet
+static void update_dispatch_modes(void) {
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        dispatch_mode_t mode;
+        switch (bootloader.state) {
+            case STATE_IDLE:
+                mode = DISPATCH_IDLE;
+                break;
+            case STATE_DFU_ACTIVE:
+                mode = t != (int)bootloader.session_transport ? DISPATCH_FOREIGN :
+                       bootloader.multicast ? DISPATCH_MULTICAST : DISPATCH_DFU;
+                break;
+            case STATE_EMERGENCY_RECOVERY:
+                mode = DISPATCH_RECOVERY;
+                break;
+            default:
+                mode = DISPATCH_BLOCKED;
+                break;
+        }
+        bootloader.dispatch_mode[t] = (uint8_t)mode;
+    }
 }
 
 static bool validate_state_transition(bootloader_state_t from, bootloader_state_t to) {
@@ -120,7 +433,8 @@ static bool validate_state_transition(bootloader_state_t from, bootloader_state_
     }
     switch (from) {
         case STATE_IDLE:
-            return (to == STATE_DFU_ACTIVE || to == STATE_RUNNING_APP || 
+            return (to == STATE_DFU_ACTIVE || to == STATE_DFU_VERIFY || // Launch request
+                    to == STATE_RUNNING_APP || 
                     to == STATE_EMERGENCY_RECOVERY || to == STATE_ERROR);
             
         case STATE_DFU_ACTIVE:
@@ -144,65 +458,259 @@ static bool validate_state_transition(bootloader_state_t from, bootloader_state_
     return false;
 }
 
-bool bootloader_receive_packet(const uint8_t *data, size_t length) {
-    if (bootloader.count >= BUFFER_SIZE) {
-        bootloader.packets_dropped++;
-        printf("[BOOT] Buffer full - packet dropped (dropped: %d)\n", bootloader.packets_dropped);
-        
-        // If too many drops, enter recovery
-        if (bootloader.packets_dropped > 10 && bootloader.state != STATE_EMERGENCY_RECOVERY) {
-            handle_emergency_condition();
-        }
+static bool is_control_packet(uint8_t packet_type) {
+    return packet_type == PKT_ABORT || packet_type == PKT_EMERGENCY_RESET ||
+           packet_type == PKT_PING || packet_type == PKT_GET_STATUS;
+}
+
+// Called with the critical section held
+static void record_dropped_packet(transport_t transport) {
+    bootloader.stats.packets_dropped++;
+    bootloader.queues[transport].packets_dropped++;
+    
+    // If too many drops, enter recovery - unless they are overruns on a
+    // transport other than the one carrying the session, or multicast data
+    // that the repair rounds will resend
+    if (bootloader.queues[transport].packets_dropped > 10 &&
+        bootloader.state != STATE_EMERGENCY_RECOVERY && !bootloader.multicast &&
+        (!bootloader.session_active || transport == bootloader.session_transport)) {
+        handle_emergency_condition();
+    }
+}
+
+// Time since the session's transport last delivered anything: traffic on
+// the others must not keep an idle session alive
+static uint32_t session_idle_us(uint32_t now) {
+    return now - bootloader.queues[bootloader.session_transport].last_rx_time;
+}
+
+static bool receive_control_packet(transport_t transport, const uint8_t *data, size_t length) {
+    platform_enter_critical();
+    if (bootloader.control_count >= CONTROL_BUFFER_SIZE) {
+        BOOT_LOG("[BOOT] Control queue full - packet dropped\n");
+        record_dropped_packet(transport);
+        platform_exit_critical();
+        platform_signal_event();
         return false;
     }
     
-    packet_t *pkt = &bootloader.buffer[bootloader.head];
+    control_packet_t *pkt = &bootloader.control_buffer[bootloader.control_head];
     memcpy(pkt->data, data, length);
     pkt->length = length;
+    pkt->rx_time = get_system_tick();
+    pkt->transport = transport;
     pkt->valid = true;
     
-    bootloader.head = (bootloader.head + 1) % BUFFER_SIZE;
-    bootloader.count++;
-    bootloader.last_activity_time = get_system_tick();
+    bootloader.control_head = (bootloader.control_head + 1) % CONTROL_BUFFER_SIZE;
+    bootloader.control_count++;
+    bootloader.queues[transport].last_rx_time = pkt->rx_time;
     
-    printf("[BOOT] Packet received (%zu bytes) - buffer: %d/%d\n", 
-           length, bootloader.count, BUFFER_SIZE);
+    BOOT_LOG("[BOOT] Control packet received (type %d) - control queue: %d/%d\n",
+             data[1], bootloader.control_count, CONTROL_BUFFER_SIZE);
+    platform_exit_critical();
     
+    platform_signal_event();
     return true;
 }
 
-// Replace the bootloader_process_cycle function in bootloader.c with this fixed version:
+bool bootloader_receive_packet(const uint8_t *data, size_t length) {
+    return bootloader_receive_packet_from(TRANSPORT_UART, data, length);
+}
+
+// Each transport's RX path calls this for its own queue only
+bool bootloader_receive_packet_from(transport_t transport, const uint8_t *data, size_t length) {
+    if (transport >= TRANSPORT_COUNT) {
+        return false;
+    }
+    if (length < PACKET_HEADER_SIZE || length > MAX_PACKET_SIZE) {
+        BOOT_LOG("[BOOT] Invalid packet length %zu - packet dropped\n", length);
+        return false;
+    }
+    
+    // Control packets get their own lane so they are neither dropped nor
+    // delayed behind queued flash writes
+    if (is_control_packet(data[1]) && length <= CONTROL_PACKET_SIZE) {
+        return receive_control_packet(transport, data, length);
+    }
+    
+    uint8_t *slot = bootloader_rx_reserve(transport);
+    if (!slot) {
+        bootloader_rx_overrun(transport);
+        return false;
+    }
+    memcpy(slot, data, length);
+    return bootloader_rx_commit(transport, length);
+}
+
+static packet_t *record_at(ingress_queue_t *queue, uint32_t offset) {
+    return (packet_t *)((uint8_t *)rx_arenas[queue - bootloader.queues] + offset);
+}
+
+// Records occupied, processed or not
+static uint32_t queue_count(const ingress_queue_t *queue) {
+    return queue->received - queue->freed;
+}
+
+// Records received but not yet processed
+static uint32_t queue_pending(const ingress_queue_t *queue) {
+    return queue->received - queue->processed;
+}
+
+// Bytes occupied, an unused end included
+static uint32_t queue_used(const ingress_queue_t *queue) {
+    return queue->bytes_in - queue->bytes_freed;
+}
+
+// Offset of the record after the one at offset, past any wrap
+static uint32_t next_record(ingress_queue_t *queue, uint32_t offset) {
+    offset += record_at(queue, offset)->size;
+    return queue->wrap != 0 && offset == queue->wrap ? 0 : offset;
+}
+
+// Room for a full-size record at the head, wrapping if the end is too
+// short. Called with the critical section held, which is what lets it move
+// the consumer's tail, release and wrap: it only does so when the main loop
+// has no record there to process or free.
+static packet_t *reserve_record(ingress_queue_t *queue) {
+    if (queue_count(queue) == 0 && queue->head != 0) {
+        queue->head = queue->tail = queue->release = 0; // Nothing is left past a wrap either
+    }
+    if (queue->wrap != 0) {
+        return queue->release - queue->head >= RX_RECORD_MAX ? record_at(queue, queue->head) : NULL;
+    }
+    if (RX_ARENA_SIZE - queue->head >= RX_RECORD_MAX) {
+        return record_at(queue, queue->head);
+    }
+    if (queue->release < RX_RECORD_MAX) {
+        return NULL;
+    }
+    queue->wrap = queue->head;
+    queue->bytes_in += RX_ARENA_SIZE - queue->head;
+    if (queue->tail == queue->head) {
+        queue->tail = 0; // Nothing left to process before the wrap
+    }
+    queue->head = 0;
+    return record_at(queue, 0);
+}
+
+// Full-size packets the queue can still take, as the ACK credits promise
+static uint32_t queue_credits(const ingress_queue_t *queue) {
+    if (queue_count(queue) == 0) {
+        return RX_ARENA_SIZE / RX_RECORD_MAX;
+    }
+    if (queue->wrap != 0) {
+        return (queue->release - queue->head) / RX_RECORD_MAX;
+    }
+    return (RX_ARENA_SIZE - queue->head) / RX_RECORD_MAX + queue->release / RX_RECORD_MAX;
+}
+
+uint8_t *bootloader_rx_reserve(transport_t transport) {
+    if (transport >= TRANSPORT_COUNT) {
+        return NULL;
+    }
+    ingress_queue_t *queue = &bootloader.queues[transport];
+    platform_enter_critical();
+    packet_t *pkt = reserve_record(queue);
+    platform_exit_critical();
+    return pkt ? pkt->data : NULL;
+}
+
+void bootloader_rx_overrun(transport_t transport) {
+    if (transport >= TRANSPORT_COUNT) {
+        return;
+    }
+    platform_enter_critical();
+    BOOT_LOG("[BOOT] Buffer full - packet dropped (dropped: %d)\n", bootloader.stats.packets_dropped + 1);
+    record_dropped_packet(transport);
+    platform_exit_critical();
+    platform_signal_event();
+}
+
+bool bootloader_rx_commit(transport_t transport, size_t length) {
+    if (transport >= TRANSPORT_COUNT) {
+        return false;
+    }
+    ingress_queue_t *queue = &bootloader.queues[transport];
+    packet_t *pkt = record_at(queue, queue->head);
+    if (length < PACKET_HEADER_SIZE || length > MAX_PACKET_SIZE) {
+        BOOT_LOG("[BOOT] Invalid packet length %zu - packet dropped\n", length);
+        return false;
+    }
+    
+    // A short control packet moves to the control lane; the slot stays free
+    if (is_control_packet(pkt->data[1]) && length <= CONTROL_PACKET_SIZE) {
+        return receive_control_packet(transport, pkt->data, length);
+    }
+    
+    platform_enter_critical();
+    pkt->length = (uint16_t)length;
+    pkt->size = (uint16_t)(bootloader.fixed_rx_slots ? RX_RECORD_MAX : RX_RECORD_SIZE(length));
+    pkt->valid = true;
+    pkt->held = false;
+    
+    queue->head += pkt->size;
+    queue->bytes_in += pkt->size;
+    queue->received++;
+    uint32_t used = queue_used(queue);
+    if (used > queue->used_peak) {
+        queue->used_peak = used;
+    }
+    queue->last_rx_time = get_system_tick();
+    
+    BOOT_LOG("[BOOT] Packet received (%zu bytes) - buffer: %u/%u bytes\n", 
+             length, used, RX_ARENA_SIZE);
+    platform_exit_critical();
+    
+    // Wake bootloader_run() if it is sleeping
+    platform_signal_event();
+    return true;
+}
 
 void bootloader_process_cycle(void) {
+    run_cycle();
+    flush_responses(false);
+}
+
+static void run_cycle(void) {
     handle_timeout_checks();
     is_flash_operation_complete();
+    service_write_queue();
+    
+    // Control lane first, whatever is waiting in the data FIFO
+    process_control_lane();
     
     // State-specific background processing - CRITICAL: This runs every cycle
     switch (bootloader.state) {
         case STATE_DFU_VERIFY:
-            printf("[BOOT] Background: Processing DFU verification\n");
+            BOOT_LOG("[BOOT] Background: Processing DFU verification\n");
             if (validate_application()) {
-                printf("[BOOT] Application validation successful\n");
+                BOOT_LOG("[BOOT] Application validation successful\n");
+                if (bootloader.scrub_size == 0) {
+                    bootloader.scrub_size = bootloader.image_size;
+                }
                 enter_state(STATE_RUNNING_APP);
             } else {
-                printf("[BOOT] Application validation failed\n");
+                BOOT_LOG("[BOOT] Application validation failed\n");
                 enter_state(STATE_ERROR);
             }
             return; // Important: return here to prevent packet processing during state transition
             
         case STATE_RUNNING_APP:
-            printf("[BOOT] Background: Processing application launch\n");
+            BOOT_LOG("[BOOT] Background: Processing application launch\n");
             // In real implementation, would jump to application
-            printf("[BOOT] Application launch simulation complete\n");
+            BOOT_LOG("[BOOT] Application launch simulation complete\n");
             enter_state(STATE_IDLE); // For simulation, return to idle
             return; // Important: return here to prevent packet processing during state transition
             
         case STATE_EMERGENCY_RECOVERY:
             // Auto-recovery after timeout
             if ((get_system_tick() - bootloader.state_entry_time) > 10000000) { // 10 seconds
-                printf("[BOOT] Emergency recovery timeout - returning to idle\n");
-                bootloader.packets_dropped = 0; // Reset error counters
-                bootloader.error_count = 0;
+                BOOT_LOG("[BOOT] Emergency recovery timeout - returning to idle\n");
+                bootloader.stats.packets_dropped = 0; // Reset error counters
+                for (int t = 0; t < TRANSPORT_COUNT; t++) {
+                    bootloader.queues[t].packets_dropped = 0;
+                }
+                bootloader.stats.error_count = 0;
                 bootloader.force_bootloader_mode = false; // Reset forced mode
                 enter_state(STATE_IDLE);
                 return; // Important: return here
@@ -212,237 +720,1343 @@ void bootloader_process_cycle(void) {
         case STATE_ERROR:
             // Auto-recovery from error state after 5 seconds
             if ((get_system_tick() - bootloader.state_entry_time) > 5000000) {
-                printf("[BOOT] Auto-recovery from error state\n");
-                bootloader.error_count = 0; // Reset error counter
+                BOOT_LOG("[BOOT] Auto-recovery from error state\n");
+                bootloader.stats.error_count = 0; // Reset error counter
                 enter_state(STATE_IDLE);
                 return; // Important: return here
             }
             break;
             
+        case STATE_IDLE:
+            scrub_step();
+            break;
+            
         default:
             break;
     }
     
-    // Process packets from buffer - only if we didn't change state above
-    while (bootloader.count > 0) {
-        packet_t *pkt = &bootloader.buffer[bootloader.tail];
+    // Serve the transports round-robin, one packet each per turn, so a busy
+    // interface cannot starve the one carrying the session - only if we
+    // didn't change state above
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = 0; i < TRANSPORT_COUNT; i++) {
+            transport_t transport = (transport_t)((bootloader.next_transport + i) % TRANSPORT_COUNT);
+            if (process_ingress_packet(transport)) {
+                progress = true;
+            }
+        }
+        bootloader.next_transport = (bootloader.next_transport + 1) % TRANSPORT_COUNT;
+    }
+}
+
+typedef void (*packet_handler_t)(transport_t transport, packet_t *pkt, uint8_t seq);
+
+static const packet_handler_t packet_handlers[256] = {
+    [PKT_START_SESSION] = on_start_session,
+    [PKT_DATA] = on_data,
+    [PKT_END_SESSION] = on_end_session,
+    [PKT_ABORT] = on_control,
+    [PKT_PING] = on_control,
+    [PKT_GET_STATUS] = on_control,
+    [PKT_JUMP_APP] = on_jump_app,
+    [PKT_EMERGENCY_RESET] = on_control,
+    [PKT_MULTICAST_START] = on_multicast_start,
+    [PKT_MULTICAST_DATA] = on_multicast_data,
+    [PKT_GAP_QUERY] = on_gap_query,
+    [PKT_PAGE_CRCS] = on_page_crcs,
+    [PKT_REPAIR_START] = on_repair_start,
+    [PKT_REGION_DATA] = on_data,
+};
+
+// Packet types each dispatch mode accepts, as a 256-bit mask. Every type
+// with a handler is below 32, so only the first word is ever set.
+typedef char packet_types_in_first_mask_word[PKT_REGION_DATA < 32 ? 1 : -1];
+#define PKT_BIT(type) (1u << (type))
+#define CONTROL_TYPES (PKT_BIT(PKT_ABORT) | PKT_BIT(PKT_PING) | \
+                       PKT_BIT(PKT_GET_STATUS) | PKT_BIT(PKT_EMERGENCY_RESET))
+
+static const uint32_t accepted_types[DISPATCH_MODE_COUNT][256 / 32] = {
+    [DISPATCH_IDLE] = { CONTROL_TYPES | PKT_BIT(PKT_START_SESSION) | PKT_BIT(PKT_MULTICAST_START) |
+                        PKT_BIT(PKT_MULTICAST_DATA) | PKT_BIT(PKT_GAP_QUERY) |
+                        PKT_BIT(PKT_END_SESSION) | PKT_BIT(PKT_JUMP_APP) |
+                        PKT_BIT(PKT_REPAIR_START) },
+    [DISPATCH_DFU] = { CONTROL_TYPES | PKT_BIT(PKT_DATA) | PKT_BIT(PKT_REGION_DATA) |
+                       PKT_BIT(PKT_END_SESSION) |
+                       PKT_BIT(PKT_START_SESSION) | PKT_BIT(PKT_GAP_QUERY) |
+                       PKT_BIT(PKT_PAGE_CRCS) | PKT_BIT(PKT_REPAIR_START) },
+    [DISPATCH_MULTICAST] = { CONTROL_TYPES | PKT_BIT(PKT_MULTICAST_DATA) | PKT_BIT(PKT_GAP_QUERY) |
+                             PKT_BIT(PKT_END_SESSION) },
+    [DISPATCH_FOREIGN] = { CONTROL_TYPES },
+    [DISPATCH_RECOVERY] = { CONTROL_TYPES },
+    [DISPATCH_BLOCKED] = { CONTROL_TYPES },
+};
+
+// NACK for a type the mode does not accept; 0 drops it silently, as a
+// multicast session must
+static const uint8_t reject_codes[DISPATCH_MODE_COUNT] = {
+    [DISPATCH_IDLE] = 0x01,      // Invalid packet
+    [DISPATCH_DFU] = 0x04,       // Not accepted while a session is active
+    [DISPATCH_MULTICAST] = 0,
+    [DISPATCH_FOREIGN] = 0x13,   // Session bound to another transport
+    [DISPATCH_RECOVERY] = 0x10,  // Recovery mode error
+    [DISPATCH_BLOCKED] = 0x11,   // Transitional or error state
+};
+
+// Handles the packet at the head of one transport's queue. Returns false if
+// there is none or it has to wait for the write queue.
+static bool process_ingress_packet(transport_t transport) {
+    ingress_queue_t *queue = &bootloader.queues[transport];
+    if (queue_pending(queue) == 0) {
+        return false;
+    }
+    packet_t *pkt = record_at(queue, queue->tail);
+    if (!pkt->valid) {
+        return false;
+    }
+    
+    // Flash writes wait in the FIFO until the controller is free; the
+    // occupied slots are what the credits in each ACK advertise
+    if (data_lane_blocked(transport)) {
+        return false;
+    }
+    
+    bootloader.stats.packets_processed++;
+    
+    uint8_t seq = pkt->data[0];
+    uint8_t packet_type = pkt->data[1];
+    
+    BOOT_LOG("[BOOT] Processing packet: seq=%d, type=%d, state=%d\n", 
+             seq, packet_type, bootloader.state);
+    
+    // One branch turns away whatever the transport's dispatch mode does
+    // not accept; everything else reaches its handler in one indirect call
+    uint8_t mode = bootloader.dispatch_mode[transport];
+    if (accepted_types[mode][packet_type / 32] & (1u << (packet_type % 32))) {
+        packet_handlers[packet_type](transport, pkt, seq);
+    } else {
+        BOOT_LOG("[BOOT] Packet type %d rejected in state %d\n", packet_type, bootloader.state);
+        if (reject_codes[mode]) {
+            send_nack(transport, reject_codes[mode]);
+        }
+    }
+    
+    // Release the slot only after handling so the producer cannot
+    // overwrite a packet that is still being read. A slot whose payload
+    // was queued for flash stays held until the write completes. tail
+    // moves under the critical section, as reserve_record() may rewind it.
+    platform_enter_critical();
+    queue->tail = next_record(queue, queue->tail);
+    queue->processed++;
+    platform_exit_critical();
+    if (!pkt->held) {
+        release_slot(pkt);
+    }
+    return true;
+}
+
+static ingress_queue_t *queue_of(const packet_t *pkt) {
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        const uint8_t *arena = (const uint8_t *)rx_arenas[t];
+        if ((const uint8_t *)pkt >= arena && (const uint8_t *)pkt < arena + RX_ARENA_SIZE) {
+            return &bootloader.queues[t];
+        }
+    }
+    return NULL;
+}
+
+// Frees a processed record and reclaims every free record at the old end
+// of its ring; a held record keeps the ones behind it reserved until it is
+// released. release and wrap move under the critical section, as
+// reserve_record() may reset them.
+static void release_slot(packet_t *pkt) {
+    ingress_queue_t *queue = queue_of(pkt);
+    platform_enter_critical();
+    pkt->held = false;
+    pkt->valid = false;
+    while (queue->freed != queue->processed) {
+        packet_t *oldest = record_at(queue, queue->release);
+        if (oldest->valid) break;
+        queue->bytes_freed += oldest->size;
+        queue->freed++;
+        queue->release += oldest->size;
+        if (queue->wrap != 0 && queue->release == queue->wrap) {
+            queue->bytes_freed += RX_ARENA_SIZE - queue->wrap;
+            queue->release = 0;
+            queue->wrap = 0;
+        }
+    }
+    platform_exit_critical();
+}
+
+static void process_control_lane(void) {
+    while (bootloader.control_count > 0) {
+        control_packet_t *pkt = &bootloader.control_buffer[bootloader.control_tail];
         if (!pkt->valid) break;
         
-        bootloader.tail = (bootloader.tail + 1) % BUFFER_SIZE;
-        bootloader.count--;
-        bootloader.packets_processed++;
-        
-        uint8_t seq = pkt->data[0];
-        uint8_t packet_type = pkt->data[1];
-        
-        printf("[BOOT] Processing packet: seq=%d, type=%d, state=%d\n", 
-               seq, packet_type, bootloader.state);
-        
-        // Global packet handlers (work in any state)
-        switch (packet_type) {
-            case PKT_PING:
-                printf("[BOOT] Ping received\n");
-                send_ack_packet();
-                break;
-                
-            case PKT_GET_STATUS:
-                printf("[BOOT] Status request\n");
-                send_ack_packet();
-                break;
-                
-            case PKT_EMERGENCY_RESET:
-                printf("[BOOT] Emergency reset requested\n");
-                handle_emergency_condition();
-                break;
-                
-            case PKT_ABORT:
-                if (bootloader.state == STATE_DFU_ACTIVE) {
-                    printf("[BOOT] DFU session aborted\n");
-                    enter_state(STATE_IDLE);
-                    send_ack_packet();
-                } else {
-                    printf("[BOOT] Abort command ignored in state %d\n", bootloader.state);
-                    send_nack_packet(0x11);
-                }
-                break;
-                
-            default:
-                // State-specific packet handling
-                switch (bootloader.state) {
-                    case STATE_IDLE:
-                        handle_idle_packet(pkt, seq, packet_type);
-                        break;
-                        
-                    case STATE_DFU_ACTIVE:
-                        handle_dfu_packet(pkt, seq, packet_type);
-                        break;
-                        
-                    case STATE_EMERGENCY_RECOVERY:
-                        // Only respond to emergency reset and ping in recovery mode
-                        if (packet_type != PKT_PING && packet_type != PKT_EMERGENCY_RESET) {
-                            printf("[BOOT] Only emergency commands accepted in recovery mode\n");
-                            send_nack_packet(0x10); // Recovery mode error
-                        }
-                        break;
-                        
-                    case STATE_DFU_VERIFY:
-                    case STATE_RUNNING_APP:
-                        // These states don't process packets - they're transitional
-                        printf("[BOOT] Packet ignored in transitional state %d\n", bootloader.state);
-                        send_nack_packet(0x11);
-                        break;
-                        
-                    case STATE_ERROR:
-                        printf("[BOOT] Packet ignored in error state\n");
-                        send_nack_packet(0x11);
-                        break;
-                        
-                    default:
-                        printf("[BOOT] Unknown state %d\n", bootloader.state);
-                        send_nack_packet(0xFF);
-                        break;
-                }
-                break;
+        uint32_t latency_us = get_system_tick() - pkt->rx_time;
+        bootloader.stats.control_packets++;
+        bootloader.stats.control_latency_total_us += latency_us;
+        if (latency_us > bootloader.stats.control_latency_max_us) {
+            bootloader.stats.control_latency_max_us = latency_us;
         }
+        bootloader.stats.packets_processed++;
         
+        BOOT_LOG("[BOOT] Processing control packet: seq=%d, type=%d, state=%d (waited %d us)\n",
+                 pkt->data[0], pkt->data[1], bootloader.state, latency_us);
+        handle_control_packet(pkt->transport, pkt->data[0], pkt->data[1]);
+        
+        platform_enter_critical();
         pkt->valid = false;
+        bootloader.control_tail = (bootloader.control_tail + 1) % CONTROL_BUFFER_SIZE;
+        bootloader.control_count--;
+        platform_exit_critical();
     }
 }
 
-static void handle_idle_packet(packet_t *pkt, uint8_t seq, uint8_t packet_type) {
+static void handle_control_packet(transport_t transport, uint8_t seq, uint8_t packet_type) {
     switch (packet_type) {
-        case PKT_START_SESSION:
-            if (!bootloader.force_bootloader_mode && pkt->length >= 8) {
-                bootloader.total_size = (pkt->data[2] << 24) | (pkt->data[3] << 16) | 
-                                       (pkt->data[4] << 8) | pkt->data[5];
-                bootloader.expected_crc = (pkt->data[6] << 8) | pkt->data[7];
-                
-                if (bootloader.total_size > 0 && bootloader.total_size <= 1024*1024) {
-                    enter_state(STATE_DFU_ACTIVE);
-                    bootloader.session_active = true;
-                    bootloader.expected_seq = 1;
-                    bootloader.bytes_received = 0;
-                    
-                    printf("[BOOT] Session started: %d bytes, CRC=0x%04X\n", 
-                           bootloader.total_size, bootloader.expected_crc);
-                    send_ack_packet();
-                } else {
-                    printf("[BOOT] Invalid session size: %d\n", bootloader.total_size);
-                    send_nack_packet(0x05); // Invalid size
-                }
-            } else if (bootloader.force_bootloader_mode) {
-                printf("[BOOT] Bootloader mode forced - DFU disabled\n");
-                send_nack_packet(0x12); // Bootloader mode forced
-            } else {
-                printf("[BOOT] Invalid session start packet\n");
-                send_nack_packet(0x01); // Invalid packet
-            }
+        case PKT_PING:
+            BOOT_LOG("[BOOT] Ping received\n");
+            send_ack(transport, seq);
             break;
             
-        case PKT_JUMP_APP:
-            if (!bootloader.force_bootloader_mode) {
-                printf("[BOOT] Application launch requested\n");
-                enter_state(STATE_DFU_VERIFY); // Validate before jumping
-                send_ack_packet();
-            } else {
-                printf("[BOOT] Application launch disabled in forced bootloader mode\n");
-                send_nack_packet(0x12);
-            }
+        case PKT_GET_STATUS:
+            BOOT_LOG("[BOOT] Status request\n");
+            send_ack(transport, seq);
             break;
             
-        default:
-            printf("[BOOT] Invalid packet type %d in IDLE state\n", packet_type);
-            send_nack_packet(0x01);
+        case PKT_EMERGENCY_RESET:
+            BOOT_LOG("[BOOT] Emergency reset requested\n");
+            handle_emergency_condition();
+            break;
+            
+        case PKT_ABORT:
+            if (bootloader.state == STATE_DFU_ACTIVE && transport != bootloader.session_transport) {
+                BOOT_LOG("[BOOT] Abort from a transport that does not own the session\n");
+                send_nack(transport, 0x13);
+            } else if (bootloader.state == STATE_DFU_ACTIVE) {
+                BOOT_LOG("[BOOT] DFU session aborted\n");
+                enter_state(STATE_IDLE);
+                send_ack(transport, seq);
+            } else {
+                BOOT_LOG("[BOOT] Abort command ignored in state %d\n", bootloader.state);
+                send_nack(transport, 0x11);
+            }
             break;
     }
 }
 
-static void handle_dfu_packet(packet_t *pkt, uint8_t seq, uint8_t packet_type) {
-    switch (packet_type) {
+// Returns the entry, for a range report to fill in its ranges
+static tx_response_t *queue_response(transport_t transport, uint8_t type, uint8_t value,
+                                     uint8_t seq, bool cumulative) {
+    // A data ACK right behind another on the same transport replaces it:
+    // the later sequence covers both
+    if (cumulative && bootloader.ack_coalescing && bootloader.tx_count > 0) {
+        tx_response_t *last = &bootloader.tx_queue[bootloader.tx_count - 1];
+        if (last->cumulative && last->transport == transport) {
+            if ((int8_t)(seq - last->seq) > 0) {
+                last->seq = seq;
+            }
+            bootloader.stats.acks_coalesced++;
+            return last;
+        }
+    }
+    if (bootloader.tx_count == TX_QUEUE_SIZE) {
+        flush_responses(true);
+    }
+    tx_response_t *rsp = &bootloader.tx_queue[bootloader.tx_count++];
+    rsp->transport = transport;
+    rsp->type = type;
+    rsp->value = value;
+    rsp->seq = seq;
+    rsp->cumulative = cumulative;
+    return rsp;
+}
+
+// Every ACK echoes the sequence it answers; the credits are added when it
+// is sent
+static void send_ack(transport_t transport, uint8_t seq) {
+    queue_response(transport, RSP_ACK, 0, seq, false);
+}
+
+// ACK for session data: every packet up to seq has been accepted
+static void send_data_ack(transport_t transport, uint8_t seq) {
+    queue_response(transport, RSP_ACK, 0, seq, true);
+}
+
+static void send_nack(transport_t transport, uint8_t error_code) {
+    queue_response(transport, RSP_NACK, error_code, 0, false);
+}
+
+static void send_seq_nack(transport_t transport, uint8_t expected_seq) {
+    queue_response(transport, RSP_NACK, 0x02, expected_seq, false);
+}
+
+// Sends the queued responses in order on every transport whose line is
+// free; the rest wait, and keep coalescing, until a later cycle. On a
+// half-duplex link that is one turnaround for a whole run of ACKs.
+// Each ACK tells the host how many more packets its transport's data FIFO
+// can take as of sending, after the cycle has released the packets it
+// handled. Only a forced flush inside a handler still counts that
+// handler's packet.
+static void flush_responses(bool force) {
+    bool ready[TRANSPORT_COUNT];
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        ready[t] = force || platform_tx_ready((transport_t)t);
+    }
+    
+    int kept = 0;
+    for (int i = 0; i < bootloader.tx_count; i++) {
+        const tx_response_t *rsp = &bootloader.tx_queue[i];
+        if (!ready[rsp->transport]) {
+            bootloader.tx_queue[kept++] = *rsp;
+            continue;
+        }
+        if (rsp->type == RSP_ACK) {
+            // head, release and wrap are read as one set
+            platform_enter_critical();
+            uint32_t credits = queue_credits(&bootloader.queues[rsp->transport]);
+            platform_exit_critical();
+            send_ack_packet(rsp->transport, (uint8_t)credits, rsp->seq);
+        } else if (rsp->type != RSP_NACK) {
+            send_range_report_packet(rsp->transport, rsp->type, rsp->missing, rsp->ranges,
+                                     rsp->value);
+        } else if (rsp->value == 0x02) {
+            send_seq_nack_packet(rsp->transport, rsp->seq);
+        } else {
+            send_nack_packet(rsp->transport, rsp->value);
+        }
+        bootloader.stats.responses_sent++;
+    }
+    bootloader.tx_count = kept;
+}
+
+// ACKs a written packet whose slot has just been freed, then any sequence
+// NACK that was waiting behind it
+static void send_deferred_ack(uint8_t seq) {
+    if (bootloader.acks_deferred == 0) {
+        return; // Session was abandoned while the write was in progress
+    }
+    bootloader.acks_deferred--;
+    send_data_ack(bootloader.session_transport, seq);
+    if (bootloader.acks_deferred == 0 && bootloader.resync_deferred) {
+        bootloader.resync_deferred = false;
+        send_seq_nack(bootloader.session_transport, (uint8_t)bootloader.expected_seq);
+    }
+}
+
+// Packets stay in the FIFO - and keep their slots out of the advertised
+// credits - while the write queue cannot take them. Only the session's
+// transport feeds the write queue, so no other transport ever waits.
+static bool data_lane_blocked(transport_t transport) {
+    ingress_queue_t *queue = &bootloader.queues[transport];
+    const packet_t *pkt = record_at(queue, queue->tail);
+    if (queue_pending(queue) == 0 || bootloader.state != STATE_DFU_ACTIVE ||
+        transport != bootloader.session_transport) {
+        return false;
+    }
+    
+    switch (pkt->data[1]) {
         case PKT_DATA:
-            if (seq == bootloader.expected_seq) {
-                const uint8_t *payload = &pkt->data[2];
-                size_t payload_len = pkt->length - 2;
-                
-                uint32_t flash_addr = APPLICATION_START + bootloader.bytes_received;
-                
-                printf("[BOOT] Data packet %d: %zu bytes payload\n", seq, payload_len);
-                
-                // Check if we need to erase a new flash page
-                if ((flash_addr % FLASH_PAGE_SIZE) == 0) {
-                    printf("[BOOT] Erasing flash page at 0x%08X\n", flash_addr);
-                    if (!start_flash_erase(flash_addr)) {
-                        printf("[BOOT] Flash erase busy - sending NACK\n");
-                        send_nack_packet(0x03);
-                        return;
-                    }
-                    // Wait for erase to complete
-                    while (!is_flash_operation_complete()) {
-                        // In real implementation, this would be non-blocking
-                    }
-                }
-                
-                if (start_flash_write(flash_addr, payload, payload_len)) {
-                    bootloader.bytes_received += payload_len;
-                    bootloader.expected_seq++;
-                    send_ack_packet();
-                    printf("[BOOT] Progress: %d/%d bytes (%.1f%%) - next seq: %d\n", 
-                           bootloader.bytes_received, bootloader.total_size,
-                           (float)bootloader.bytes_received * 100.0f / bootloader.total_size,
-                           bootloader.expected_seq);
-                } else {
-                    printf("[BOOT] Flash busy - sending NACK\n");
-                    send_nack_packet(0x03); // Flash busy
-                }
+        case PKT_MULTICAST_DATA:
+        case PKT_REGION_DATA:
+            // Every data header leaves the payload length's alignment unchanged
+            return bootloader.write_count >= WRITE_QUEUE_SIZE ||
+                   (bootloader.staging_busy && (pkt->length - PACKET_HEADER_SIZE) % 4 != 0);
+        case PKT_END_SESSION:
+            // Barrier: all queued writes must have completed
+            return bootloader.write_count > 0 || !is_flash_operation_complete();
+        default:
+            return false;
+    }
+}
+
+static void queue_flash_write(uint32_t address, packet_t *pkt, size_t payload_offset) {
+    const uint8_t *payload = &pkt->data[payload_offset];
+    size_t length = pkt->length - payload_offset;
+    pending_write_t *write = &bootloader.write_queue[bootloader.write_head];
+    write->address = address;
+    write->length = length;
+    
+    if (length % 4 == 0) {
+        // Program straight from the ring slot
+        write->data = payload;
+        write->slot = pkt;
+        pkt->held = true;
+    } else {
+        memcpy(bootloader.staging, payload, length);
+        write->data = bootloader.staging;
+        write->slot = NULL;
+        bootloader.staging_busy = true;
+    }
+    
+    // Erase each page before the first write that reaches into it. A write
+    // is shorter than a page, so the pages still to erase are contiguous.
+    write->erase_pages = 0;
+    uint32_t first_page = (address - APPLICATION_START) / FLASH_PAGE_SIZE;
+    uint32_t last_page = (address - APPLICATION_START + length - 1) / FLASH_PAGE_SIZE;
+    for (uint32_t page = first_page; page <= last_page && page < REGION_PAGE_COUNT; page++) {
+        if (bootloader.erased_pages[page / 8] & (1u << (page % 8))) {
+            continue;
+        }
+        bootloader.erased_pages[page / 8] |= (uint8_t)(1u << (page % 8));
+        if (write->erase_pages++ == 0) {
+            write->erase_address = APPLICATION_START + page * FLASH_PAGE_SIZE;
+        }
+    }
+    
+    bootloader.write_head = (bootloader.write_head + 1) % WRITE_QUEUE_SIZE;
+    bootloader.write_count++;
+    service_write_queue();
+}
+
+static void release_staged_ack(void) {
+    if (bootloader.staged_ack_deferred) {
+        bootloader.staged_ack_deferred = false;
+        send_deferred_ack(bootloader.staged_seq);
+    }
+}
+
+// The source of the last write may be reused once programming is done
+static void release_flash_source(void) {
+    if (!(bootloader.flash_slot || bootloader.flash_staged) || !is_flash_operation_complete()) {
+        return;
+    }
+    page_programmed(bootloader.flash_end);
+    if (bootloader.flash_slot) {
+        uint8_t seq = bootloader.flash_slot->data[0]; // Before the producer reuses the slot
+        release_slot(bootloader.flash_slot);
+        bootloader.flash_slot = NULL;
+        send_deferred_ack(seq);
+    } else {
+        bootloader.staging_busy = false;
+        bootloader.flash_staged = false;
+        release_staged_ack();
+    }
+}
+
+// Starts the erase of the next page, in the order the manifest's regions
+// are sent, that no write has erased yet
+static void erase_next_page(void) {
+    while (bootloader.erase_index < bootloader.region_count) {
+        const session_region_t *region = &bootloader.regions[bootloader.erase_index];
+        if (bootloader.erase_offset >= region->size) {
+            bootloader.erase_index++;
+            bootloader.erase_offset = 0;
+            continue;
+        }
+        uint32_t address = region_map[region->region].start + bootloader.erase_offset;
+        uint32_t page = (address - APPLICATION_START) / FLASH_PAGE_SIZE;
+        bootloader.erase_offset += FLASH_PAGE_SIZE;
+        if (bootloader.erased_pages[page / 8] & (1u << (page % 8))) {
+            continue;
+        }
+        bootloader.erased_pages[page / 8] |= (uint8_t)(1u << (page % 8));
+        BOOT_LOG("[BOOT] Erasing flash page at 0x%08X ahead of its data\n", address);
+        if (!start_flash_erase(address)) {
+            BOOT_LOG("[BOOT] Flash erase failed at 0x%08X\n", address);
+            bootloader.flash_error = true;
+        }
+        bootloader.stats.pages_erased_ahead++;
+        return;
+    }
+}
+
+// Hands the next queued operation to the flash controller whenever it is
+// idle. A page's erase is issued ahead of its first write.
+static void service_write_queue(void) {
+    release_flash_source();
+    
+    while (bootloader.write_count > 0 && is_flash_operation_complete()) {
+        pending_write_t *write = &bootloader.write_queue[bootloader.write_tail];
+        release_flash_source();
+        
+        if (write->erase_pages > 0) {
+            BOOT_LOG("[BOOT] Erasing flash page at 0x%08X\n", write->erase_address);
+            if (!start_flash_erase(write->erase_address)) {
+                BOOT_LOG("[BOOT] Flash erase failed at 0x%08X\n", write->erase_address);
+                bootloader.flash_error = true;
+            }
+            write->erase_address += FLASH_PAGE_SIZE;
+            write->erase_pages--;
+            continue;
+        }
+        
+        if (start_flash_write(write->address, write->data, write->length)) {
+            bootloader.flash_end = write->address + (uint32_t)write->length;
+            bootloader.flash_slot = write->slot;
+            bootloader.flash_staged = (write->slot == NULL);
+        } else {
+            BOOT_LOG("[BOOT] Flash write failed at 0x%08X\n", write->address);
+            bootloader.flash_error = true;
+            if (write->slot) {
+                uint8_t seq = write->slot->data[0];
+                release_slot(write->slot);
+                send_deferred_ack(seq);
             } else {
-                printf("[BOOT] Sequence error: got %d, expected %d\n", seq, bootloader.expected_seq);
-                send_nack_packet(0x02); // Sequence error
-                
-                // Too many sequence errors trigger recovery
-                bootloader.error_count++;
-                if (bootloader.error_count > 5) {
-                    printf("[BOOT] Too many sequence errors (%d) - entering emergency recovery\n", bootloader.error_count);
-                    handle_emergency_condition();
-                }
+                bootloader.staging_busy = false;
+                release_staged_ack();
             }
+        }
+        bootloader.write_tail = (bootloader.write_tail + 1) % WRITE_QUEUE_SIZE;
+        bootloader.write_count--;
+    }
+    
+    // Nothing to program: erase ahead of a manifest session's data
+    if (bootloader.write_count == 0 && bootloader.region_count > 0 && bootloader.erase_ahead &&
+        bootloader.state == STATE_DFU_ACTIVE) {
+        release_flash_source();
+        if (is_flash_operation_complete()) {
+            erase_next_page();
+        }
+    }
+}
+
+// Drops queued writes of an abandoned session and frees their slots; the
+// write already in progress keeps its slot until it completes
+static void discard_write_queue(void) {
+    while (bootloader.write_count > 0) {
+        pending_write_t *write = &bootloader.write_queue[bootloader.write_tail];
+        if (write->slot) {
+            release_slot(write->slot);
+        } else {
+            bootloader.staging_busy = false;
+        }
+        bootloader.write_tail = (bootloader.write_tail + 1) % WRITE_QUEUE_SIZE;
+        bootloader.write_count--;
+    }
+    bootloader.write_head = bootloader.write_tail = 0;
+}
+
+void bootloader_run(void) {
+    bootloader.run_requested = true;
+    
+    while (bootloader.run_requested) {
+        bootloader.stats.wakeups++;
+        bootloader_process_cycle();
+        
+        uint32_t timeout_us = next_event_timeout_us();
+        if (timeout_us > 0 && bootloader.run_requested) {
+            // Sleeps until a packet arrives, the flash controller finishes
+            // or the next timer deadline - WFI on target
+            platform_wait_for_event(timeout_us);
+        }
+    }
+}
+
+void bootloader_stop(void) {
+    bootloader.run_requested = false;
+    platform_signal_event();
+}
+
+// Time until bootloader_process_cycle() next has work to do, based on the
+// same deadlines handle_timeout_checks() and the state handlers test
+static uint32_t next_event_timeout_us(void) {
+    if (bootloader.control_count > 0 ||
+        bootloader.state == STATE_DFU_VERIFY ||
+        bootloader.state == STATE_RUNNING_APP) {
+        return 0;
+    }
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        if (queue_pending(&bootloader.queues[t]) > 0 && !data_lane_blocked((transport_t)t)) {
+            return 0;
+        }
+    }
+    
+    uint32_t now = get_system_tick();
+    uint32_t timeout_us = WAIT_FOREVER;
+    
+    if (bootloader.session_active) {
+        uint32_t elapsed = session_idle_us(now);
+        uint32_t limit = bootloader.session_timeout_ms * 1000;
+        timeout_us = elapsed >= limit ? 0 : limit - elapsed + 1;
+    }
+    
+    uint32_t state_limit = 0;
+    switch (bootloader.state) {
+        case STATE_EMERGENCY_RECOVERY:
+            state_limit = 10000000;
             break;
+        case STATE_ERROR:
+            state_limit = 5000000;
+            break;
+        default:
+            break;
+    }
+    if (state_limit > 0) {
+        uint32_t elapsed = now - bootloader.state_entry_time;
+        uint32_t remaining = elapsed >= state_limit ? 0 : state_limit - elapsed + 1;
+        if (remaining < timeout_us) {
+            timeout_us = remaining;
+        }
+    }
+    
+    // The next scrub slice, or pass
+    if (bootloader.state == STATE_IDLE && bootloader.scrub_size > 0 &&
+        bootloader.scrub_budget_us > 0) {
+        uint32_t elapsed = now - bootloader.scrub_pass_time;
+        uint32_t interval = bootloader.scrub_interval_ms * 1000u;
+        uint32_t remaining = bootloader.scrub_running || !bootloader.scrub_fresh ||
+                             elapsed >= interval ? 0 : interval - elapsed;
+        if (remaining < timeout_us) {
+            timeout_us = remaining;
+        }
+    }
+    
+    // Responses held back by a busy line
+    if (bootloader.tx_count > 0 && timeout_us > TX_RETRY_US) {
+        timeout_us = TX_RETRY_US;
+    }
+    
+    return timeout_us;
+}
+
+// True if a gap query names this device
+static bool gap_query_addressed(const packet_t *pkt) {
+    return pkt->length >= PACKET_HEADER_SIZE + 3 && pkt->data[2] == bootloader.node_id;
+}
+
+// Collects up to GAP_REPORT_MAX_RANGES runs of entries of map whose bit is
+// set, from first to count, as {first, count} pairs
+static uint8_t find_ranges(const uint8_t *map, bool set, uint32_t first, uint32_t count,
+                           uint16_t *ranges) {
+    uint8_t range_count = 0;
+    uint32_t i = first;
+    
+    while (i < count && range_count < GAP_REPORT_MAX_RANGES) {
+        if (((map[i / 8] >> (i % 8)) & 1) != set) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < count && ((map[i / 8] >> (i % 8)) & 1) == set) {
+            i++;
+        }
+        ranges[range_count * 2] = (uint16_t)start;
+        ranges[range_count * 2 + 1] = (uint16_t)(i - start);
+        range_count++;
+    }
+    return range_count;
+}
+
+static uint32_t image_page_count(void) {
+    return (bootloader.image_size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+}
+
+// With a root, the table counts only once all of it has matched
+static bool page_table_complete(void) {
+    return bootloader.image_size > 0 && bootloader.page_crcs_received == image_page_count();
+}
+
+static bool page_crc_trusted(uint32_t page) {
+    return (bootloader.page_crc_map[page / 8] & (1u << (page % 8))) &&
+           (!bootloader.has_page_root || page_table_complete());
+}
+
+static void set_page_result(uint32_t page, bool bad);
+
+// Reads a page back against its CRC. The last page is checked up to the
+// end of the image only.
+static void check_page(uint32_t page) {
+    uint32_t offset = page * FLASH_PAGE_SIZE;
+    uint32_t length = bootloader.image_size - offset < FLASH_PAGE_SIZE ?
+                      bootloader.image_size - offset : FLASH_PAGE_SIZE;
+    set_page_result(page, crc32_update(0, flash_memory_at(APPLICATION_START + offset), length) !=
+                          bootloader.page_crcs[page]);
+}
+
+static void set_page_result(uint32_t page, bool bad) {
+    uint8_t bit = (uint8_t)(1u << (page % 8));
+    if (bad && !(bootloader.bad_pages[page / 8] & bit)) {
+        bootloader.bad_pages[page / 8] |= bit;
+        bootloader.bad_page_count++;
+    } else if (!bad && (bootloader.bad_pages[page / 8] & bit)) {
+        bootloader.bad_pages[page / 8] &= (uint8_t)~bit;
+        bootloader.bad_page_count--;
+    }
+    bootloader.pages_checked[page / 8] |= bit;
+}
+
+// A unicast session writes in order, so a page is done when a write ends
+// on its last byte: at a page boundary, or at the end of the session
+static void page_programmed(uint32_t end) {
+    uint32_t offset = end - APPLICATION_START;
+    if (bootloader.state != STATE_DFU_ACTIVE || bootloader.multicast || offset == 0 ||
+        (offset % FLASH_PAGE_SIZE != 0 && offset != bootloader.image_size)) {
+        return;
+    }
+    uint32_t page = (offset - 1) / FLASH_PAGE_SIZE;
+    if (page < image_page_count() && page_crc_trusted(page)) {
+        check_page(page);
+    }
+}
+
+// Checks the pages that were not as they were programmed - their CRC came
+// late - and returns the number of bad pages
+static uint32_t check_pending_pages(void) {
+    uint32_t pages = image_page_count();
+    for (uint32_t page = 0; page < pages; page++) {
+        if (!(bootloader.pages_checked[page / 8] & (1u << (page % 8)))) {
+            check_page(page);
+        }
+    }
+    return bootloader.bad_page_count;
+}
+
+static void send_bad_page_report(transport_t transport) {
+    tx_response_t *rsp = queue_response(transport, RSP_BAD_PAGES, 0, 0, false);
+    rsp->missing = (uint16_t)bootloader.bad_page_count;
+    rsp->value = find_ranges(bootloader.bad_pages, true, 0, image_page_count(), rsp->ranges);
+}
+
+// The image is being rewritten: no pass over it holds any more
+static void stop_scrub(void) {
+    bootloader.scrub_size = 0;
+    bootloader.scrub_running = false;
+    bootloader.scrub_fresh = false;
+}
+
+// In RAM only: a reset forgets the pass
+static bool scrub_trusted(void) {
+    return bootloader.scrub_fresh &&
+           get_system_tick() - bootloader.scrub_pass_time <= SCRUB_TRUST_MS * 1000u;
+}
+
+// A page of the pass is read. A page without a CRC - the session sent no
+// table - takes the one read now.
+static void scrub_page_done(uint32_t page, uint32_t crc) {
+    uint8_t bit = (uint8_t)(1u << (page % 8));
+    if (bootloader.page_crc_map[page / 8] & bit) {
+        set_page_result(page, crc != bootloader.page_crcs[page]);
+    } else {
+        bootloader.page_crcs[page] = crc;
+        bootloader.page_crc_map[page / 8] |= bit;
+        bootloader.page_crcs_received++;
+        bootloader.pages_checked[page / 8] |= bit;
+    }
+}
+
+// IDLE: carries the pass on for one slice, then more while the budget
+// lasts, so a packet waits for the scrub no longer than that
+static void scrub_step(void) {
+    uint32_t start = get_system_tick();
+    if (bootloader.scrub_size == 0 || bootloader.scrub_budget_us == 0) {
+        return;
+    }
+    if (!bootloader.scrub_running) {
+        if (bootloader.scrub_fresh &&
+            start - bootloader.scrub_pass_time < bootloader.scrub_interval_ms * 1000u) {
+            return;
+        }
+        bootloader.scrub_running = true;
+        bootloader.scrub_offset = 0;
+        bootloader.scrub_crc = 0;
+    }
+    
+    do {
+        uint32_t offset = bootloader.scrub_offset;
+        uint32_t page_end = (offset / FLASH_PAGE_SIZE + 1) * FLASH_PAGE_SIZE;
+        if (page_end > bootloader.scrub_size) {
+            page_end = bootloader.scrub_size;
+        }
+        uint32_t length = page_end - offset < SCRUB_SLICE ? page_end - offset : SCRUB_SLICE;
+        bootloader.scrub_crc = crc32_update(bootloader.scrub_crc,
+                                            flash_memory_at(APPLICATION_START + offset), length);
+        bootloader.scrub_offset += length;
+        bootloader.stats.scrub_bytes += length;
+        if (bootloader.scrub_offset == page_end) {
+            scrub_page_done(offset / FLASH_PAGE_SIZE, bootloader.scrub_crc);
+            bootloader.scrub_crc = 0;
+        }
+    } while (bootloader.scrub_offset < bootloader.scrub_size &&
+             get_system_tick() - start < bootloader.scrub_budget_us);
+    if (bootloader.scrub_offset < bootloader.scrub_size) {
+        return;
+    }
+    
+    // Bad pages wait for a repair session, and fail any launch until then
+    bootloader.scrub_running = false;
+    bootloader.scrub_fresh = true;
+    bootloader.scrub_pass_time = get_system_tick();
+    bootloader.stats.scrub_passes++;
+    bootloader.repair_pending = bootloader.bad_page_count > 0;
+    if (bootloader.bad_page_count > 0) {
+        BOOT_LOG("[BOOT] Scrub pass %d: %d of %d pages bad - repair needed\n",
+                 bootloader.stats.scrub_passes, bootloader.bad_page_count, image_page_count());
+    }
+}
+
+// ---- Packet handlers: one per type, reached through packet_handlers[] ----
+// Each runs only in the dispatch modes whose mask accepts its type.
+
+// Reads a manifest start's regions. Returns their count, or 0 if the
+// manifest is malformed, names a region twice or overflows a partition.
+static uint8_t parse_manifest(const packet_t *pkt, session_region_t *regions) {
+    const uint8_t *p = &pkt->data[PACKET_HEADER_SIZE];
+    uint8_t count = pkt->length >= PACKET_HEADER_SIZE + 4 ? p[3] : 0;
+    if (count == 0 || count > REGION_COUNT ||
+        pkt->length != PACKET_HEADER_SIZE + 4 + count * 9u) {
+        return 0;
+    }
+    uint8_t seen = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        const uint8_t *entry = &p[4 + i * 9];
+        session_region_t *region = &regions[i];
+        region->region = entry[0];
+        region->size = ((uint32_t)entry[1] << 24) | ((uint32_t)entry[2] << 16) |
+                       ((uint32_t)entry[3] << 8) | entry[4];
+        region->crc = ((uint32_t)entry[5] << 24) | ((uint32_t)entry[6] << 16) |
+                      ((uint32_t)entry[7] << 8) | entry[8];
+        region->received = 0;
+        if (region->region >= REGION_COUNT || (seen & (1u << region->region)) ||
+            region->size == 0 || region->size > region_map[region->region].size) {
+            return 0;
+        }
+        seen |= (uint8_t)(1u << region->region);
+    }
+    return count;
+}
+
+// A plain session always rewrites the application; a manifest session only
+// if the application is one of its regions
+static bool session_writes_application(void) {
+    for (uint8_t i = 0; i < bootloader.region_count; i++) {
+        if (bootloader.regions[i].region == REGION_APPLICATION) {
+            return true;
+        }
+    }
+    return bootloader.region_count == 0;
+}
+
+static void start_session(transport_t transport, packet_t *pkt, uint8_t seq, bool multicast) {
+    bool manifest = !multicast && pkt->length >= 3 && pkt->data[2] == SESSION_MANIFEST;
+    session_region_t regions[REGION_COUNT];
+    uint8_t region_count = 0;
+    
+    // Nobody answers a multicast start, or the bus would be flooded
+    if (!bootloader.force_bootloader_mode && pkt->length >= 8) {
+        if (manifest) {
+            region_count = parse_manifest(pkt, regions);
+            bootloader.total_size = 0;
+            for (uint8_t i = 0; i < region_count; i++) {
+                bootloader.total_size += regions[i].size;
+            }
+            bootloader.expected_crc = (pkt->data[3] << 8) | pkt->data[4];
+        } else {
+            bootloader.total_size = (pkt->data[2] << 24) | (pkt->data[3] << 16) | 
+                                   (pkt->data[4] << 8) | pkt->data[5];
+            bootloader.expected_crc = (pkt->data[6] << 8) | pkt->data[7];
+        }
+        
+        if (manifest ? region_count > 0 :
+                       bootloader.total_size > 0 && bootloader.total_size <= 1024*1024) {
+            enter_state(STATE_DFU_ACTIVE);
+            bootloader.end_acked = false;
+            bootloader.session_active = true;
+            bootloader.session_transport = transport;
+            bootloader.expected_seq = 1;
+            bootloader.bytes_received = 0;
+            bootloader.multicast = multicast;
+            bootloader.chunk_count = (bootloader.total_size + MULTICAST_CHUNK_SIZE - 1) /
+                                     MULTICAST_CHUNK_SIZE;
+            bootloader.chunks_received = 0;
+            memset(bootloader.chunk_map, 0, sizeof(bootloader.chunk_map));
+            memset(bootloader.erased_pages, 0, sizeof(bootloader.erased_pages));
+            bootloader.session_base = 0;
+            memcpy(bootloader.regions, regions, region_count * sizeof(regions[0]));
+            bootloader.region_count = region_count;
+            bootloader.region_index = 0;
+            bootloader.erase_index = 0;
+            bootloader.erase_offset = 0;
             
-        case PKT_END_SESSION:
-            printf("[BOOT] End session request: %d/%d bytes received\n", 
-                   bootloader.bytes_received, bootloader.total_size);
-            
-            if (bootloader.bytes_received == bootloader.total_size) {
-                printf("[BOOT] All data received - starting verification\n");
-                
-                // Wait for any pending flash operations to complete
-                while (!is_flash_operation_complete()) {
-                    printf("[BOOT] Waiting for flash operations to complete...\n");
+            // The application's pages, table and scrub only start over if
+            // it is being rewritten
+            if (session_writes_application()) {
+                bootloader.image_size = bootloader.total_size;
+                for (uint8_t i = 0; i < region_count; i++) {
+                    if (regions[i].region == REGION_APPLICATION) {
+                        bootloader.image_size = regions[i].size;
+                    }
                 }
-                
-                enter_state(STATE_DFU_VERIFY);
-                send_ack_packet();
-            } else {
-                printf("[BOOT] Incomplete transfer: %d/%d bytes\n", 
-                       bootloader.bytes_received, bootloader.total_size);
-                send_nack_packet(0x08); // Incomplete
-                enter_state(STATE_ERROR);
+                bootloader.page_crcs_received = 0;
+                memset(bootloader.page_crc_map, 0, sizeof(bootloader.page_crc_map));
+                memset(bootloader.pages_checked, 0, sizeof(bootloader.pages_checked));
+                memset(bootloader.bad_pages, 0, sizeof(bootloader.bad_pages));
+                bootloader.bad_page_count = 0;
+                bootloader.has_page_root = !multicast && !manifest && pkt->length >= 12;
+                bootloader.page_root = bootloader.has_page_root ?
+                                       (uint32_t)(pkt->data[8] << 24) | (pkt->data[9] << 16) |
+                                       (pkt->data[10] << 8) | pkt->data[11] : 0;
+                bootloader.repair_pending = false;
+                stop_scrub();
             }
-            break;
+            update_dispatch_modes();
             
-        default:
-            printf("[BOOT] Invalid packet type %d in DFU_ACTIVE state\n", packet_type);
-            send_nack_packet(0x04);
-            break;
+            BOOT_LOG("[BOOT] %s started: %d bytes in %d region(s), CRC=0x%04X, transport %d\n",
+                     multicast ? "Multicast session" : "Session", bootloader.total_size,
+                     region_count > 0 ? region_count : 1, bootloader.expected_crc, transport);
+            if (!multicast) {
+                send_ack(transport, seq);
+            }
+        } else {
+            BOOT_LOG("[BOOT] Invalid session size: %d\n", bootloader.total_size);
+            if (!multicast) {
+                send_nack(transport, 0x05); // Invalid size
+            }
+        }
+    } else if (bootloader.force_bootloader_mode) {
+        BOOT_LOG("[BOOT] Bootloader mode forced - DFU disabled\n");
+        if (!multicast) {
+            send_nack(transport, 0x12); // Bootloader mode forced
+        }
+    } else {
+        BOOT_LOG("[BOOT] Invalid session start packet\n");
+        if (!multicast) {
+            send_nack(transport, 0x01); // Invalid packet
+        }
+    }
+}
+
+// True for the start of the session already open, sent again
+static bool is_duplicate_start(const packet_t *pkt) {
+    if (pkt->length >= 3 && pkt->data[2] == SESSION_MANIFEST) {
+        session_region_t regions[REGION_COUNT];
+        uint8_t count = parse_manifest(pkt, regions);
+        if (count == 0 || count != bootloader.region_count ||
+            bootloader.expected_crc != (uint32_t)((pkt->data[3] << 8) | pkt->data[4])) {
+            return false;
+        }
+        for (uint8_t i = 0; i < count; i++) {
+            if (regions[i].region != bootloader.regions[i].region ||
+                regions[i].size != bootloader.regions[i].size ||
+                regions[i].crc != bootloader.regions[i].crc) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return bootloader.region_count == 0 && pkt->length >= 8 &&
+           bootloader.total_size == (uint32_t)((pkt->data[2] << 24) | (pkt->data[3] << 16) |
+                                               (pkt->data[4] << 8) | pkt->data[5]) &&
+           bootloader.expected_crc == (uint32_t)((pkt->data[6] << 8) | pkt->data[7]);
+}
+
+// IDLE and unicast DFU
+static void on_start_session(transport_t transport, packet_t *pkt, uint8_t seq) {
+    if (bootloader.state == STATE_IDLE) {
+        start_session(transport, pkt, seq, false);
+        return;
+    }
+    
+    // Retransmitted because our ACK was lost: same session, no data yet
+    if (bootloader.bytes_received == 0 && is_duplicate_start(pkt)) {
+        BOOT_LOG("[BOOT] Duplicate session start - re-sending ACK\n");
+        bootloader.stats.duplicate_packets++;
+        send_ack(transport, seq);
+    } else {
+        BOOT_LOG("[BOOT] Session already active\n");
+        send_nack(transport, 0x04);
+    }
+}
+
+// IDLE
+static void on_multicast_start(transport_t transport, packet_t *pkt, uint8_t seq) {
+    start_session(transport, pkt, seq, true);
+}
+
+// Where the next data packet's payload goes: on in the image, or in a
+// manifest session on in the region being sent. Returns false for data the
+// session does not expect next.
+static bool data_destination(const packet_t *pkt, uint32_t *address, size_t *payload_offset) {
+    if (bootloader.region_count == 0) {
+        // Nothing past the declared size, nor past the application partition
+        uint32_t end = bootloader.bytes_received + (pkt->length - PACKET_HEADER_SIZE);
+        if (pkt->data[1] != PKT_DATA || end > bootloader.total_size ||
+            bootloader.session_base + end > MAX_APPLICATION_SIZE) {
+            return false;
+        }
+        *address = APPLICATION_START + bootloader.session_base + bootloader.bytes_received;
+        *payload_offset = PACKET_HEADER_SIZE;
+        return true;
+    }
+    const session_region_t *region = &bootloader.regions[bootloader.region_index];
+    if (pkt->data[1] != PKT_REGION_DATA || pkt->length <= PACKET_HEADER_SIZE + 4) {
+        return false;
+    }
+    uint32_t offset = ((uint32_t)pkt->data[3] << 16) | ((uint32_t)pkt->data[4] << 8) | pkt->data[5];
+    if (pkt->data[2] != region->region || offset != region->received ||
+        pkt->length - PACKET_HEADER_SIZE - 4 > region->size - region->received) {
+        return false;
+    }
+    *address = region_map[region->region].start + offset;
+    *payload_offset = PACKET_HEADER_SIZE + 4;
+    return true;
+}
+
+// Unicast DFU: PKT_DATA, or PKT_REGION_DATA in a manifest session
+static void on_data(transport_t transport, packet_t *pkt, uint8_t seq) {
+    if (seq == (uint8_t)bootloader.expected_seq) {
+        uint32_t flash_addr;
+        size_t payload_offset;
+        if (!data_destination(pkt, &flash_addr, &payload_offset)) {
+            BOOT_LOG("[BOOT] Data packet %d out of turn or past the session's end - discarded\n", seq);
+            send_nack(transport, 0x01);
+            return;
+        }
+        size_t payload_len = pkt->length - payload_offset;
+        
+        BOOT_LOG("[BOOT] Data packet %d: %zu bytes payload\n", seq, payload_len);
+        
+        // ACK once the slot is free again: at once if the payload
+        // was copied, else when its write completes. ACKs are
+        // cumulative, so a copied packet's waits behind those.
+        // Flash errors are reported at PKT_END_SESSION.
+        queue_flash_write(flash_addr, pkt, payload_offset);
+        bootloader.bytes_received += payload_len;
+        if (bootloader.region_count > 0) {
+            session_region_t *region = &bootloader.regions[bootloader.region_index];
+            region->received += (uint32_t)payload_len;
+            if (region->received == region->size &&
+                bootloader.region_index + 1 < bootloader.region_count) {
+                bootloader.region_index++;
+            }
+        }
+        bootloader.expected_seq++;
+        bootloader.resync_pending = false;
+        bootloader.resync_deferred = false;
+        bootloader.seq_errors = 0;
+        if (pkt->held) {
+            bootloader.acks_deferred++;
+        } else if (bootloader.acks_deferred > 0) {
+            bootloader.acks_deferred++;
+            bootloader.staged_ack_deferred = true;
+            bootloader.staged_seq = seq;
+        } else {
+            send_data_ack(transport, seq);
+        }
+        BOOT_LOG("[BOOT] Progress: %d/%d bytes (%.1f%%) - next seq: %d\n", 
+                 bootloader.bytes_received, bootloader.total_size,
+                 (float)bootloader.bytes_received * 100.0f / bootloader.total_size,
+                 bootloader.expected_seq);
+    } else if (is_duplicate_seq(seq)) {
+        // Already written - the host retransmitted because our ACK was lost
+        BOOT_LOG("[BOOT] Duplicate data packet %d - re-sending ACK\n", seq);
+        bootloader.stats.duplicate_packets++;
+        // Unless its first ACK is still waiting on the flash. The
+        // re-ACK covers every packet whose ACK has gone out.
+        if ((uint8_t)((uint8_t)bootloader.expected_seq - seq) > bootloader.acks_deferred) {
+            send_data_ack(transport, (uint8_t)(bootloader.expected_seq - 1 - bootloader.acks_deferred));
+        }
+    } else if (bootloader.resync_pending) {
+        // Remainder of a window sent past a gap; the host already has
+        // a resync NACK for it
+        BOOT_LOG("[BOOT] Out-of-order packet %d discarded - awaiting %d\n",
+                 seq, (uint8_t)bootloader.expected_seq);
+    } else {
+        BOOT_LOG("[BOOT] Sequence error: got %d, expected %d\n", seq, (uint8_t)bootloader.expected_seq);
+        // Responses go out in packet order, so the NACK must not
+        // overtake the ACKs of packets still being written
+        if (bootloader.acks_deferred > 0) {
+            bootloader.resync_deferred = true;
+        } else {
+            send_seq_nack(transport, (uint8_t)bootloader.expected_seq); // Sequence error
+        }
+        bootloader.resync_pending = true;
+        
+        // Too many sequence errors without progress trigger recovery
+        bootloader.stats.error_count++;
+        bootloader.seq_errors++;
+        if (bootloader.seq_errors > 5) {
+            BOOT_LOG("[BOOT] Too many sequence errors (%d) - entering emergency recovery\n", bootloader.seq_errors);
+            handle_emergency_condition();
+        }
+    }
+}
+
+// Every mode: a control packet too long for the control lane
+static void on_control(transport_t transport, packet_t *pkt, uint8_t seq) {
+    handle_control_packet(transport, seq, pkt->data[1]);
+}
+
+// Reads every region of a manifest session back against its CRC-32
+static bool regions_match(void) {
+    for (uint8_t i = 0; i < bootloader.region_count; i++) {
+        const session_region_t *region = &bootloader.regions[i];
+        uint32_t crc = crc32_update(0, flash_memory_at(region_map[region->region].start),
+                                    region->size);
+        if (crc != region->crc) {
+            BOOT_LOG("[BOOT] Region %d: CRC 0x%08X, expected 0x%08X\n",
+                     region->region, crc, region->crc);
+            return false;
+        }
+    }
+    return true;
+}
+
+// IDLE, unicast and multicast DFU
+static void on_end_session(transport_t transport, packet_t *pkt, uint8_t seq) {
+    (void)pkt;
+    if (bootloader.state == STATE_IDLE) {
+        // Retransmitted because the ACK of the last session's end was
+        // lost; the image has been validated and launched by now
+        if (bootloader.end_acked && seq == bootloader.end_seq) {
+            BOOT_LOG("[BOOT] Duplicate session end - re-sending ACK\n");
+            bootloader.stats.duplicate_packets++;
+            send_ack(transport, seq);
+        } else if (bootloader.repair_pending && seq == bootloader.end_seq) {
+            BOOT_LOG("[BOOT] Duplicate session end - re-sending bad page report\n");
+            bootloader.stats.duplicate_packets++;
+            send_bad_page_report(transport);
+        } else {
+            BOOT_LOG("[BOOT] Session end without a session\n");
+            send_nack(transport, 0x01);
+        }
+        return;
+    }
+    
+    // The data lane holds this packet until the write queue has drained,
+    // so every flash operation of the session is done. A multicast
+    // session ends silently.
+    if (bootloader.multicast) {
+        if (bootloader.flash_error) {
+            BOOT_LOG("[BOOT] Flash programming failed during multicast session\n");
+            enter_state(STATE_ERROR);
+        } else if (bootloader.chunks_received == bootloader.chunk_count) {
+            BOOT_LOG("[BOOT] All chunks received - starting verification\n");
+            enter_state(STATE_DFU_VERIFY);
+        } else {
+            BOOT_LOG("[BOOT] Multicast session ended with %d chunks missing\n",
+                     bootloader.chunk_count - bootloader.chunks_received);
+            enter_state(STATE_ERROR);
+        }
+        return;
+    }
+    
+    BOOT_LOG("[BOOT] End session request: %d/%d bytes received\n", 
+             bootloader.bytes_received, bootloader.total_size);
+    if (bootloader.flash_error) {
+        BOOT_LOG("[BOOT] Flash programming failed during session\n");
+        send_nack(transport, 0x09); // Flash write failed
+        enter_state(STATE_ERROR);
+    } else if (bootloader.bytes_received == bootloader.total_size && !regions_match()) {
+        send_nack(transport, 0x17); // Region CRC mismatch
+        enter_state(STATE_ERROR);
+    } else if (bootloader.bytes_received == bootloader.total_size &&
+               !session_writes_application()) {
+        // Nothing to verify or launch: the application is as it was
+        BOOT_LOG("[BOOT] All regions written - application untouched\n");
+        enter_state(STATE_IDLE);
+        send_ack(transport, seq);
+        bootloader.end_acked = true;
+        bootloader.end_seq = seq;
+    } else if (bootloader.bytes_received == bootloader.total_size &&
+               page_table_complete() && check_pending_pages() > 0) {
+        // Keep the image and the table; the host rewrites the bad pages
+        BOOT_LOG("[BOOT] %d of %d pages failed their CRC - repair needed\n",
+                 bootloader.bad_page_count, image_page_count());
+        send_bad_page_report(transport);
+        enter_state(STATE_IDLE);
+        bootloader.repair_pending = true;
+        bootloader.end_seq = seq;
+    } else if (bootloader.bytes_received == bootloader.total_size) {
+        BOOT_LOG("[BOOT] All data received - starting verification\n");
+        bootloader.repair_pending = false;
+        enter_state(STATE_DFU_VERIFY);
+        send_ack(transport, seq);
+        bootloader.end_acked = true;
+        bootloader.end_seq = seq;
+    } else {
+        BOOT_LOG("[BOOT] Incomplete transfer: %d/%d bytes\n", 
+                 bootloader.bytes_received, bootloader.total_size);
+        send_nack(transport, 0x08); // Incomplete
+        enter_state(STATE_ERROR);
     }
 }
+
+// IDLE
+static void on_jump_app(transport_t transport, packet_t *pkt, uint8_t seq) {
+    (void)pkt;
+    if (!bootloader.force_bootloader_mode) {
+        BOOT_LOG("[BOOT] Application launch requested\n");
+        enter_state(STATE_DFU_VERIFY); // Validate before jumping
+        send_ack(transport, seq);
+    } else {
+        BOOT_LOG("[BOOT] Application launch disabled in forced bootloader mode\n");
+        send_nack(transport, 0x12);
+    }
+}
+
+// Unicast DFU
+static void on_page_crcs(transport_t transport, packet_t *pkt, uint8_t seq) {
+    size_t payload_len = pkt->length - PACKET_HEADER_SIZE;
+    uint32_t first = payload_len >= 2 ? (uint32_t)(pkt->data[2] << 8) | pkt->data[3] : 0;
+    uint32_t count = payload_len >= 2 ? (uint32_t)(payload_len - 2) / 4 : 0;
+    if (count == 0 || (payload_len - 2) % 4 != 0 || first + count > image_page_count()) {
+        BOOT_LOG("[BOOT] Invalid page CRC packet\n");
+        send_nack(transport, 0x01);
+        return;
+    }
+    
+    const uint8_t *crc = &pkt->data[4];
+    for (uint32_t page = first; page < first + count; page++, crc += 4) {
+        bootloader.page_crcs[page] = (uint32_t)(crc[0] << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+        if (!(bootloader.page_crc_map[page / 8] & (1u << (page % 8)))) {
+            bootloader.page_crc_map[page / 8] |= (uint8_t)(1u << (page % 8));
+            bootloader.page_crcs_received++;
+        }
+    }
+    BOOT_LOG("[BOOT] Page CRCs %d-%d received (%d/%d)\n", first, first + count - 1,
+             bootloader.page_crcs_received, image_page_count());
+    
+    // The whole table against the root from the session start: a CRC that
+    // does not belong to the image would pass a bad page or fail a good one
+    if (bootloader.has_page_root && page_table_complete() &&
+        merkle_root(bootloader.page_crcs, image_page_count()) != bootloader.page_root) {
+        BOOT_LOG("[BOOT] Page CRC table does not match root 0x%08X\n", bootloader.page_root);
+        bootloader.page_crcs_received = 0;
+        memset(bootloader.page_crc_map, 0, sizeof(bootloader.page_crc_map));
+        send_nack(transport, 0x16); // Table does not match the root
+        return;
+    }
+    send_ack(transport, seq);
+}
+
+// IDLE after a session ended with bad pages; unicast DFU for a
+// retransmission
+static void on_repair_start(transport_t transport, packet_t *pkt, uint8_t seq) {
+    uint32_t first = 0, count = 0;
+    if (pkt->length >= PACKET_HEADER_SIZE + 4) {
+        first = (uint32_t)(pkt->data[2] << 8) | pkt->data[3];
+        count = (uint32_t)(pkt->data[4] << 8) | pkt->data[5];
+    }
+    uint32_t base = first * FLASH_PAGE_SIZE;
+    uint32_t size = count * FLASH_PAGE_SIZE;
+    if (first + count >= image_page_count()) {
+        size = bootloader.image_size > base ? bootloader.image_size - base : 0;
+    }
+    
+    if (bootloader.state == STATE_DFU_ACTIVE) {
+        // Retransmitted because our ACK was lost: same run, no data yet
+        if (bootloader.repair_pending && bootloader.bytes_received == 0 &&
+            bootloader.session_base == base && bootloader.total_size == size) {
+            BOOT_LOG("[BOOT] Duplicate repair start - re-sending ACK\n");
+            bootloader.stats.duplicate_packets++;
+            send_ack(transport, seq);
+        } else {
+            BOOT_LOG("[BOOT] Session already active\n");
+            send_nack(transport, 0x04);
+        }
+        return;
+    }
+    if (!bootloader.repair_pending) {
+        BOOT_LOG("[BOOT] Repair start without bad pages\n");
+        send_nack(transport, 0x15); // Nothing to repair
+        return;
+    }
+    if (count == 0 || first + count > image_page_count()) {
+        BOOT_LOG("[BOOT] Invalid repair run: %d pages from %d\n", count, first);
+        send_nack(transport, 0x05); // Invalid size
+        return;
+    }
+    
+    enter_state(STATE_DFU_ACTIVE);
+    bootloader.end_acked = false;
+    bootloader.session_active = true;
+    bootloader.session_transport = transport;
+    bootloader.expected_seq = 1;
+    bootloader.bytes_received = 0;
+    bootloader.session_base = base;
+    bootloader.total_size = size;
+    bootloader.region_count = 0;
+    memset(bootloader.erased_pages, 0, sizeof(bootloader.erased_pages));
+    for (uint32_t page = first; page < first + count; page++) {
+        bootloader.pages_checked[page / 8] &= (uint8_t)~(1u << (page % 8));
+    }
+    stop_scrub();
+    update_dispatch_modes();
+    
+    BOOT_LOG("[BOOT] Repair session started: pages %d-%d, %d bytes\n",
+             first, first + count - 1, size);
+    send_ack(transport, seq);
+}
+
+// Reports up to GAP_REPORT_MAX_RANGES runs of missing chunks from first_chunk on
+static void send_gap_report(transport_t transport, uint32_t first_chunk) {
+    tx_response_t *rsp = queue_response(transport, RSP_GAPS, 0, 0, false);
+    rsp->missing = (uint16_t)(bootloader.chunk_count - bootloader.chunks_received);
+    rsp->value = find_ranges(bootloader.chunk_map, false, first_chunk, bootloader.chunk_count,
+                             rsp->ranges);
+}
+
+// IDLE, unicast and multicast DFU; only the addressed device answers
+static void on_gap_query(transport_t transport, packet_t *pkt, uint8_t seq) {
+    (void)seq;
+    if (!gap_query_addressed(pkt)) {
+        return;
+    }
+    if (bootloader.state == STATE_DFU_ACTIVE && bootloader.multicast) {
+        uint32_t first_chunk = pkt->length >= PACKET_HEADER_SIZE + 3 + 2 ?
+                               (uint32_t)(pkt->data[3] << 8) | pkt->data[4] : 0;
+        send_gap_report(transport, first_chunk);
+    } else {
+        send_nack(transport, 0x14); // No multicast session
+    }
+}
+
+// IDLE, multicast DFU. Chunks are written in whatever order they arrive,
+// and ones already held are dropped.
+static void on_multicast_data(transport_t transport, packet_t *pkt, uint8_t seq) {
+    (void)transport;
+    (void)seq;
+    if (bootloader.state == STATE_IDLE) {
+        // Start missed, or session already over - the gap query tells
+        BOOT_LOG("[BOOT] Multicast data ignored outside a session\n");
+        return;
+    }
+    if (pkt->length <= PACKET_HEADER_SIZE + 4) {
+        BOOT_LOG("[BOOT] Multicast data packet without payload\n");
+        return;
+    }
+    uint32_t offset = ((uint32_t)pkt->data[2] << 24) | ((uint32_t)pkt->data[3] << 16) |
+                      ((uint32_t)pkt->data[4] << 8) | pkt->data[5];
+    size_t payload_len = pkt->length - PACKET_HEADER_SIZE - 4;
+    uint32_t chunk = offset / MULTICAST_CHUNK_SIZE;
+    
+    // Every chunk is full-sized except the image's last
+    if (offset % MULTICAST_CHUNK_SIZE != 0 || offset >= bootloader.total_size ||
+        payload_len != (bootloader.total_size - offset < MULTICAST_CHUNK_SIZE ?
+                        bootloader.total_size - offset : MULTICAST_CHUNK_SIZE)) {
+        BOOT_LOG("[BOOT] Multicast chunk at 0x%08X does not fit the image\n", offset);
+        return;
+    }
+    if (bootloader.chunk_map[chunk / 8] & (1u << (chunk % 8))) {
+        bootloader.stats.duplicate_packets++;
+        return;
+    }
+    
+    bootloader.chunk_map[chunk / 8] |= (uint8_t)(1u << (chunk % 8));
+    bootloader.chunks_received++;
+    queue_flash_write(APPLICATION_START + offset, pkt, PACKET_HEADER_SIZE + 4);
+    bootloader.bytes_received += payload_len;
+    BOOT_LOG("[BOOT] Multicast chunk %d: %d/%d chunks\n",
+             chunk, bootloader.chunks_received, bootloader.chunk_count);
+}
+// True for a retransmission of one of the last DUPLICATE_WINDOW packets
+// already written in this session
+static bool is_duplicate_seq(uint8_t seq) {
+    uint8_t behind = (uint8_t)((uint8_t)bootloader.expected_seq - seq);
+    return behind >= 1 && behind <= DUPLICATE_WINDOW && behind < bootloader.expected_seq;
+}
+
 static void handle_timeout_checks(void) {
     uint32_t current_time = get_system_tick();
     
     // Session timeout check
     if (bootloader.session_active) {
-        if ((current_time - bootloader.last_activity_time) > 
-            (bootloader.session_timeout_ms * 1000)) {
-            printf("[BOOT] Session timeout - aborting\n");
+        if (session_idle_us(current_time) > bootloader.session_timeout_ms * 1000) {
+            BOOT_LOG("[BOOT] Session timeout - aborting\n");
             enter_state(STATE_ERROR);
         }
     }
@@ -452,7 +2066,7 @@ static void handle_timeout_checks(void) {
         case STATE_DFU_VERIFY:
             if ((current_time - bootloader.state_entry_time) > 
                 (bootloader.app_validation_timeout_ms * 1000)) {
-                printf("[BOOT] Application validation timeout\n");
+                BOOT_LOG("[BOOT] Application validation timeout\n");
                 enter_state(STATE_ERROR);
             }
             break;
@@ -460,7 +2074,7 @@ static void handle_timeout_checks(void) {
         case STATE_ERROR:
             // Auto-recovery from error state after 5 seconds
             if ((current_time - bootloader.state_entry_time) > 5000000) {
-                printf("[BOOT] Auto-recovery from error state\n");
+                BOOT_LOG("[BOOT] Auto-recovery from error state\n");
                 enter_state(STATE_IDLE);
             }
             break;
@@ -472,7 +2086,7 @@ static void handle_timeout_checks(void) {
 
 static bool validate_application(void) {
     // Simulate application validation
-    printf("[BOOT] Validating application...\n");
+    BOOT_LOG("[BOOT] Validating application...\n");
     
     // In real implementation, would read from flash and calculate CRC
     bootloader.app_validation.size = bootloader.bytes_received;
@@ -481,25 +2095,47 @@ static bool validate_application(void) {
     bootloader.app_validation.valid = (bootloader.app_validation.calculated_crc == 
                                       bootloader.app_validation.expected_crc);
     
-    printf("[BOOT] Validation result: %s (CRC: calc=0x%04X, exp=0x%04X)\n",
-           bootloader.app_validation.valid ? "PASS" : "FAIL",
-           bootloader.app_validation.calculated_crc,
-           bootloader.app_validation.expected_crc);
+    // Launching the image already in flash: every page is read again,
+    // unless a scrub pass just did
+    if (bootloader.previous_state == STATE_IDLE) {
+        if (scrub_trusted()) {
+            BOOT_LOG("[BOOT] Trusting the scrub pass of %d ms ago\n",
+                     (get_system_tick() - bootloader.scrub_pass_time) / 1000);
+        } else {
+            memset(bootloader.pages_checked, 0, sizeof(bootloader.pages_checked));
+        }
+    }
+    
+    // With a Merkle root the tree replaces the image CRC: the table
+    // matched the root as it came in and each page was checked against
+    // it as it was programmed, so only the results are left to look at.
+    // Both are CRCs, so this catches corruption, not a forged image.
+    if (bootloader.has_page_root) {
+        bootloader.app_validation.size = bootloader.image_size;
+        bootloader.app_validation.valid = page_table_complete() && check_pending_pages() == 0;
+        BOOT_LOG("[BOOT] Root 0x%08X: %d of %d pages bad\n", bootloader.page_root,
+                 bootloader.bad_page_count, image_page_count());
+    } else if (page_table_complete()) {
+        bootloader.app_validation.size = bootloader.image_size;
+        bootloader.app_validation.valid = bootloader.app_validation.valid &&
+                                          check_pending_pages() == 0;
+        BOOT_LOG("[BOOT] Page check: %d of %d pages bad\n",
+                 bootloader.bad_page_count, image_page_count());
+    }
+    
+    BOOT_LOG("[BOOT] Validation result: %s (CRC: calc=0x%04X, exp=0x%04X)\n",
+             bootloader.app_validation.valid ? "PASS" : "FAIL",
+             bootloader.app_validation.calculated_crc,
+             bootloader.app_validation.expected_crc);
     
     return bootloader.app_validation.valid;
 }
 
 static void handle_emergency_condition(void) {
-    printf("[BOOT] EMERGENCY CONDITION DETECTED\n");
+    BOOT_LOG("[BOOT] EMERGENCY CONDITION DETECTED\n");
     enter_state(STATE_EMERGENCY_RECOVERY);
 }
 
-// Mock function - in real implementation would get system tick
-uint32_t get_system_tick(void) {
-    static uint32_t tick = 0;
-    return tick += 1000; // Increment by 1ms each call
-}
-
 void bootloader_print_stats(void) {
     printf("\n=== Advanced Bootloader Statistics ===\n");
     printf("Current State: %d (%s)\n", bootloader.state,
@@ -513,16 +2149,30 @@ void bootloader_print_stats(void) {
     printf("Session Active: %s\n", bootloader.session_active ? "Yes" : "No");
     printf("Forced Bootloader Mode: %s\n", bootloader.force_bootloader_mode ? "Yes" : "No");
     printf("\nPacket Statistics:\n");
-    printf("  Processed: %d\n", bootloader.packets_processed);
-    printf("  Dropped: %d\n", bootloader.packets_dropped);
-    printf("  Buffer Count: %d/%d\n", bootloader.count, BUFFER_SIZE);
+    printf("  Processed: %d\n", bootloader.stats.packets_processed);
+    printf("  Dropped: %d\n", bootloader.stats.packets_dropped);
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        printf("  Transport %d: processed %u, dropped %u, buffer %u packets in %u/%u bytes\n",
+               t, bootloader.queues[t].processed, bootloader.queues[t].packets_dropped,
+               queue_count(&bootloader.queues[t]), queue_used(&bootloader.queues[t]), RX_ARENA_SIZE);
+    }
+    printf("  Control Packets: %d (max latency %d us)\n",
+           bootloader.stats.control_packets, bootloader.stats.control_latency_max_us);
     printf("\nTransfer Statistics:\n");
     printf("  Bytes Received: %d/%d\n", bootloader.bytes_received, bootloader.total_size);
     printf("  Expected Sequence: %d\n", bootloader.expected_seq);
+    printf("  Duplicates Re-ACKed: %d\n", bootloader.stats.duplicate_packets);
+    printf("  Responses Sent: %d (%d ACKs coalesced)\n",
+           bootloader.stats.responses_sent, bootloader.stats.acks_coalesced);
+    if (bootloader.multicast) {
+        printf("  Multicast Chunks: %d/%d\n", bootloader.chunks_received, bootloader.chunk_count);
+    }
     printf("\nError Statistics:\n");
-    printf("  Error Count: %d\n", bootloader.error_count);
-    printf("  Recovery Attempts: %d\n", bootloader.recovery_attempts);
-    printf("  App Launch Attempts: %d\n", bootloader.app_launch_attempts);
+    printf("  Error Count: %d\n", bootloader.stats.error_count);
+    printf("  Recovery Attempts: %d\n", bootloader.stats.recovery_attempts);
+    printf("  App Launch Attempts: %d\n", bootloader.stats.app_launch_attempts);
+    printf("  Run Loop Wakeups: %d\n", bootloader.stats.wakeups);
+    printf("  Scrub Passes: %d (%d bad pages)\n", bootloader.stats.scrub_passes, bootloader.bad_page_count);
     printf("\nApplication Validation:\n");
     printf("  Valid: %s\n", bootloader.app_validation.valid ? "Yes" : "No");
     printf("  Size: %d bytes\n", bootloader.app_validation.size);
@@ -530,4 +2180,31 @@ void bootloader_print_stats(void) {
            bootloader.app_validation.calculated_crc,
            bootloader.app_validation.expected_crc);
     printf("=====================================\n\n");
-}
\ No newline at end of file
+}
+
+void bootloader_get_stats(bootloader_stats_t *stats) {
+    stats->state = bootloader.state;
+    stats->packets_processed = bootloader.stats.packets_processed;
+    stats->packets_dropped = bootloader.stats.packets_dropped;
+    stats->error_count = bootloader.stats.error_count;
+    stats->recovery_attempts = bootloader.stats.recovery_attempts;
+    stats->bytes_received = bootloader.bytes_received;
+    stats->wakeups = bootloader.stats.wakeups;
+    stats->control_packets = bootloader.stats.control_packets;
+    stats->control_latency_max_us = bootloader.stats.control_latency_max_us;
+    stats->control_latency_total_us = bootloader.stats.control_latency_total_us;
+    stats->duplicate_packets = bootloader.stats.duplicate_packets;
+    stats->app_launch_attempts = bootloader.stats.app_launch_attempts;
+    stats->responses_sent = bootloader.stats.responses_sent;
+    stats->acks_coalesced = bootloader.stats.acks_coalesced;
+    stats->bad_pages = bootloader.bad_page_count;
+    stats->scrub_passes = bootloader.stats.scrub_passes;
+    stats->scrub_bytes = bootloader.stats.scrub_bytes;
+    stats->pages_erased_ahead = bootloader.stats.pages_erased_ahead;
+    stats->session_transport = bootloader.session_transport;
+    for (int t = 0; t < TRANSPORT_COUNT; t++) {
+        stats->transport_packets[t] = bootloader.queues[t].processed;
+        stats->transport_dropped[t] = bootloader.queues[t].packets_dropped;
+        stats->transport_rx_peak[t] = bootloader.queues[t].used_peak;
+    }
+}
@@ -4,12 +4,45 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
-#define MAX_PACKET_SIZE 256
-#define BUFFER_SIZE 16
+#define PACKET_HEADER_SIZE 2 // seq + type
+#define MAX_PAYLOAD_SIZE 256
+#define MAX_PACKET_SIZE (PACKET_HEADER_SIZE + MAX_PAYLOAD_SIZE)
+#define BUFFER_SIZE 16 // Full-size packets a transport's data FIFO holds
+#define CONTROL_BUFFER_SIZE 4
+#define CONTROL_PACKET_SIZE 8
+#define WRITE_QUEUE_SIZE BUFFER_SIZE // Entries point into held FIFO records
+
+// Each data FIFO is one arena of records: a 6-byte header, then the packet,
+// padded to a whole word. Short packets take only the room they need.
+#define RX_RECORD_HEADER 6
+#define RX_RECORD_SIZE(length) ((RX_RECORD_HEADER + (length) + 3) & ~3u)
+#define RX_RECORD_MAX RX_RECORD_SIZE(MAX_PACKET_SIZE)
+#ifndef RX_ARENA_SIZE
+#define RX_ARENA_SIZE (BUFFER_SIZE * RX_RECORD_MAX)
+#endif
+#define DUPLICATE_WINDOW 64 // How far behind expected_seq a retransmission is recognised
 #define APPLICATION_START 0x08008000
 #define MAX_APPLICATION_SIZE (1024*1024)
 #define FLASH_PAGE_SIZE 2048
+#define CONFIG_START 0x08108000       // Data/config partition, after the application
+#define CONFIG_SIZE (64*1024)
+#define COPROCESSOR_START 0x08118000  // Co-processor image, staged for it to load
+#define COPROCESSOR_SIZE (256*1024)
+#define MULTICAST_CHUNK_SIZE (MAX_PAYLOAD_SIZE - 4) // Image bytes per multicast data packet
+#define MULTICAST_MAX_CHUNKS ((MAX_APPLICATION_SIZE + MULTICAST_CHUNK_SIZE - 1) / MULTICAST_CHUNK_SIZE)
+#define GAP_REPORT_MAX_RANGES 8
+#define SCRUB_BUDGET_US 50        // Default scrub time per idle cycle
+#define SCRUB_INTERVAL_MS 10000   // Default time between scrub passes
+#define SCRUB_TRUST_MS 60000      // Age up to which a launch trusts a scrub pass
+
+// Trace output; build with -DBOOTLOADER_QUIET to compile it out
+#ifdef BOOTLOADER_QUIET
+#define BOOT_LOG(...) ((void)0)
+#else
+#define BOOT_LOG(...) printf(__VA_ARGS__)
+#endif
 
 // Extended state machine
 typedef enum {
@@ -21,6 +54,23 @@ typedef enum {
     STATE_ERROR
 } bootloader_state_t;
 
+// Interfaces packets can arrive on. Each has its own ingress queue, and
+// responses go back out on the interface the packet came from.
+typedef enum {
+    TRANSPORT_UART = 0,
+    TRANSPORT_USB,
+    TRANSPORT_CAN,
+    TRANSPORT_COUNT
+} transport_t;
+
+// Flash regions one session can update; see the manifest below
+typedef enum {
+    REGION_APPLICATION = 0,
+    REGION_CONFIG,
+    REGION_COPROCESSOR,
+    REGION_COUNT
+} region_t;
+
 // Extended packet types
 typedef enum {
     PKT_START_SESSION = 0x01,
@@ -31,21 +81,171 @@ typedef enum {
     PKT_GET_STATUS = 0x06,
     PKT_JUMP_APP = 0x07,
     PKT_EMERGENCY_RESET = 0x08,
-    PKT_GET_VERSION = 0x09
+    PKT_GET_VERSION = 0x09,
+    PKT_MULTICAST_START = 0x0A, // As PKT_START_SESSION, for every device on the bus
+    PKT_MULTICAST_DATA = 0x0B,  // [offset:4][up to MULTICAST_CHUNK_SIZE bytes]
+    PKT_GAP_QUERY = 0x0C,       // [node][first chunk:2]
+    PKT_PAGE_CRCS = 0x0D,       // [first page:2][CRC-32:4 per page, up to PAGE_CRCS_PER_PACKET]
+    PKT_REPAIR_START = 0x0E,    // [first page:2][pages:2]
+    PKT_REGION_DATA = 0x0F      // [region:1][offset:3][up to REGION_DATA_SIZE bytes]
 } packet_type_t;
 
+#define PAGE_CRCS_PER_PACKET ((MAX_PAYLOAD_SIZE - 2) / 4)
+#define SESSION_MANIFEST 0x80 // First byte of a manifest start; a size's is 0
+#define REGION_DATA_SIZE (MAX_PAYLOAD_SIZE - 4) // Region bytes per region data packet
+
+// Response frame types (device -> host): {type, value}. An ACK's value is
+// the number of free data FIFO slots the host may fill, followed by the
+// sequence number of the packet it answers: {RSP_ACK, credits, seq}. Data
+// ACKs are cumulative - every packet up to seq has been accepted - so the
+// device may send one ACK for a run of packets. A NACK's value is
+// the error code. A sequence error NACK (0x02) appends the sequence number
+// the device expects next so the host can resynchronise in one round trip.
+// NACK 0x13 rejects session traffic from a transport other than the one the
+// session was started on.
+//
+// A multicast session is silent, since every device on the bus receives the
+// same packets: data is addressed by image offset, and each device records
+// the chunks it has in a bitmap. Only the device named in a PKT_GAP_QUERY
+// answers, with an RSP_GAPS frame: {type, ranges, missing:2, then
+// [first chunk:2][count:2] for up to GAP_REPORT_MAX_RANGES missing ranges
+// from the queried chunk on}. NACK 0x14 answers a gap query outside a
+// multicast session.
+//
+// A unicast session may carry a CRC-32 of every FLASH_PAGE_SIZE page of the
+// image, the last page's over the image bytes only, in PKT_PAGE_CRCS
+// packets (big-endian, each ACKed) before its data. Each page is then read
+// back as soon as it is programmed. If any is bad, PKT_END_SESSION answers
+// with RSP_BAD_PAGES - laid out as RSP_GAPS, in pages - and returns to
+// IDLE instead of verifying. PKT_REPAIR_START then opens a session over a
+// run of those pages: its data packets, numbered from 1 again, rewrite the
+// run, and its PKT_END_SESSION reports the pages still bad. NACK 0x15
+// answers a repair start with nothing to repair.
+//
+// PKT_START_SESSION may append the Merkle root of the page CRCs (merkle.h)
+// as [root:4] after the size and CRC. The table must then match it - NACK
+// 0x16 answers the packet completing one that does not - and stands in for
+// the image CRC at validation. Like that CRC, it only detects accidental
+// corruption: a table built to match a chosen root passes, so neither
+// authenticates the image.
+//
+// While IDLE, the last image that validated is scrubbed: each cycle re-reads
+// the next slices of it for up to the scrub budget, checking each page
+// against its CRC - the table's, or the one the first pass records if the
+// session had none. A bad page can then be rewritten with PKT_REPAIR_START
+// before anything tries to launch the image, and a launch trusts a clean
+// pass finished in the last SCRUB_TRUST_MS instead of reading the image
+// again. Passes start scrub interval apart. The pass result lives in RAM
+// only and bootloader_init() clears it, so only a PKT_JUMP_APP in the same
+// power cycle can trust it; validation after a reset reads every page.
+//
+// One session can also update several regions: PKT_START_SESSION then
+// carries a manifest, [SESSION_MANIFEST][CRC:2][regions:1] and per region
+// [region:1][size:4][CRC-32:4], the CRC:2 being the application's as in
+// the plain form. Each region starts on a page and takes up to its
+// partition, and the regions are sent one after the other in manifest
+// order, in PKT_REGION_DATA packets numbered on through the session, each
+// tagged with its region and offset. While the flash controller has no
+// data to program it erases ahead, the next pages of the region being sent
+// and then the regions after it. PKT_END_SESSION reads every region back:
+// NACK 0x17 answers a CRC-32 that does not match. Otherwise the application,
+// if it was one of the regions, is verified and launched as after a plain
+// session; if not, the device ACKs and stays in IDLE. NACK 0x01 answers
+// region data out of turn.
+#define RSP_ACK 0x80
+#define RSP_NACK 0x81
+#define RSP_GAPS 0x82
+#define RSP_BAD_PAGES 0x83
+
+// Timeout value for platform_wait_for_event() meaning "no deadline"
+#define WAIT_FOREVER 0xFFFFFFFFu
+
+// Snapshot of the counters printed by bootloader_print_stats()
+typedef struct {
+    bootloader_state_t state;
+    uint32_t packets_processed;
+    uint32_t packets_dropped;
+    uint32_t error_count;
+    uint32_t recovery_attempts;
+    uint32_t bytes_received;
+    uint32_t wakeups;
+    uint32_t control_packets;
+    uint32_t control_latency_max_us;
+    uint64_t control_latency_total_us;
+    uint32_t duplicate_packets;
+    uint32_t app_launch_attempts;
+    uint32_t responses_sent;
+    uint32_t acks_coalesced;   // Data ACKs merged into a later one
+    uint32_t bad_pages;        // Pages of the image that failed their CRC
+    uint32_t scrub_passes;     // Idle scrub passes over the image finished
+    uint32_t scrub_bytes;      // Bytes re-read by the idle scrub
+    uint32_t pages_erased_ahead; // Erased while the flash had no data to program
+    transport_t session_transport;
+    uint32_t transport_packets[TRANSPORT_COUNT];
+    uint32_t transport_dropped[TRANSPORT_COUNT];
+    uint32_t transport_rx_peak[TRANSPORT_COUNT]; // Most data FIFO bytes in use at once
+} bootloader_stats_t;
+
 // Main API
 void bootloader_init(void);
-bool bootloader_receive_packet(const uint8_t *data, size_t length);
+void bootloader_set_node_id(uint8_t node_id); // Address for gap queries
+void bootloader_set_ack_coalescing(bool enabled); // On by default
+void bootloader_set_fixed_rx_slots(bool enabled); // Off by default
+void bootloader_set_erase_ahead(bool enabled); // On by default
+void bootloader_set_scrub(uint32_t budget_us, uint32_t interval_ms); // See below
+bool bootloader_receive_packet(const uint8_t *data, size_t length); // UART
+bool bootloader_receive_packet_from(transport_t transport, const uint8_t *data, size_t length);
+
+// Zero-copy receive for drivers that assemble packets themselves (see
+// framer.h): build the packet in the slot returned by bootloader_rx_reserve()
+// - room for MAX_PACKET_SIZE bytes, or NULL if the queue is full - and
+// publish it with bootloader_rx_commit(), which keeps only the length
+// committed. A reserved slot that is never committed is simply reused. A
+// transport's driver must be its queue's only producer.
+uint8_t *bootloader_rx_reserve(transport_t transport);
+bool bootloader_rx_commit(transport_t transport, size_t length);
+void bootloader_rx_overrun(transport_t transport); // Packet lost for want of a slot
 void bootloader_process_cycle(void);
+void bootloader_run(void);
+void bootloader_stop(void);
 void bootloader_print_stats(void);
+void bootloader_get_stats(bootloader_stats_t *stats);
 uint32_t get_system_tick(void);
 
 // Platform functions (implemented in platform.c)
 extern bool start_flash_write(uint32_t address, const uint8_t *data, size_t length);
 extern bool start_flash_erase(uint32_t address);
 extern bool is_flash_operation_complete(void);
-extern void send_ack_packet(void);
-extern void send_nack_packet(uint8_t error_code);
+extern void send_ack_packet(transport_t transport, uint8_t credits, uint8_t seq);
+extern void send_nack_packet(transport_t transport, uint8_t error_code);
+extern void send_seq_nack_packet(transport_t transport, uint8_t expected_seq);
+extern void send_range_report_packet(transport_t transport, uint8_t type, uint16_t missing,
+                                     const uint16_t *ranges, uint8_t range_count);
+extern const uint8_t *flash_memory_at(uint32_t address);
+extern bool platform_tx_ready(transport_t transport); // Line free to send responses
+extern void platform_enter_critical(void);
+extern void platform_exit_critical(void);
+extern void platform_wait_for_event(uint32_t timeout_us);
+extern void platform_signal_event(void);
+
+// Host simulation only: observe the response frames sent to the host
+typedef void (*response_hook_t)(transport_t transport, const uint8_t *frame,
+                                size_t length, void *ctx);
+extern void platform_set_response_hook(response_hook_t hook, void *ctx);
+
+// Host simulation only: report whether a half-duplex line is free for the
+// device to answer on. Without a hook every line is always free.
+typedef bool (*tx_ready_hook_t)(transport_t transport, void *ctx);
+extern void platform_set_tx_ready_hook(tx_ready_hook_t hook, void *ctx);
+
+// Host simulation only: keep the mock flash in a file (see platform.c),
+// and set how long each write or erase takes (2 ms by default)
+extern bool platform_map_flash_file(const char *path);
+extern void platform_set_flash_time_us(uint32_t time_us);
+
+// Host simulation only: make each flash write flip one bit with this
+// probability, as weak cells would
+extern void platform_set_flash_fault_rate(double per_write);
+extern void platform_flip_flash_bit(uint32_t address, uint8_t bit);
 
 #endif
\ No newline at end of file
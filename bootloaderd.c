@@ -0,0 +1,190 @@
+#define _XOPEN_SOURCE 700
+
+#include "device_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Bootloader simulator daemon: one simulated board that host tools reach
+// the way they reach hardware, over a UART-style framed byte stream
+// (framer.h) on a UNIX socket or a pty, or - for throughput benchmarks
+// without transport cost - a shared-memory link (shm_link.h) that packets
+// cross without a syscall. The bootloader keeps its state
+// while hosts come and go; with --flash, the flash lives in a file that
+// outlasts the daemon and can be inspected - the application image starts
+// at APPLICATION_START & 0x1FFFFF.
+//
+//   bootloaderd --socket PATH [--flash FILE] [--flash-time US]
+//   bootloaderd --pty [LINK] [--flash FILE] [--flash-time US]
+//   bootloaderd --shm PATH [--flash FILE] [--flash-time US]
+
+// A tty carries the frames as raw bytes: no echo, line editing or CR/LF
+// translation
+static void set_raw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        return;
+    }
+    tio.c_iflag &= ~(tcflag_t)(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tio.c_oflag &= ~(tcflag_t)OPOST;
+    tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(tcflag_t)(CSIZE | PARENB);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void log_session(void) {
+    device_sim_stats_t stats;
+    device_sim_get_stats(&stats);
+    fprintf(stderr, "bootloaderd: host %u gone - state %d, %u packets, %u dropped, "
+            "%u frame errors, %u launches\n", stats.connections, stats.bootloader.state,
+            stats.bootloader.packets_processed, stats.bootloader.packets_dropped,
+            stats.frame_errors, stats.bootloader.app_launch_attempts);
+}
+
+// One host at a time; the next waits in the listen backlog
+static int serve_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "bootloaderd: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 4) != 0) {
+        fprintf(stderr, "bootloaderd: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "bootloaderd: listening on %s\n", path);
+    
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "bootloaderd: accept: %s\n", strerror(errno));
+            return 1;
+        }
+        device_sim_serve(fd, fd);
+        close(fd);
+        log_session();
+    }
+}
+
+// The daemon holds the slave open itself, so the line stays up - and in
+// raw mode - while hosts open and close it
+static int serve_pty(const char *link) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        fprintf(stderr, "bootloaderd: pty: %s\n", strerror(errno));
+        return 1;
+    }
+    const char *name = ptsname(master);
+    int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    if (slave < 0) {
+        fprintf(stderr, "bootloaderd: pty: %s\n", strerror(errno));
+        return 1;
+    }
+    set_raw(slave);
+    if (link) {
+        unlink(link);
+        if (symlink(name, link) != 0) {
+            fprintf(stderr, "bootloaderd: %s: %s\n", link, strerror(errno));
+            return 1;
+        }
+    }
+    fprintf(stderr, "bootloaderd: pty %s%s%s\n", name, link ? " as " : "", link ? link : "");
+    
+    device_sim_serve(master, master);
+    fprintf(stderr, "bootloaderd: pty closed\n");
+    return 1;
+}
+
+static int serve_shm(const char *path) {
+    shm_link_t *link = shm_link_create(path);
+    if (!link) {
+        fprintf(stderr, "bootloaderd: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "bootloaderd: shared memory %s\n", path);
+    for (;;) {
+        device_sim_serve_shm(link);
+        log_session();
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: bootloaderd --socket PATH | --pty [LINK] | --shm PATH\n"
+            "                   [--flash FILE] [--flash-time US]\n"
+            "\n"
+            "  --socket PATH    listen for hosts on a UNIX socket\n"
+            "  --pty [LINK]     attach to a new pty, optionally symlinked as LINK\n"
+            "  --shm PATH       create a shared-memory link in the file PATH\n"
+            "  --flash FILE     keep the 2 MB flash in FILE (default: in memory)\n"
+            "  --flash-time US  time per flash write or erase (default 2000)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = NULL;
+    const char *pty_link = NULL;
+    const char *shm_path = NULL;
+    const char *flash_path = NULL;
+    bool pty = false;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc && argv[i + 1][0] != '-' ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--socket") == 0 && value) {
+            socket_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--pty") == 0) {
+            pty = true;
+            if (value) {
+                pty_link = value;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--shm") == 0 && value) {
+            shm_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--flash") == 0 && value) {
+            flash_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--flash-time") == 0 && value) {
+            platform_set_flash_time_us((uint32_t)strtoul(value, NULL, 0));
+            i++;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (pty + (socket_path != NULL) + (shm_path != NULL) != 1) {
+        usage();
+        return 2;
+    }
+    
+    if (flash_path && !platform_map_flash_file(flash_path)) {
+        fprintf(stderr, "bootloaderd: %s: %s\n", flash_path, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A host gone mid-response
+    
+    if (shm_path) {
+        return serve_shm(shm_path);
+    }
+    device_sim_start();
+    return pty ? serve_pty(pty_link) : serve_socket(socket_path);
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 (IEEE 802.3), shared by the bootloader's page checks and the host
+// tools; start with crc = 0 and chain calls over a buffer
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length);
+
+#endif
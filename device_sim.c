@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "device_sim.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define RX_CHUNK_SIZE 4096
+#define RESPONSE_MAX_SIZE (4 + GAP_REPORT_MAX_RANGES * 4)
+#define SETTLE_TIMEOUT_MS 1000
+
+static pthread_t thread;
+static bool initialized;
+static bool threaded;
+static framer_t framer;
+static uint32_t connections;
+static uint32_t frames_ok;
+static uint32_t frame_errors;
+
+// Where responses go out: the connected host's stream or shared-memory
+// link, neither while no host is connected
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int response_fd = -1;
+static shm_link_t *response_shm;
+
+static bool write_full(int fd, const void *buffer, size_t length) {
+    const uint8_t *bytes = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+static void on_response(transport_t transport, const uint8_t *frame, size_t length, void *ctx) {
+    uint8_t encoded[FRAME_MAX_ENCODED_SIZE(RESPONSE_MAX_SIZE)];
+    (void)transport;
+    (void)ctx;
+    size_t encoded_length = framer_encode(frame, length, encoded, sizeof(encoded));
+    pthread_mutex_lock(&out_lock);
+    if (response_fd >= 0 && encoded_length > 0) {
+        write_full(response_fd, encoded, encoded_length);
+    }
+    // A full ring waits for the host to catch up, unless it has left
+    while (response_shm && !shm_ring_send(&response_shm->to_host, frame, length) &&
+           __atomic_load_n(&response_shm->host_attached, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&out_lock);
+}
+
+static void *device_thread(void *arg) {
+    (void)arg;
+    bootloader_run();
+    return NULL;
+}
+
+static void init_device(void) {
+    if (!initialized) {
+        bootloader_init();
+        platform_set_response_hook(on_response, NULL);
+        initialized = true;
+    }
+}
+
+void device_sim_start(void) {
+    init_device();
+    threaded = pthread_create(&thread, NULL, device_thread, NULL) == 0;
+}
+
+void device_sim_serve(int in_fd, int out_fd) {
+    framer_init(&framer, TRANSPORT_UART);
+    pthread_mutex_lock(&out_lock);
+    response_fd = out_fd;
+    pthread_mutex_unlock(&out_lock);
+    connections++;
+    
+    // This thread is the UART RX interrupt
+    uint8_t chunk[RX_CHUNK_SIZE];
+    for (;;) {
+        ssize_t n = read(in_fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        framer_feed(&framer, chunk, (size_t)n);
+    }
+    
+    pthread_mutex_lock(&out_lock);
+    response_fd = -1;
+    pthread_mutex_unlock(&out_lock);
+    frames_ok += framer.frames_ok;
+    frame_errors += framer.crc_errors + framer.framing_errors;
+}
+
+void device_sim_serve_shm(shm_link_t *link) {
+    init_device();
+    while (!__atomic_load_n(&link->host_attached, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = { 0, 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    pthread_mutex_lock(&out_lock);
+    response_shm = link;
+    pthread_mutex_unlock(&out_lock);
+    connections++;
+    
+    for (;;) {
+        // Straight from the link into an ingress slot. With the queue full
+        // a data packet waits in the ring, as a bulk endpoint NAKs; a
+        // control packet takes the control lane.
+        bool idle = true;
+        const shm_slot_t *packet;
+        while ((packet = shm_ring_peek(&link->to_device)) != NULL) {
+            size_t length = packet->length;
+            if (length > CONTROL_PACKET_SIZE && length <= MAX_PACKET_SIZE) {
+                uint8_t *slot = bootloader_rx_reserve(TRANSPORT_USB);
+                if (!slot) {
+                    break;
+                }
+                memcpy(slot, packet->data, length);
+                bootloader_rx_commit(TRANSPORT_USB, length);
+            } else {
+                bootloader_receive_packet_from(TRANSPORT_USB, packet->data, length);
+            }
+            shm_ring_consume(&link->to_device);
+            idle = false;
+        }
+        
+        bootloader_process_cycle();
+        if (idle) {
+            if (!__atomic_load_n(&link->host_attached, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    
+    pthread_mutex_lock(&out_lock);
+    response_shm = NULL;
+    pthread_mutex_unlock(&out_lock);
+}
+
+void device_sim_stop(void) {
+    // Validation runs once the end of session has been ACKed
+    for (int i = 0; i < SETTLE_TIMEOUT_MS; i++) {
+        if (!threaded) {
+            bootloader_process_cycle();
+        }
+        bootloader_stats_t stats;
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_VERIFY && stats.state != STATE_RUNNING_APP) {
+            break;
+        }
+        struct timespec ts = { 0, 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    if (threaded) {
+        bootloader_stop();
+        pthread_join(thread, NULL);
+        threaded = false;
+    }
+    platform_set_response_hook(NULL, NULL);
+    initialized = false;
+}
+
+void device_sim_get_stats(device_sim_stats_t *stats) {
+    bootloader_get_stats(&stats->bootloader);
+    stats->connections = connections;
+    stats->frames_ok = frames_ok;
+    stats->frame_errors = frame_errors;
+}
@@ -0,0 +1,40 @@
+#ifndef DEVICE_SIM_H
+#define DEVICE_SIM_H
+
+#include "framer.h"
+#include "shm_link.h"
+
+// Device end of a byte stream link, standing in for a board on a UART: the
+// bootloader runs on its own thread under bootloader_run(), and the bytes
+// read from the stream go through a COBS framer on TRANSPORT_UART as the RX
+// interrupt would feed them. Responses go back framed on the same stream.
+// A shared-memory link (shm_link.h) can stand in for the stream.
+
+typedef struct {
+    bootloader_stats_t bootloader;
+    uint32_t connections;
+    uint32_t frames_ok;
+    uint32_t frame_errors;    // CRC and framing errors
+} device_sim_stats_t;
+
+void device_sim_start(void);
+
+// Feeds everything read from in_fd to the bootloader, answering on out_fd,
+// until the stream closes. The bootloader keeps running across calls, as a
+// board does when the host reconnects.
+void device_sim_serve(int in_fd, int out_fd);
+
+// Waits for a host to attach to the shared-memory link, then feeds its
+// packets to the bootloader on TRANSPORT_USB - packet-based, like a bulk
+// endpoint - until it detaches. Responses go back on the link. Instead of
+// device_sim_start()'s thread, the caller runs the bootloader, polled: it
+// alternates between the link and bootloader_process_cycle(), so nothing
+// on the path from host to state machine sleeps or makes a syscall.
+void device_sim_serve_shm(shm_link_t *link);
+
+// Lets a validation in progress finish, then stops the bootloader
+void device_sim_stop(void);
+
+void device_sim_get_stats(device_sim_stats_t *stats);
+
+#endif
@@ -0,0 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "crc32.h"
+#include "device_sim.h"
+#include "host_link.h"
+#include "image_format.h"
+#include "image_loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Host flashing tool: sends a firmware image to a bootloader (host_link.h)
+//
+//   dfu_flash [options] IMAGE              Flash a local bootloader process
+//   dfu_flash --port PATH [options] IMAGE  ... one behind a UNIX socket, a
+//                                          pty or a serial device, such as
+//                                          bootloaderd
+//   dfu_flash --shm PATH [options] IMAGE   ... bootloaderd on shared memory
+//
+// IMAGE is a raw image, Intel HEX, S-records or ELF (image_loader.h), or a
+// container from dfu_pack whose chunks are all checked against their CRCs
+// and the root, and unpacked, one worker per CPU, before the first is sent. Each session carries a CRC of
+// every flash page - a container's chunk table, or computed here - so the
+// bootloader names the pages that did not program right and only those are
+// sent again.
+//
+// Given several --port options, or --spawn N local bootloaders, it flashes
+// them all at once as a gang programmer does, from one event loop
+// (host_link_flash_all()). The image is mapped once and shared by every
+// session.
+
+#define DEFAULT_TIMEOUT_MS 50
+#define DEFAULT_RETRIES 10
+#define DEFAULT_IMAGE_CRC 0x1234 // What the simulated validation computes
+#define MAX_DEVICES 64
+#define MAX_INPUT_SIZE (64 << 20) // HEX and ELF files run larger than the image
+
+static host_link_t links[MAX_DEVICES];
+static const char *ports[MAX_DEVICES];
+static pid_t devices[MAX_DEVICES];
+static image_load_t load;
+static uint32_t page_crcs[IMAGE_MAX_CHUNKS];
+
+// A tty carries the frames as raw bytes: no echo, line editing or CR/LF
+// translation. Speed and flow control are left as configured.
+static void set_raw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        return;
+    }
+    tio.c_iflag &= ~(tcflag_t)(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tio.c_oflag &= ~(tcflag_t)OPOST;
+    tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(tcflag_t)(CSIZE | PARENB);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+// ---- Host side ----
+
+static int open_port(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    if (S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd >= 0 && isatty(fd)) {
+        set_raw(fd);
+        tcflush(fd, TCIOFLUSH); // Responses meant for an earlier host
+    }
+    return fd;
+}
+
+static const uint8_t *map_image(const char *path, uint32_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "dfu_flash: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if (st.st_size == 0 || st.st_size > MAX_INPUT_SIZE) {
+        fprintf(stderr, "dfu_flash: %s: empty, or over %d MiB\n", path, MAX_INPUT_SIZE >> 20);
+        close(fd);
+        return NULL;
+    }
+    void *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "dfu_flash: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    *size = (uint32_t)st.st_size;
+    return image;
+}
+
+// Unpacks a container into a buffer of its own, or loads any other build
+// output into the flat image of the application area
+static const uint8_t *unpack_image(const char *path, const uint8_t *file, uint32_t *size) {
+    if (*size < 4 || memcmp(file, "DFUC", 4) != 0) {
+        if (!image_load(file, *size, &load)) {
+            fprintf(stderr, "dfu_flash: %s: %s\n", path, load.error);
+            return NULL;
+        }
+        if (load.input != IMAGE_INPUT_BINARY) {
+            printf("Loaded %u bytes in %u region(s); %u bytes of holes are sent erased\n",
+                   load.loaded, load.region_count, load.size - load.loaded);
+        }
+        *size = load.size;
+        for (uint32_t offset = 0; offset < load.size; offset += FLASH_PAGE_SIZE) {
+            uint32_t length = load.size - offset < FLASH_PAGE_SIZE ? load.size - offset :
+                              FLASH_PAGE_SIZE;
+            page_crcs[offset / FLASH_PAGE_SIZE] = crc32_update(0, &load.data[offset], length);
+        }
+        return load.data;
+    }
+    image_header_t header;
+    if (!image_read_header(file, *size, &header)) {
+        fprintf(stderr, "dfu_flash: %s: damaged container header\n", path);
+        return NULL;
+    }
+    if (header.load_address != APPLICATION_START) {
+        fprintf(stderr, "dfu_flash: %s: a session can only load at 0x%08X\n", path,
+                APPLICATION_START);
+        return NULL;
+    }
+    uint8_t *image = malloc(header.chunk_count * IMAGE_CHUNK_SIZE);
+    if (!image) {
+        fprintf(stderr, "dfu_flash: %s: out of memory\n", path);
+        return NULL;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t bad_chunk;
+    if (!image_unpack_all(file, *size, &header, image, cpus > 0 ? (int)cpus : 1, &bad_chunk)) {
+        if (bad_chunk < header.chunk_count) {
+            fprintf(stderr, "dfu_flash: %s: chunk %u is damaged\n", path, bad_chunk);
+        } else {
+            fprintf(stderr, "dfu_flash: %s: chunk CRCs do not match the root\n", path);
+        }
+        free(image);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header.chunk_count; i++) {
+        image_chunk_t chunk;
+        image_read_chunk(file, i, &chunk);
+        page_crcs[i] = chunk.crc; // A chunk is a page
+    }
+    *size = header.image_size;
+    return image;
+}
+
+// A bootloader in a child process on the other end of a socketpair. Its
+// counters go to stderr when it exits, unless a gang of them would flood it.
+static pid_t spawn_device(int *fd, bool report_stats) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        fprintf(stderr, "dfu_flash: socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+    pid_t device = fork();
+    if (device == 0) {
+        close(pair[0]);
+        for (int i = 0; i < MAX_DEVICES; i++) {
+            if (devices[i] > 0) {
+                close(links[i].fd); // Earlier devices see their host go
+            }
+        }
+        device_sim_start();
+        device_sim_serve(pair[1], pair[1]);
+        device_sim_stop();
+        device_sim_stats_t stats;
+        device_sim_get_stats(&stats);
+        if (report_stats) {
+            fprintf(stderr, "device: %u packets, %u dropped, %u duplicates, %u frame errors\n",
+                    stats.bootloader.packets_processed, stats.bootloader.packets_dropped,
+                    stats.bootloader.duplicate_packets, stats.frame_errors);
+        }
+        _exit(stats.bootloader.app_launch_attempts > 0 ? 0 : 1);
+    }
+    close(pair[1]);
+    *fd = pair[0];
+    return device;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: dfu_flash [--port PATH ... | --spawn N | --shm PATH] [--window N]\n"
+            "                 [--timeout MS] [--retries N] [--crc HEX] IMAGE\n"
+            "\n"
+            "  --port PATH    UNIX socket, pty or serial device with a bootloader on it;\n"
+            "                 repeat to flash up to %d at once\n"
+            "  --spawn N      start N local bootloader processes and flash them all\n"
+            "                 (default: one)\n"
+            "  --shm PATH     shared-memory link of a bootloaderd --shm\n"
+            "  --window N     packets in flight, 1-%d (default %d)\n"
+            "  --timeout MS   retransmit timeout (default %d)\n"
+            "  --retries N    timeouts in a row before giving up (default %d)\n"
+            "  --crc HEX      image CRC for the session start (default 0x%04X)\n",
+            MAX_DEVICES, DUPLICATE_WINDOW, BUFFER_SIZE, DEFAULT_TIMEOUT_MS, DEFAULT_RETRIES,
+            DEFAULT_IMAGE_CRC);
+}
+
+int main(int argc, char **argv) {
+    host_flash_options_t options = { BUFFER_SIZE, DEFAULT_TIMEOUT_MS * 1000, DEFAULT_RETRIES,
+                                     DEFAULT_IMAGE_CRC, page_crcs };
+    int port_count = 0;
+    int spawn = 0;
+    const char *shm_path = NULL;
+    const char *image_path = NULL;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--port") == 0 && value && port_count < MAX_DEVICES) {
+            ports[port_count++] = value;
+        } else if (strcmp(argv[i], "--spawn") == 0 && value) {
+            spawn = (int)strtol(value, NULL, 0);
+        } else if (strcmp(argv[i], "--shm") == 0 && value) {
+            shm_path = value;
+        } else if (strcmp(argv[i], "--window") == 0 && value) {
+            options.window = (uint32_t)strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i], "--timeout") == 0 && value) {
+            options.timeout_us = (uint32_t)strtoul(value, NULL, 0) * 1000;
+        } else if (strcmp(argv[i], "--retries") == 0 && value) {
+            options.retries = (uint32_t)strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i], "--crc") == 0 && value) {
+            options.image_crc = (uint16_t)strtoul(value, NULL, 16);
+        } else if (argv[i][0] != '-' && !image_path) {
+            image_path = argv[i];
+            continue;
+        } else {
+            usage();
+            return 2;
+        }
+        i++;
+    }
+    if (port_count == 0 && !shm_path && spawn == 0) {
+        spawn = 1;
+    }
+    // The device tells retransmissions from new packets within its
+    // duplicate window only
+    if (!image_path || (port_count > 0) + (shm_path != NULL) + (spawn != 0) != 1 ||
+        spawn < 0 || spawn > MAX_DEVICES || options.window == 0 ||
+        options.window > DUPLICATE_WINDOW || options.timeout_us == 0 || options.retries == 0) {
+        usage();
+        return 2;
+    }
+    
+    uint32_t size;
+    const uint8_t *file = map_image(image_path, &size);
+    const uint8_t *image = file ? unpack_image(image_path, file, &size) : NULL;
+    if (!image) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    int count = spawn > 0 ? spawn : port_count > 0 ? port_count : 1;
+    shm_link_t *shm = NULL;
+    if (shm_path) {
+        shm = shm_link_attach(shm_path);
+        if (!shm) {
+            fprintf(stderr, "dfu_flash: %s: no shared-memory link\n", shm_path);
+            return 1;
+        }
+        host_link_init_shm(&links[0], shm);
+    }
+    for (int i = 0; i < port_count; i++) {
+        int fd = open_port(ports[i]);
+        if (fd < 0) {
+            fprintf(stderr, "dfu_flash: %s: %s\n", ports[i], strerror(errno));
+            return 1;
+        }
+        host_link_init_stream(&links[i], fd);
+    }
+    for (int i = 0; i < spawn; i++) {
+        int fd;
+        devices[i] = spawn_device(&fd, spawn == 1);
+        if (devices[i] < 0) {
+            return 1;
+        }
+        host_link_init_stream(&links[i], fd);
+    }
+    
+    uint32_t start_time = get_system_tick();
+    bool flashed = count == 1 ? host_link_flash(&links[0], image, size, &options) :
+                                host_link_flash_all(links, count, image, size, &options);
+    double seconds = (get_system_tick() - start_time) / 1e6;
+    int flashed_count = 0;
+    int launched_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (shm) {
+            shm_link_detach(shm);
+        } else {
+            close(links[i].fd);
+        }
+        if (links[i].phase == HOST_PHASE_DONE) {
+            flashed_count++;
+        } else {
+            fprintf(stderr, "dfu_flash: %s%s%s\n", port_count > 0 ? ports[i] : "",
+                    port_count > 0 ? ": " : "", links[i].error);
+        }
+    }
+    for (int i = 0; i < spawn; i++) {
+        int status;
+        bool launched = waitpid(devices[i], &status, 0) == devices[i] &&
+                        WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        launched_count += launched;
+    }
+    
+    if (count == 1) {
+        host_link_t *link = &links[0];
+        printf("%s %u bytes in %.3f s: %.1f KiB/s, %.0f packets/s\n",
+               flashed ? "Flashed" : "Failed after", size, seconds,
+               seconds > 0 ? size / 1024.0 / seconds : 0.0,
+               seconds > 0 ? link->packets_sent / seconds : 0.0);
+        printf("  packets %u sent, %u retransmitted, %u timeouts\n",
+               link->packets_sent, link->retransmissions, link->timeouts);
+        printf("  responses %u ACK, %u NACK, %u bad frames; %llu bytes on the wire\n",
+               link->acks, link->nacks, link->frame_errors, (unsigned long long)link->bytes_out);
+        if (link->repair_sessions > 0) {
+            printf("  %u repair sessions for bad pages: %llu bytes on the wire\n",
+                   link->repair_sessions, (unsigned long long)link->repair_bytes_out);
+        }
+    } else {
+        printf("Flashed %d of %d devices, %u bytes each, in %.3f s: %.2f MB/s in total\n",
+               flashed_count, count, size, seconds,
+               seconds > 0 ? (double)size * flashed_count / 1e6 / seconds : 0.0);
+        for (int i = 0; i < count; i++) {
+            host_link_t *link = &links[i];
+            char name[16];
+            snprintf(name, sizeof(name), "local %d", i);
+            printf("  %-16s %-6s %7.3f s  %u packets, %u retransmitted, %u timeouts, %u repairs\n",
+                   port_count > 0 ? ports[i] : name,
+                   link->phase == HOST_PHASE_DONE ? "done" : "FAILED",
+                   (link->finished_at - link->started_at) / 1e6,
+                   link->packets_sent, link->retransmissions, link->timeouts,
+                   link->repair_sessions);
+        }
+    }
+    if (spawn == 1 && flashed && launched_count == 0) {
+        printf("  the bootloader did not launch the image - check --crc\n");
+    } else if (flashed && launched_count < spawn) {
+        printf("  %d bootloaders did not launch the image - check --crc\n", spawn - launched_count);
+    }
+    return flashed && launched_count == spawn ? 0 : 1;
+}
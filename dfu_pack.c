@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "image_format.h"
+#include "image_loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Firmware packager: turns a build output - raw binary, Intel HEX,
+// S-records or ELF (image_loader.h) - into a container (image_format.h)
+// that dfu_flash checks chunk by chunk before it sends anything. Holes
+// between the loaded regions become erased chunks, stored as nothing.
+//
+//   dfu_pack [--threads N] [--no-compress] IMAGE OUTPUT
+
+static image_load_t load;
+static uint8_t container[IMAGE_MAX_CONTAINER_SIZE];
+
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: dfu_pack [--threads N] [--no-compress] IMAGE OUTPUT\n"
+            "\n"
+            "  --threads N    chunks packed in parallel (default: one per CPU)\n"
+            "  --no-compress  store every chunk as is\n");
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    image_pack_options_t options = { cpus > 0 ? (int)cpus : 1, true };
+    const char *paths[2] = { NULL, NULL };
+    int path_count = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = (int)strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--no-compress") == 0) {
+            options.compress = false;
+        } else if (argv[i][0] != '-' && path_count < 2) {
+            paths[path_count++] = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (path_count != 2 || options.threads < 1) {
+        usage();
+        return 2;
+    }
+    
+    int fd = open(paths[0], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "dfu_pack: %s: %s\n", paths[0], strerror(errno));
+        return 1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "dfu_pack: %s: empty file\n", paths[0]);
+        return 1;
+    }
+    void *input = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (input == MAP_FAILED) {
+        fprintf(stderr, "dfu_pack: %s: %s\n", paths[0], strerror(errno));
+        return 1;
+    }
+    
+    double start_time = seconds_now();
+    if (!image_load(input, (size_t)st.st_size, &load)) {
+        fprintf(stderr, "dfu_pack: %s: %s\n", paths[0], load.error);
+        return 1;
+    }
+    double load_seconds = seconds_now() - start_time;
+    uint32_t size = load.size;
+    
+    image_pack_stats_t stats;
+    start_time = seconds_now();
+    size_t length = image_pack(load.data, size, container, &options, &stats);
+    double seconds = seconds_now() - start_time;
+    if (length == 0) {
+        fprintf(stderr, "dfu_pack: out of memory\n");
+        return 1;
+    }
+    
+    FILE *file = fopen(paths[1], "wb");
+    if (!file || fwrite(container, 1, length, file) != length || fclose(file) != 0) {
+        fprintf(stderr, "dfu_pack: %s: %s\n", paths[1], strerror(errno));
+        return 1;
+    }
+    static const char *input_names[] = { "binary", "Intel HEX", "S-records", "ELF" };
+    printf("Loaded %u bytes from %s in %.3f s: %u region(s) over 0x%08X-0x%08X\n",
+           load.loaded, input_names[load.input], load_seconds, load.region_count,
+           APPLICATION_START, APPLICATION_START + size - 1);
+    uint32_t end = APPLICATION_START;
+    for (uint32_t i = 0; i < load.region_count && i < IMAGE_MAX_REGIONS; i++) {
+        const image_region_t *region = &load.regions[i];
+        if (region->address > end) {
+            printf("  gap    0x%08X-0x%08X %7u bytes\n", end, region->address - 1,
+                   region->address - end);
+        }
+        printf("  region 0x%08X-0x%08X %7u bytes\n", region->address,
+               region->address + region->length - 1, region->length);
+        end = region->address + region->length;
+    }
+    if (load.region_count > IMAGE_MAX_REGIONS) {
+        printf("  ... %u more regions\n", load.region_count - IMAGE_MAX_REGIONS);
+    }
+    
+    uint32_t chunks = (size + IMAGE_CHUNK_SIZE - 1) / IMAGE_CHUNK_SIZE;
+    printf("Packed %u bytes into %zu (%.1f%%) in %.3f s with %d thread(s)\n",
+           size, length, length * 100.0 / size, seconds, options.threads);
+    printf("  %u chunks of %d bytes: %u run-length encoded, %u erased, %u stored as is\n",
+           chunks, IMAGE_CHUNK_SIZE, stats.chunks_rle, stats.chunks_erased,
+           chunks - stats.chunks_rle - stats.chunks_erased);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# End-to-end check of the host <-> device path: dfu_flash against
+# bootloaderd over a UNIX socket, a pty and shared memory, from a dfu_pack
+# container, then to three daemons at once; each flash file is compared
+# with the image
+
+set -e
+
+WORK=$(mktemp -d)
+DAEMON=
+cleanup() {
+    [ -n "$DAEMON" ] && kill $DAEMON 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+APP_OFFSET=32768 # APPLICATION_START & 0x1FFFFF
+head -c 100000 /dev/urandom > "$WORK/image.bin"
+
+check_flash() {
+    if cmp -s -n 100000 -i 0:$APP_OFFSET "$WORK/image.bin" "${1:-$WORK/flash.bin}"; then
+        echo "Flash file matches the image"
+    else
+        echo "Flash file does not match the image"
+        exit 1
+    fi
+}
+
+echo "=== UNIX socket ==="
+./bootloaderd --socket "$WORK/sock" --flash "$WORK/flash.bin" &
+DAEMON=$!
+for i in $(seq 50); do [ -S "$WORK/sock" ] && break; sleep 0.1; done
+./dfu_flash --port "$WORK/sock" "$WORK/image.bin"
+check_flash
+kill $DAEMON; wait $DAEMON 2>/dev/null || true
+
+echo "=== PTY ==="
+rm -f "$WORK/flash.bin"
+./bootloaderd --pty "$WORK/tty" --flash "$WORK/flash.bin" &
+DAEMON=$!
+for i in $(seq 50); do [ -e "$WORK/tty" ] && break; sleep 0.1; done
+./dfu_flash --port "$WORK/tty" "$WORK/image.bin"
+check_flash
+kill $DAEMON; wait $DAEMON 2>/dev/null || true
+
+echo "=== Shared memory ==="
+rm -f "$WORK/flash.bin"
+./bootloaderd --shm "$WORK/shm" --flash "$WORK/flash.bin" &
+DAEMON=$!
+for i in $(seq 50); do [ -s "$WORK/shm" ] && break; sleep 0.1; done
+./dfu_flash --shm "$WORK/shm" "$WORK/image.bin"
+check_flash
+kill $DAEMON; wait $DAEMON 2>/dev/null || true
+
+echo "=== Container ==="
+rm -f "$WORK/flash.bin" "$WORK/sock"
+./dfu_pack "$WORK/image.bin" "$WORK/image.dfu"
+./bootloaderd --socket "$WORK/sock" --flash "$WORK/flash.bin" &
+DAEMON=$!
+for i in $(seq 50); do [ -S "$WORK/sock" ] && break; sleep 0.1; done
+./dfu_flash --port "$WORK/sock" "$WORK/image.dfu"
+check_flash
+kill $DAEMON; wait $DAEMON 2>/dev/null || true
+
+echo "=== Gang of three ==="
+DAEMON=
+for n in 0 1 2; do
+    ./bootloaderd --socket "$WORK/gang$n" --flash "$WORK/gang$n.bin" &
+    DAEMON="$DAEMON $!"
+done
+for n in 0 1 2; do
+    for i in $(seq 50); do [ -S "$WORK/gang$n" ] && break; sleep 0.1; done
+done
+./dfu_flash --port "$WORK/gang0" --port "$WORK/gang1" --port "$WORK/gang2" "$WORK/image.bin"
+for n in 0 1 2; do
+    check_flash "$WORK/gang$n.bin"
+done
+
+echo "✓ End-to-end test passed"
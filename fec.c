@@ -0,0 +1,301 @@
+#include "fec.h"
+#include <string.h>
+
+// GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static bool gf_ready;
+
+static void gf_init(void) {
+    if (gf_ready) {
+        return;
+    }
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11D;
+        }
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    gf_ready = true;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Coefficient of data symbol i in parity symbol j: 1 / (x_j + y_i) with
+// x_j = FEC_GROUP_DATA + j and y_i = i. Every square submatrix of a Cauchy
+// matrix is invertible, so any `parity` losses can be rebuilt.
+static uint8_t cauchy(int j, int i) {
+    return gf_inv((uint8_t)((FEC_GROUP_DATA + j) ^ i));
+}
+
+// dst += c * src
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length) {
+    if (c == 0) {
+        return;
+    }
+    unsigned log_c = gf_log[c];
+    for (size_t k = 0; k < length; k++) {
+        if (src[k]) {
+            dst[k] ^= gf_exp[log_c + gf_log[src[k]]];
+        }
+    }
+}
+
+// ---- Host side ----
+
+void fec_encoder_init(fec_encoder_t *enc, uint8_t parity) {
+    gf_init();
+    memset(enc, 0, sizeof(*enc));
+    enc->parity = parity < FEC_MAX_PARITY ? parity : FEC_MAX_PARITY;
+}
+
+static int emit_parity(fec_encoder_t *enc, uint8_t frames[][FEC_MAX_FRAME_SIZE], size_t *lengths) {
+    for (int j = 0; j < enc->parity; j++) {
+        frames[j][0] = enc->group;
+        frames[j][1] = (uint8_t)(FEC_GROUP_DATA + j);
+        frames[j][2] = enc->count;
+        memcpy(&frames[j][FEC_HEADER_SIZE], enc->parity_symbols[j], enc->symbol_length);
+        lengths[j] = FEC_HEADER_SIZE + enc->symbol_length;
+    }
+    enc->group++;
+    enc->count = 0;
+    enc->symbol_length = 0;
+    memset(enc->parity_symbols, 0, sizeof(enc->parity_symbols));
+    return enc->parity;
+}
+
+int fec_encode(fec_encoder_t *enc, const uint8_t *packet, size_t length,
+               uint8_t frames[][FEC_MAX_FRAME_SIZE], size_t *lengths) {
+    if (length > MAX_PACKET_SIZE) {
+        return 0;
+    }
+    frames[0][0] = enc->group;
+    frames[0][1] = enc->count;
+    frames[0][2] = 0;
+    memcpy(&frames[0][FEC_HEADER_SIZE], packet, length);
+    lengths[0] = FEC_HEADER_SIZE + length;
+    
+    // The parity covers the length too, so rebuilt packets know their size
+    uint8_t symbol[FEC_SYMBOL_SIZE];
+    symbol[0] = (uint8_t)(length >> 8);
+    symbol[1] = (uint8_t)length;
+    memcpy(&symbol[2], packet, length);
+    for (int j = 0; j < enc->parity; j++) {
+        gf_mul_add(enc->parity_symbols[j], symbol, cauchy(j, enc->count), 2 + length);
+    }
+    if (2 + length > enc->symbol_length) {
+        enc->symbol_length = 2 + length;
+    }
+    
+    if (++enc->count == FEC_GROUP_DATA) {
+        return 1 + emit_parity(enc, &frames[1], &lengths[1]);
+    }
+    return 1;
+}
+
+int fec_flush(fec_encoder_t *enc, uint8_t frames[][FEC_MAX_FRAME_SIZE], size_t *lengths) {
+    return enc->count > 0 ? emit_parity(enc, frames, lengths) : 0;
+}
+
+// ---- Device side ----
+
+void fec_decoder_init(fec_decoder_t *dec, transport_t transport) {
+    gf_init();
+    memset(dec, 0, sizeof(*dec));
+    dec->transport = transport;
+}
+
+static bool data_present(const fec_decoder_t *dec, int index) {
+    return (dec->data_present & (1u << index)) != 0;
+}
+
+static void deliver(fec_decoder_t *dec, int index) {
+    const uint8_t *symbol = dec->data[index];
+    size_t length = ((size_t)symbol[0] << 8) | symbol[1];
+    bootloader_receive_packet_from(dec->transport, &symbol[2], length);
+}
+
+static void deliver_in_order(fec_decoder_t *dec) {
+    while (dec->next_delivery < FEC_GROUP_DATA && data_present(dec, dec->next_delivery)) {
+        deliver(dec, dec->next_delivery++);
+    }
+    if (dec->next_delivery >= (dec->count ? dec->count : FEC_GROUP_DATA)) {
+        dec->open = false;
+    }
+}
+
+// Gives up on the rest of a group: whatever arrived after its gap goes to
+// the bootloader, which resynchronises with the host as without FEC
+static void close_group(fec_decoder_t *dec) {
+    if (!dec->open) {
+        return;
+    }
+    int count = dec->count;
+    for (int i = FEC_GROUP_DATA - 1; count == 0 && i >= 0; i--) {
+        if (data_present(dec, i)) {
+            count = i + 1;
+        }
+    }
+    for (int i = dec->next_delivery; i < count; i++) {
+        if (data_present(dec, i)) {
+            deliver(dec, i);
+        } else {
+            dec->lost++;
+        }
+    }
+    dec->open = false;
+}
+
+// Rebuilds the missing data symbols once there are as many parity symbols
+static void try_decode(fec_decoder_t *dec) {
+    uint8_t missing[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+    int erasures = 0, available = 0;
+    if (dec->count == 0) {
+        return;
+    }
+    for (int i = 0; i < dec->count; i++) {
+        if (!data_present(dec, i)) {
+            if (erasures == FEC_MAX_PARITY) {
+                return;
+            }
+            missing[erasures++] = (uint8_t)i;
+        }
+    }
+    for (int j = 0; j < FEC_MAX_PARITY && available < erasures; j++) {
+        if (dec->parity_present & (1u << j)) {
+            rows[available++] = (uint8_t)j;
+        }
+    }
+    if (erasures == 0 || available < erasures) {
+        return;
+    }
+    
+    // Syndromes: take what the received data contributes out of a copy of
+    // each parity symbol, leaving the contribution of the missing symbols.
+    // The parity itself stays as received for a retry after a failed rebuild.
+    for (int r = 0; r < erasures; r++) {
+        memcpy(dec->syndromes[r], dec->parity[rows[r]], dec->symbol_length);
+        for (int i = 0; i < dec->count; i++) {
+            if (data_present(dec, i)) {
+                gf_mul_add(dec->syndromes[r], dec->data[i], cauchy(rows[r], i), dec->symbol_length);
+            }
+        }
+    }
+    
+    // Invert the erasures x erasures Cauchy submatrix (Gauss-Jordan)
+    uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for (int r = 0; r < erasures; r++) {
+        for (int c = 0; c < erasures; c++) {
+            a[r][c] = cauchy(rows[r], missing[c]);
+            inv[r][c] = (r == c);
+        }
+    }
+    for (int col = 0; col < erasures; col++) {
+        int pivot = col;
+        while (a[pivot][col] == 0) {
+            pivot++;
+        }
+        for (int c = 0; pivot != col && c < erasures; c++) {
+            uint8_t t = a[col][c];
+            a[col][c] = a[pivot][c];
+            a[pivot][c] = t;
+            t = inv[col][c];
+            inv[col][c] = inv[pivot][c];
+            inv[pivot][c] = t;
+        }
+        uint8_t scale = gf_inv(a[col][col]);
+        for (int c = 0; c < erasures; c++) {
+            a[col][c] = gf_mul(a[col][c], scale);
+            inv[col][c] = gf_mul(inv[col][c], scale);
+        }
+        for (int r = 0; r < erasures; r++) {
+            uint8_t factor = a[r][col];
+            if (r == col || factor == 0) {
+                continue;
+            }
+            for (int c = 0; c < erasures; c++) {
+                a[r][c] ^= gf_mul(factor, a[col][c]);
+                inv[r][c] ^= gf_mul(factor, inv[col][c]);
+            }
+        }
+    }
+    
+    for (int c = 0; c < erasures; c++) {
+        uint8_t *symbol = dec->data[missing[c]];
+        memset(symbol, 0, FEC_SYMBOL_SIZE);
+        for (int r = 0; r < erasures; r++) {
+            gf_mul_add(symbol, dec->syndromes[r], inv[c][r], dec->symbol_length);
+        }
+        size_t length = ((size_t)symbol[0] << 8) | symbol[1];
+        if (length < PACKET_HEADER_SIZE || length > MAX_PACKET_SIZE) {
+            continue; // Corrupt parity; leave the gap to the bootloader
+        }
+        dec->data_present |= (uint16_t)(1u << missing[c]);
+        dec->recovered++;
+    }
+}
+
+void fec_receive_frame(fec_decoder_t *dec, const uint8_t *frame, size_t length) {
+    if (length < FEC_HEADER_SIZE) {
+        return;
+    }
+    dec->frames++;
+    uint8_t index = frame[1];
+    const uint8_t *body = &frame[FEC_HEADER_SIZE];
+    size_t body_length = length - FEC_HEADER_SIZE;
+    
+    if (!dec->started || frame[0] != dec->group) {
+        close_group(dec);
+        dec->started = true;
+        dec->group = frame[0];
+        dec->open = true;
+        dec->count = 0;
+        dec->symbol_length = 0;
+        dec->data_present = 0;
+        dec->parity_present = 0;
+        dec->next_delivery = 0;
+    }
+    if (!dec->open) {
+        return; // Everything delivered; late parity is of no use
+    }
+    
+    if (index < FEC_GROUP_DATA) {
+        if (body_length < PACKET_HEADER_SIZE || body_length > MAX_PACKET_SIZE ||
+            data_present(dec, index) || index < dec->next_delivery) {
+            return;
+        }
+        uint8_t *symbol = dec->data[index];
+        symbol[0] = (uint8_t)(body_length >> 8);
+        symbol[1] = (uint8_t)body_length;
+        memcpy(&symbol[2], body, body_length);
+        memset(&symbol[2 + body_length], 0, FEC_SYMBOL_SIZE - 2 - body_length);
+        dec->data_present |= (uint16_t)(1u << index);
+    } else if (index < FEC_GROUP_DATA + FEC_MAX_PARITY) {
+        int j = index - FEC_GROUP_DATA;
+        if (body_length > FEC_SYMBOL_SIZE || frame[2] == 0 || frame[2] > FEC_GROUP_DATA ||
+            (dec->parity_present & (1u << j))) {
+            return;
+        }
+        dec->count = frame[2];
+        dec->symbol_length = body_length;
+        memcpy(dec->parity[j], body, body_length);
+        dec->parity_present |= (uint8_t)(1u << j);
+    } else {
+        return;
+    }
+    
+    try_decode(dec);
+    deliver_in_order(dec);
+}
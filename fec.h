@@ -0,0 +1,68 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include "bootloader.h"
+
+// Forward error correction for lossy links. Packets are sent in groups of
+// up to FEC_GROUP_DATA data frames - one flash page of payload - followed
+// by 1..FEC_MAX_PARITY parity frames of a systematic Cauchy Reed-Solomon
+// code over GF(256). The receiver rebuilds up to as many lost data frames
+// as it got parity frames, without a NACK round trip, and hands packets
+// to the bootloader in order. Losses beyond that fall back to the
+// bootloader's own retransmission.
+//
+// Frame: [group][index][data count][body]. Data frames (index below
+// FEC_GROUP_DATA) carry the packet as the body and a data count of 0.
+// Parity frame j has index FEC_GROUP_DATA + j, the group's data count, and
+// the parity of the data symbols [length:2][packet, zero-padded].
+
+#define FEC_GROUP_DATA (FLASH_PAGE_SIZE / MAX_PAYLOAD_SIZE)
+#define FEC_MAX_PARITY 4
+#define FEC_HEADER_SIZE 3
+#define FEC_SYMBOL_SIZE (2 + MAX_PACKET_SIZE)
+#define FEC_MAX_FRAME_SIZE (FEC_HEADER_SIZE + FEC_SYMBOL_SIZE)
+
+// Host side
+typedef struct {
+    uint8_t parity;          // Parity frames per group
+    uint8_t group;
+    uint8_t count;           // Data frames in the open group
+    size_t symbol_length;    // Longest data symbol in the open group
+    uint8_t parity_symbols[FEC_MAX_PARITY][FEC_SYMBOL_SIZE];
+} fec_encoder_t;
+
+void fec_encoder_init(fec_encoder_t *enc, uint8_t parity);
+
+// Frames a packet into frames[0]; once the group is full, its parity
+// frames follow. Returns the number of frames, their lengths in lengths[].
+int fec_encode(fec_encoder_t *enc, const uint8_t *packet, size_t length,
+               uint8_t frames[][FEC_MAX_FRAME_SIZE], size_t *lengths);
+
+// Closes a partly filled group with its parity frames, e.g. before the
+// host sits waiting for ACKs. Returns 0 if no group is open.
+int fec_flush(fec_encoder_t *enc, uint8_t frames[][FEC_MAX_FRAME_SIZE], size_t *lengths);
+
+// Device side
+typedef struct {
+    transport_t transport;
+    bool started;
+    uint8_t group;
+    bool open;               // Group still has frames to deliver
+    uint8_t count;           // Data frames in the group, 0 until parity seen
+    size_t symbol_length;
+    uint16_t data_present;
+    uint8_t parity_present;
+    uint8_t next_delivery;   // Data frames go to the bootloader in order
+    uint8_t data[FEC_GROUP_DATA][FEC_SYMBOL_SIZE];
+    uint8_t parity[FEC_MAX_PARITY][FEC_SYMBOL_SIZE];
+    uint8_t syndromes[FEC_MAX_PARITY][FEC_SYMBOL_SIZE]; // Decoding scratch
+    
+    uint32_t frames;
+    uint32_t recovered;      // Data frames rebuilt from parity
+    uint32_t lost;           // Data frames neither received nor rebuilt
+} fec_decoder_t;
+
+void fec_decoder_init(fec_decoder_t *dec, transport_t transport);
+void fec_receive_frame(fec_decoder_t *dec, const uint8_t *frame, size_t length);
+
+#endif
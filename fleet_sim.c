@@ -0,0 +1,388 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fleet_sim.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define START_REPEATS 3
+#define QUERY_TIMEOUT_US 60000 // Covers a full device FIFO of writes
+#define QUERY_RETRIES 5
+#define MAX_REPAIR_ROUNDS 50
+#define SETTLE_TIMEOUT_MS 1000
+
+// Host end of one device's bus connection. Host -> device frames are
+// [length:2][packet], device -> host frames [length:1][response].
+typedef struct {
+    pid_t pid;
+    int to_device;
+    int from_device;
+    bool complete;  // Reported no gaps
+} device_t;
+
+static device_t fleet[MAX_FLEET_SIZE];
+static uint8_t repair_map[(MULTICAST_MAX_CHUNKS + 7) / 8];
+
+static bool read_full(int fd, void *buffer, size_t length) {
+    uint8_t *bytes = buffer;
+    while (length > 0) {
+        ssize_t n = read(fd, bytes, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buffer, size_t length) {
+    const uint8_t *bytes = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// ---- Device side (child process) ----
+
+typedef struct {
+    int fd;
+    uint32_t rng;
+    double loss_rate;
+} device_link_t;
+
+static void on_device_response(transport_t transport, const uint8_t *frame, size_t length,
+                               void *ctx) {
+    device_link_t *link = ctx;
+    (void)transport;
+    if (link_sim_frame_lost(&link->rng, link->loss_rate)) {
+        return;
+    }
+    uint8_t buffer[1 + 4 + GAP_REPORT_MAX_RANGES * 4];
+    if (length > sizeof(buffer) - 1) {
+        return;
+    }
+    buffer[0] = (uint8_t)length;
+    memcpy(&buffer[1], frame, length);
+    write_full(link->fd, buffer, 1 + length);
+}
+
+static void *device_thread(void *arg) {
+    (void)arg;
+    bootloader_run();
+    return NULL;
+}
+
+// Feeds bus frames to this device's bootloader until the host closes the
+// bus, then exits with 0 if the new image was validated and launched
+static void run_device(int node, int from_host, int to_host, const fleet_config_t *config) {
+    uint32_t seed = (config->seed ? config->seed : 1) + (uint32_t)node * 0x9E3779B9u;
+    device_link_t response_link = { to_host, seed ^ 0x85EBCA6Bu, config->loss_rate };
+    uint32_t rng = seed ? seed : 1;
+    
+    bootloader_init();
+    bootloader_set_node_id((uint8_t)node);
+    platform_set_response_hook(on_device_response, &response_link);
+    pthread_t thread;
+    pthread_create(&thread, NULL, device_thread, NULL);
+    
+    uint8_t header[2];
+    uint8_t packet[MAX_PACKET_SIZE];
+    while (read_full(from_host, header, sizeof(header))) {
+        size_t length = ((size_t)header[0] << 8) | header[1];
+        if (length > MAX_PACKET_SIZE || !read_full(from_host, packet, length)) {
+            break;
+        }
+        if (!link_sim_frame_lost(&rng, config->loss_rate)) {
+            bootloader_receive_packet_from(TRANSPORT_CAN, packet, length);
+        }
+    }
+    
+    // The end of session waits for the last writes, then validation runs
+    bootloader_stats_t stats;
+    for (int i = 0; i < SETTLE_TIMEOUT_MS; i++) {
+        bootloader_get_stats(&stats);
+        if (stats.app_launch_attempts > 0 || stats.state == STATE_ERROR) {
+            break;
+        }
+        struct timespec ts = { 0, 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    bootloader_stop();
+    pthread_join(thread, NULL);
+    _exit(stats.app_launch_attempts > 0 ? 0 : 1);
+}
+
+// ---- Host side ----
+
+static int spawn_fleet(const fleet_config_t *config) {
+    int count = config->devices < MAX_FLEET_SIZE ? config->devices : MAX_FLEET_SIZE;
+    for (int i = 0; i < count; i++) {
+        int down[2], up[2];
+        if (pipe(down) != 0 || pipe(up) != 0) {
+            return i;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Only this device's own pipe ends stay open, so each sees EOF
+            // as soon as the host closes its end
+            for (int j = 0; j < i; j++) {
+                close(fleet[j].to_device);
+                close(fleet[j].from_device);
+            }
+            close(down[1]);
+            close(up[0]);
+            run_device(i, down[0], up[1], config);
+        }
+        close(down[0]);
+        close(up[1]);
+        fleet[i].pid = pid;
+        fleet[i].to_device = down[1];
+        fleet[i].from_device = up[0];
+        fleet[i].complete = false;
+    }
+    return count;
+}
+
+// Closes the bus and counts the devices that launched the new image
+static int reap_fleet(int count) {
+    int updated = 0;
+    for (int i = 0; i < count; i++) {
+        close(fleet[i].to_device);
+    }
+    for (int i = 0; i < count; i++) {
+        int status;
+        if (waitpid(fleet[i].pid, &status, 0) == fleet[i].pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            updated++;
+        }
+        close(fleet[i].from_device);
+    }
+    return updated;
+}
+
+// Every device on the bus sees every frame
+static void bus_broadcast(int count, const uint8_t *packet, size_t length) {
+    uint8_t frame[2 + MAX_PACKET_SIZE];
+    frame[0] = (uint8_t)(length >> 8);
+    frame[1] = (uint8_t)length;
+    memcpy(&frame[2], packet, length);
+    for (int i = 0; i < count; i++) {
+        write_full(fleet[i].to_device, frame, 2 + length);
+    }
+}
+
+// Sleeps until the bus slot after *next_ns, interval_us long
+static void bus_pace(struct timespec *next, uint32_t interval_us) {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+    next->tv_nsec += (long)interval_us * 1000;
+    while (next->tv_nsec >= 1000000000L) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000L;
+    }
+}
+
+static void broadcast_chunk(const fleet_config_t *config, int count, uint32_t chunk,
+                            struct timespec *next) {
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t offset = chunk * MULTICAST_CHUNK_SIZE;
+    uint32_t length = config->image_size - offset;
+    if (length > MULTICAST_CHUNK_SIZE) {
+        length = MULTICAST_CHUNK_SIZE;
+    }
+    packet[0] = (uint8_t)chunk;
+    packet[1] = PKT_MULTICAST_DATA;
+    packet[2] = (uint8_t)(offset >> 24);
+    packet[3] = (uint8_t)(offset >> 16);
+    packet[4] = (uint8_t)(offset >> 8);
+    packet[5] = (uint8_t)offset;
+    for (uint32_t i = 0; i < length; i++) {
+        packet[PACKET_HEADER_SIZE + 4 + i] = (uint8_t)(offset + i);
+    }
+    bus_pace(next, config->packet_interval_us);
+    bus_broadcast(count, packet, PACKET_HEADER_SIZE + 4 + length);
+}
+
+static void broadcast_start(const fleet_config_t *config, int count) {
+    uint8_t start[] = {0x00, PKT_MULTICAST_START,
+                       (uint8_t)(config->image_size >> 24), (uint8_t)(config->image_size >> 16),
+                       (uint8_t)(config->image_size >> 8), (uint8_t)config->image_size,
+                       0x12, 0x34};
+    bus_broadcast(count, start, sizeof(start));
+}
+
+// Waits for the next response frame from one device
+static int read_response(const device_t *device, uint8_t *frame, uint32_t timeout_us) {
+    struct pollfd pfd = { device->from_device, POLLIN, 0 };
+    if (poll(&pfd, 1, (int)(timeout_us / 1000)) <= 0) {
+        return -1;
+    }
+    uint8_t length;
+    if (!read_full(device->from_device, &length, 1) || !read_full(device->from_device, frame, length)) {
+        return -1;
+    }
+    return length;
+}
+
+#define GAPS_NO_ANSWER -1
+#define GAPS_NO_SESSION -2
+
+// Asks one device for its missing chunks from first_chunk on and marks
+// the reported ranges for repair. Returns the device's total missing
+// count; *resume is where to ask again if the report was cut short, else 0.
+static int query_gaps(int count, int node, uint32_t first_chunk, uint32_t *resume,
+                      fleet_result_t *result) {
+    uint8_t query[] = {0x00, PKT_GAP_QUERY, (uint8_t)node,
+                       (uint8_t)(first_chunk >> 8), (uint8_t)first_chunk};
+    uint8_t frame[4 + GAP_REPORT_MAX_RANGES * 4];
+    *resume = 0;
+    
+    for (int attempt = 0; attempt < QUERY_RETRIES; attempt++) {
+        // Late answers to earlier queries would keep the host a report behind
+        while (read_response(&fleet[node], frame, 0) >= 0) {
+            continue;
+        }
+        result->gap_queries++;
+        bus_broadcast(count, query, sizeof(query));
+        int length;
+        while ((length = read_response(&fleet[node], frame, QUERY_TIMEOUT_US)) >= 0) {
+            if (length >= 2 && frame[0] == RSP_NACK && frame[1] == 0x14) {
+                return GAPS_NO_SESSION;
+            }
+            if (length < 4 || frame[0] != RSP_GAPS || length < 4 + frame[1] * 4) {
+                continue;
+            }
+            int ranges = frame[1];
+            uint32_t last = 0;
+            for (int r = 0; r < ranges; r++) {
+                uint32_t first = ((uint32_t)frame[4 + r * 4] << 8) | frame[5 + r * 4];
+                uint32_t span = ((uint32_t)frame[6 + r * 4] << 8) | frame[7 + r * 4];
+                for (uint32_t c = first; c < first + span && c < MULTICAST_MAX_CHUNKS; c++) {
+                    repair_map[c / 8] |= (uint8_t)(1u << (c % 8));
+                }
+                last = first + span;
+            }
+            if (ranges == GAP_REPORT_MAX_RANGES && last > first_chunk) {
+                *resume = last;
+            }
+            return (frame[2] << 8) | frame[3];
+        }
+    }
+    return GAPS_NO_ANSWER;
+}
+
+void fleet_sim_run_multicast(const fleet_config_t *config, fleet_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    signal(SIGPIPE, SIG_IGN); // A device that died shows up as not updated
+    uint32_t chunk_count = (config->image_size + MULTICAST_CHUNK_SIZE - 1) / MULTICAST_CHUNK_SIZE;
+    if (config->image_size == 0 || config->image_size > MAX_APPLICATION_SIZE) {
+        return;
+    }
+    
+    uint32_t start_time = get_system_tick();
+    int count = spawn_fleet(config);
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    
+    // Nobody acknowledges the start, so it is repeated
+    for (int i = 0; i < START_REPEATS; i++) {
+        broadcast_start(config, count);
+    }
+    for (uint32_t chunk = 0; chunk < chunk_count; chunk++) {
+        broadcast_chunk(config, count, chunk, &next);
+        result->broadcast_packets++;
+    }
+    
+    // Repair rounds: collect every device's gaps, then rebroadcast their
+    // union once; devices drop the chunks they already hold
+    for (uint32_t round = 0; round < MAX_REPAIR_ROUNDS; round++) {
+        memset(repair_map, 0, sizeof(repair_map));
+        bool pending = false, restart = false;
+    
+        for (int node = 0; node < count; node++) {
+            if (fleet[node].complete) {
+                continue;
+            }
+            uint32_t first_chunk = 0;
+            int missing;
+            do {
+                missing = query_gaps(count, node, first_chunk, &first_chunk, result);
+            } while (first_chunk > 0 && missing > 0);
+    
+            if (missing == 0) {
+                fleet[node].complete = true;
+                continue;
+            }
+            pending = true;
+            if (missing == GAPS_NO_SESSION) {
+                // Missed every start: needs the whole image
+                restart = true;
+                memset(repair_map, 0xFF, sizeof(repair_map));
+            }
+        }
+        if (!pending) {
+            break;
+        }
+    
+        result->repair_rounds++;
+        if (restart) {
+            broadcast_start(config, count);
+        }
+        for (uint32_t chunk = 0; chunk < chunk_count; chunk++) {
+            if (repair_map[chunk / 8] & (1u << (chunk % 8))) {
+                broadcast_chunk(config, count, chunk, &next);
+                result->repair_packets++;
+            }
+        }
+    }
+    
+    // The end is not acknowledged either: a device still answering gap
+    // queries afterwards missed it
+    uint8_t end[] = {0x00, PKT_END_SESSION};
+    bus_broadcast(count, end, sizeof(end));
+    for (int node = 0; node < count; node++) {
+        for (int attempt = 0; attempt < QUERY_RETRIES; attempt++) {
+            uint32_t resume;
+            if (query_gaps(count, node, 0, &resume, result) < 0) {
+                break; // No session any more, or gone
+            }
+            bus_broadcast(count, end, sizeof(end));
+        }
+    }
+    result->devices_updated = reap_fleet(count);
+    result->seconds = (get_system_tick() - start_time) / 1e6;
+}
+
+void fleet_sim_run_unicast(const fleet_config_t *config, const dfu_host_config_t *host,
+                           fleet_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    for (int i = 0; i < config->devices; i++) {
+        link_config_t link = { .loss_rate = config->loss_rate,
+                               .response_loss_rate = config->loss_rate,
+                               .seed = config->seed + (uint32_t)i * 0x9E3779B9u,
+                               .transport = TRANSPORT_CAN };
+        dfu_transfer_result_t transfer;
+        link_sim_run_dfu(&link, host, &transfer);
+        result->seconds += transfer.seconds;
+        if (transfer.completed) {
+            result->devices_updated++;
+        }
+    }
+}
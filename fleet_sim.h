@@ -0,0 +1,38 @@
+#ifndef FLEET_SIM_H
+#define FLEET_SIM_H
+
+#include "link_sim.h"
+
+// Fleet emulator: one host updating many devices on a shared bus. Each
+// device is a child process running its own bootloader; every frame the
+// host puts on the bus reaches all of them, and each loses frames
+// independently.
+
+#define MAX_FLEET_SIZE 128
+
+typedef struct {
+    int devices;
+    uint32_t image_size;
+    double loss_rate;            // Per device and frame, both directions
+    uint32_t seed;
+    uint32_t packet_interval_us; // Multicast data pacing: what a device can program
+} fleet_config_t;
+
+typedef struct {
+    int devices_updated;         // Validated and launched the new image
+    uint32_t broadcast_packets;  // First pass over the image
+    uint32_t repair_packets;     // Chunks rebroadcast in repair rounds
+    uint32_t repair_rounds;
+    uint32_t gap_queries;
+    double seconds;
+} fleet_result_t;
+
+// One multicast pass over the image, then repair rounds until no device
+// reports gaps
+void fleet_sim_run_multicast(const fleet_config_t *config, fleet_result_t *result);
+
+// Baseline: the same devices updated one after another over unicast
+void fleet_sim_run_unicast(const fleet_config_t *config, const dfu_host_config_t *host,
+                           fleet_result_t *result);
+
+#endif
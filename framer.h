@@ -0,0 +1,54 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include "bootloader.h"
+
+// Streaming COBS framer for raw byte links such as UART. On the wire each
+// packet is followed by its CRC-16/CCITT (big-endian), COBS-encoded and
+// terminated by a 0x00 delimiter. framer_feed() takes bytes as they arrive -
+// one at a time from the RX interrupt or a whole DMA chunk - and decodes
+// them straight into the transport's next ingress slot. A corrupt frame is
+// dropped at the next delimiter, where decoding resynchronises.
+
+#define FRAME_DELIMITER 0x00
+#define FRAME_CRC_SIZE 2
+
+// Worst-case encoded size of an n-byte packet: CRC, COBS overhead, delimiter
+#define FRAME_MAX_ENCODED_SIZE(n) \
+    ((n) + FRAME_CRC_SIZE + ((n) + FRAME_CRC_SIZE) / 254 + 2)
+
+typedef struct {
+    transport_t transport;
+    uint8_t *out;                 // Ingress slot, or scratch if none was free
+    size_t capacity;
+    size_t length;                // Bytes written to out
+    uint8_t held[FRAME_CRC_SIZE]; // Newest decoded bytes: the CRC at the end
+    uint8_t held_count;
+    uint8_t code;                 // COBS code of the current block
+    uint8_t remaining;            // Data bytes left in the current block
+    uint16_t crc;                 // Over the bytes written to out
+    bool in_frame;
+    bool discard;                 // Malformed; skip to the next delimiter
+    bool overrun;                 // No slot free and too long for scratch
+    uint8_t scratch[CONTROL_PACKET_SIZE];
+    
+    uint32_t frames_ok;
+    uint32_t crc_errors;
+    uint32_t framing_errors;      // Truncated blocks and oversized frames
+    uint32_t overruns;
+} framer_t;
+
+void framer_init(framer_t *framer, transport_t transport);
+void framer_feed(framer_t *framer, const uint8_t *data, size_t length);
+
+// Host side: encodes a packet into a complete frame. Returns the frame
+// length, or 0 if out_size is too small.
+size_t framer_encode(const uint8_t *packet, size_t length, uint8_t *out, size_t out_size);
+
+// Host side: decodes one frame received without its delimiter, e.g. a
+// device response. out needs room for the packet and its CRC. Returns the
+// packet length, or 0 if the frame is malformed, fails its CRC or does not
+// fit.
+size_t framer_decode(const uint8_t *frame, size_t length, uint8_t *out, size_t out_size);
+
+#endif
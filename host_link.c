@@ -0,0 +1,544 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "host_link.h"
+#include "merkle.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define HOST_RESPONSE_BUFFER_SIZE (HOST_RESPONSE_MAX_SIZE + FRAME_CRC_SIZE)
+#define SHM_SEND_TIMEOUT_US 1000000
+#define HOST_EPOLL_BATCH 64
+
+// What a control packet the device keeps refusing was for
+static const char *const control_names[] = {
+    [HOST_PHASE_START] = "session start",
+    [HOST_PHASE_TABLE] = "page CRC table",
+    [HOST_PHASE_END] = "session end",
+    [HOST_PHASE_REPAIR] = "repair session",
+};
+
+static bool write_full(int fd, const void *buffer, size_t length) {
+    const uint8_t *bytes = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+void host_link_init_stream(host_link_t *link, int fd) {
+    memset(link, 0, sizeof(*link));
+    link->fd = fd;
+}
+
+void host_link_init_shm(host_link_t *link, shm_link_t *shm) {
+    memset(link, 0, sizeof(*link));
+    link->fd = -1;
+    link->shm = shm;
+}
+
+static void count_bytes_out(host_link_t *link, size_t length) {
+    link->bytes_out += length;
+    if (link->repair_sessions > 0) {
+        link->repair_bytes_out += length;
+    }
+}
+
+static bool host_send(host_link_t *link, const uint8_t *packet, size_t length) {
+    link->packets_sent++;
+    if (link->shm) {
+        // The device drains its ring continuously; one that stays full
+        // for a whole second is gone
+        uint32_t start = get_system_tick();
+        while (!shm_ring_send(&link->shm->to_device, packet, length)) {
+            if (get_system_tick() - start > SHM_SEND_TIMEOUT_US) {
+                link->closed = true;
+                return false;
+            }
+            sched_yield();
+        }
+        count_bytes_out(link, length);
+        return true;
+    }
+    
+    uint8_t encoded[FRAME_MAX_ENCODED_SIZE(MAX_PACKET_SIZE)];
+    size_t encoded_length = framer_encode(packet, length, encoded, sizeof(encoded));
+    count_bytes_out(link, encoded_length);
+    if (!write_full(link->fd, encoded, encoded_length)) {
+        link->closed = true;
+        return false;
+    }
+    return true;
+}
+
+// Polls the shared-memory link, yielding between polls, without a syscall
+// while responses are waiting
+static size_t shm_receive(host_link_t *link, uint8_t *response, uint32_t timeout_us) {
+    uint32_t start = get_system_tick();
+    for (;;) {
+        size_t length = shm_ring_receive(&link->shm->to_host, response, HOST_RESPONSE_BUFFER_SIZE);
+        if (length >= 2) {
+            return length;
+        }
+        if (get_system_tick() - start >= timeout_us) {
+            return 0;
+        }
+        sched_yield();
+    }
+}
+
+// Next response from the device, waiting up to timeout_us. Returns its
+// length, or 0 if none arrived in time or the link closed.
+static size_t host_receive(host_link_t *link, uint8_t *response, uint32_t timeout_us) {
+    if (link->shm) {
+        return shm_receive(link, response, timeout_us);
+    }
+    uint32_t start = get_system_tick();
+    for (;;) {
+        while (link->in_pos < link->in_length) {
+            uint8_t byte = link->in[link->in_pos++];
+            if (byte != FRAME_DELIMITER) {
+                if (link->frame_length < sizeof(link->frame)) {
+                    link->frame[link->frame_length] = byte;
+                }
+                link->frame_length++;
+                continue;
+            }
+            size_t frame_length = link->frame_length;
+            link->frame_length = 0;
+            if (frame_length == 0) {
+                continue;
+            }
+            size_t length = frame_length <= sizeof(link->frame) ?
+                            framer_decode(link->frame, frame_length, response,
+                                          HOST_RESPONSE_BUFFER_SIZE) : 0;
+            if (length >= 2) {
+                return length;
+            }
+            link->frame_errors++;
+        }
+        if (link->closed) {
+            return 0;
+        }
+        
+        uint32_t elapsed = get_system_tick() - start;
+        int wait_ms = elapsed >= timeout_us ? 0 : (int)((timeout_us - elapsed + 999) / 1000);
+        struct pollfd pfd = { link->fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return 0;
+        }
+        ssize_t n = read(link->fd, link->in, sizeof(link->in));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            link->closed = true;
+            return 0;
+        }
+        link->in_pos = 0;
+        link->in_length = (size_t)n;
+    }
+}
+
+static uint32_t page_count(const host_link_t *link) {
+    return (link->image_size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+}
+
+// The next PKT_PAGE_CRCS packet, numbered so that a late ACK of the one
+// before cannot pass for its own
+static size_t table_packet(const host_link_t *link, uint8_t *packet) {
+    uint32_t first = link->table_next;
+    uint32_t count = page_count(link) - first;
+    if (count > PAGE_CRCS_PER_PACKET) {
+        count = PAGE_CRCS_PER_PACKET;
+    }
+    packet[0] = (uint8_t)(1 + first / PAGE_CRCS_PER_PACKET);
+    packet[1] = PKT_PAGE_CRCS;
+    packet[2] = (uint8_t)(first >> 8);
+    packet[3] = (uint8_t)first;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t crc = link->options->page_crcs[first + i];
+        packet[4 + i * 4] = (uint8_t)(crc >> 24);
+        packet[5 + i * 4] = (uint8_t)(crc >> 16);
+        packet[6 + i * 4] = (uint8_t)(crc >> 8);
+        packet[7 + i * 4] = (uint8_t)crc;
+    }
+    return 4 + count * 4;
+}
+
+static void begin_phase(host_link_t *link, host_phase_t phase) {
+    link->phase = phase;
+    link->stalls = 0;
+    link->last_progress = get_system_tick();
+    uint8_t *control = link->control;
+    switch (phase) {
+        case HOST_PHASE_PING:
+            control[0] = 0x00;
+            control[1] = PKT_PING;
+            link->control_length = 2;
+            break;
+            
+        case HOST_PHASE_START:
+            control[0] = 0x00;
+            control[1] = PKT_START_SESSION;
+            control[2] = (uint8_t)(link->image_size >> 24);
+            control[3] = (uint8_t)(link->image_size >> 16);
+            control[4] = (uint8_t)(link->image_size >> 8);
+            control[5] = (uint8_t)link->image_size;
+            control[6] = (uint8_t)(link->options->image_crc >> 8);
+            control[7] = (uint8_t)link->options->image_crc;
+            link->control_length = 8;
+            if (link->options->page_crcs) {
+                uint32_t root = merkle_root(link->options->page_crcs, page_count(link));
+                control[8] = (uint8_t)(root >> 24);
+                control[9] = (uint8_t)(root >> 16);
+                control[10] = (uint8_t)(root >> 8);
+                control[11] = (uint8_t)root;
+                link->control_length = 12;
+            }
+            break;
+            
+        case HOST_PHASE_TABLE:
+            link->control_length = table_packet(link, control);
+            break;
+            
+        case HOST_PHASE_DATA:
+            link->total_packets = (link->data_size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+            link->base = 1;
+            link->next = 1;
+            link->highest_sent = 0;
+            return; // DATA packets go out from host_link_service()
+            
+        case HOST_PHASE_END:
+            control[0] = (uint8_t)(link->total_packets + 1);
+            control[1] = PKT_END_SESSION;
+            link->control_length = 2;
+            break;
+            
+        case HOST_PHASE_REPAIR:
+            link->repair_sessions++;
+            link->data_offset = link->repair_first * FLASH_PAGE_SIZE;
+            link->data_size = link->repair_count * FLASH_PAGE_SIZE;
+            if (link->data_size > link->image_size - link->data_offset) {
+                link->data_size = link->image_size - link->data_offset;
+            }
+            control[0] = 0x00;
+            control[1] = PKT_REPAIR_START;
+            control[2] = (uint8_t)(link->repair_first >> 8);
+            control[3] = (uint8_t)link->repair_first;
+            control[4] = (uint8_t)(link->repair_count >> 8);
+            control[5] = (uint8_t)link->repair_count;
+            link->control_length = 6;
+            break;
+            
+        case HOST_PHASE_DONE:
+            link->finished_at = link->last_progress;
+            return;
+            
+        default:
+            return;
+    }
+    host_send(link, control, link->control_length);
+}
+
+static void fail(host_link_t *link, const char *reason) {
+    snprintf(link->error, sizeof(link->error), "%s", reason);
+    link->phase = HOST_PHASE_FAILED;
+    link->finished_at = get_system_tick();
+}
+
+void host_link_begin(host_link_t *link, const uint8_t *image, uint32_t size,
+                     const host_flash_options_t *options) {
+    link->image = image;
+    link->image_size = size;
+    link->options = options;
+    link->table_next = 0;
+    link->data_offset = 0;
+    link->data_size = size;
+    link->credits = 0;
+    link->bad_pages = UINT32_MAX;
+    link->repair_stalls = 0;
+    link->repair_sessions = 0;
+    link->repair_bytes_out = 0;
+    link->error[0] = '\0';
+    link->started_at = get_system_tick();
+    link->finished_at = link->started_at;
+    begin_phase(link, HOST_PHASE_PING);
+}
+
+// Where an acknowledged control packet leads
+static host_phase_t next_phase(const host_link_t *link) {
+    switch (link->phase) {
+        case HOST_PHASE_PING:
+            return HOST_PHASE_START;
+        case HOST_PHASE_START:
+            return link->options->page_crcs ? HOST_PHASE_TABLE : HOST_PHASE_DATA;
+        case HOST_PHASE_TABLE:
+            return link->table_next < page_count(link) ? HOST_PHASE_TABLE : HOST_PHASE_DATA;
+        case HOST_PHASE_REPAIR:
+            return HOST_PHASE_DATA;
+        default:
+            return HOST_PHASE_DONE;
+    }
+}
+
+// The session ended with pages that failed their CRC: rewrite the first
+// run reported. Each repair session's end reports what is left.
+static void on_bad_pages(host_link_t *link, const uint8_t *response) {
+    uint32_t bad = (uint32_t)(response[2] << 8) | response[3];
+    link->repair_stalls = bad < link->bad_pages ? 0 : link->repair_stalls + 1;
+    link->bad_pages = bad;
+    if (response[1] == 0 || link->repair_stalls >= link->options->retries) {
+        char reason[sizeof(link->error)];
+        snprintf(reason, sizeof(reason), "%u pages still bad after %u repair sessions",
+                 bad, link->repair_sessions);
+        fail(link, reason);
+        return;
+    }
+    link->repair_first = (uint16_t)(response[4] << 8 | response[5]);
+    link->repair_count = (uint16_t)(response[6] << 8 | response[7]);
+    begin_phase(link, HOST_PHASE_REPAIR);
+}
+
+void host_link_on_response(host_link_t *link, const uint8_t *response, size_t length) {
+    if (link->phase >= HOST_PHASE_DONE) {
+        return;
+    }
+    
+    // Control and session packets are stop-and-wait: any ACK completes
+    // the exchange, a NACK only says why a retry may be needed
+    if (link->phase != HOST_PHASE_DATA) {
+        if (link->phase == HOST_PHASE_END && response[0] == RSP_BAD_PAGES && length >= 8) {
+            on_bad_pages(link, response);
+            return;
+        }
+        if (response[0] != RSP_ACK) {
+            link->nacks++;
+            link->last_nack = response[1];
+            if (link->phase == HOST_PHASE_TABLE && response[1] == 0x16) {
+                fail(link, "the page CRC table does not match its Merkle root");
+            }
+            return;
+        }
+        if (link->phase == HOST_PHASE_TABLE && length >= 3 && response[2] != link->control[0]) {
+            return; // For the table packet before
+        }
+        link->acks++;
+        link->credits = response[1];
+        if (link->phase == HOST_PHASE_TABLE) {
+            link->table_next += (uint32_t)(link->control_length - 4) / 4;
+        }
+        begin_phase(link, next_phase(link));
+        return;
+    }
+    
+    // Go-back-N; each ACK covers every packet up to the sequence it echoes
+    if (response[0] == RSP_ACK && length >= 3) {
+        link->acks++;
+        // Stale ACKs, for packets already covered, map past highest_sent
+        uint32_t acked = link->base + (uint8_t)(response[2] - (uint8_t)link->base);
+        if (acked <= link->highest_sent) {
+            link->base = acked + 1;
+        }
+        if (link->next < link->base) {
+            link->next = link->base; // Acknowledged while being resent
+        }
+        link->credits = response[1];
+        link->last_progress = get_system_tick();
+        link->stalls = 0;
+    } else if (response[0] == RSP_NACK && response[1] == 0x02 && length >= 3) {
+        // The device names the sequence it expects, which may be ahead of
+        // base if ACKs were lost
+        link->nacks++;
+        uint32_t resync = link->base + (uint8_t)(response[2] - (uint8_t)link->base);
+        if (resync <= link->next) {
+            link->base = resync;
+            link->next = resync;
+        }
+        if (link->credits == 0) {
+            link->credits = 1; // Resend the gap; its ACK carries real credits
+        }
+    } else if (response[0] == RSP_NACK) {
+        link->nacks++;
+        link->last_nack = response[1];
+        link->next = link->base;
+    }
+    if (link->base > link->total_packets) {
+        begin_phase(link, HOST_PHASE_END);
+    }
+}
+
+void host_link_service(host_link_t *link) {
+    if (link->phase >= HOST_PHASE_DONE) {
+        return;
+    }
+    if (link->closed) {
+        fail(link, "the bootloader closed the link");
+        return;
+    }
+    const host_flash_options_t *options = link->options;
+    uint32_t idle = get_system_tick() - link->last_progress;
+    
+    if (link->phase != HOST_PHASE_DATA) {
+        if (idle < options->timeout_us) {
+            return;
+        }
+        link->timeouts++;
+        if (++link->stalls < options->retries) {
+            host_send(link, link->control, link->control_length);
+            link->last_progress = get_system_tick();
+            return;
+        }
+        char reason[sizeof(link->error)];
+        if (link->phase == HOST_PHASE_PING) {
+            snprintf(reason, sizeof(reason), "no answer from the bootloader");
+        } else {
+            snprintf(reason, sizeof(reason), "%s refused (NACK 0x%02X)",
+                     control_names[link->phase], link->last_nack);
+        }
+        fail(link, reason);
+        return;
+    }
+    
+    if (idle > options->timeout_us) {
+        link->timeouts++;
+        if (++link->stalls > options->retries) {
+            char reason[sizeof(link->error)];
+            snprintf(reason, sizeof(reason), "no progress at packet %u of %u (last NACK 0x%02X)",
+                     link->base, link->total_packets, link->last_nack);
+            fail(link, reason);
+            return;
+        }
+        link->next = link->base;
+        link->credits = 1; // Probe; the next ACK restores the real credit count
+        link->last_progress = get_system_tick();
+    }
+    
+    while (link->next <= link->total_packets && link->next - link->base < options->window &&
+           link->credits > 0) {
+        uint8_t packet[MAX_PACKET_SIZE];
+        uint32_t offset = link->data_offset + (link->next - 1) * MAX_PAYLOAD_SIZE;
+        uint32_t payload_len = link->data_offset + link->data_size - offset;
+        if (payload_len > MAX_PAYLOAD_SIZE) {
+            payload_len = MAX_PAYLOAD_SIZE;
+        }
+        packet[0] = (uint8_t)link->next;
+        packet[1] = PKT_DATA;
+        memcpy(&packet[PACKET_HEADER_SIZE], &link->image[offset], payload_len);
+        
+        if (link->next <= link->highest_sent) {
+            link->retransmissions++;
+        } else {
+            link->highest_sent = link->next;
+        }
+        if (!host_send(link, packet, PACKET_HEADER_SIZE + payload_len)) {
+            break;
+        }
+        link->credits--;
+        link->next++;
+    }
+}
+
+uint32_t host_link_wait_us(const host_link_t *link) {
+    if (link->phase >= HOST_PHASE_DONE || link->closed) {
+        return 0;
+    }
+    uint32_t idle = get_system_tick() - link->last_progress;
+    return idle >= link->options->timeout_us ? 0 : link->options->timeout_us - idle;
+}
+
+void host_link_poll_input(host_link_t *link) {
+    uint8_t response[HOST_RESPONSE_BUFFER_SIZE];
+    size_t length;
+    while ((length = host_receive(link, response, 0)) > 0) {
+        host_link_on_response(link, response, length);
+    }
+}
+
+bool host_link_flash(host_link_t *link, const uint8_t *image, uint32_t size,
+                     const host_flash_options_t *options) {
+    host_link_begin(link, image, size, options);
+    while (link->phase < HOST_PHASE_DONE) {
+        // Everything the window allows is out; block for the next response
+        uint8_t response[HOST_RESPONSE_BUFFER_SIZE];
+        size_t length = host_receive(link, response, host_link_wait_us(link));
+        if (length > 0) {
+            host_link_on_response(link, response, length);
+            host_link_poll_input(link);
+        }
+        host_link_service(link);
+    }
+    return link->phase == HOST_PHASE_DONE;
+}
+
+bool host_link_flash_all(host_link_t *links, int count, const uint8_t *image,
+                         uint32_t size, const host_flash_options_t *options) {
+    int epoll_fd = epoll_create1(0);
+    for (int i = 0; i < count; i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &links[i] };
+        if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, links[i].fd, &event) != 0) {
+            snprintf(links[i].error, sizeof(links[i].error), "epoll: %s", strerror(errno));
+            links[i].phase = HOST_PHASE_FAILED;
+            continue;
+        }
+        host_link_begin(&links[i], image, size, options);
+    }
+    
+    // Writes block: a window of frames fits in a socket or tty buffer, and
+    // the device drains it while it has credits to give
+    for (;;) {
+        uint32_t wait_us = UINT32_MAX;
+        for (int i = 0; i < count; i++) {
+            if (links[i].phase < HOST_PHASE_DONE) {
+                uint32_t link_wait_us = host_link_wait_us(&links[i]);
+                wait_us = link_wait_us < wait_us ? link_wait_us : wait_us;
+            }
+        }
+        if (wait_us == UINT32_MAX) {
+            break;
+        }
+        
+        struct epoll_event events[HOST_EPOLL_BATCH];
+        int ready = epoll_wait(epoll_fd, events, HOST_EPOLL_BATCH, (int)((wait_us + 999) / 1000));
+        for (int i = 0; i < ready; i++) {
+            host_link_t *link = events[i].data.ptr;
+            host_link_poll_input(link);
+            if (link->phase >= HOST_PHASE_DONE) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (links[i].phase < HOST_PHASE_DONE) {
+                host_link_service(&links[i]);
+                if (links[i].phase >= HOST_PHASE_DONE) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, links[i].fd, NULL);
+                }
+            }
+        }
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    
+    bool all_done = true;
+    for (int i = 0; i < count; i++) {
+        all_done = all_done && links[i].phase == HOST_PHASE_DONE;
+    }
+    return all_done;
+}
@@ -0,0 +1,120 @@
+#ifndef HOST_LINK_H
+#define HOST_LINK_H
+
+#include "framer.h"
+#include "shm_link.h"
+
+// Host end of the session protocol of test.c, as a flashing tool runs it:
+// START_SESSION, DATA packets go-back-N within the window and the ACK
+// credits, END_SESSION. The link is a byte stream - socket, pty, serial
+// device - with COBS framing in both directions (framer.h), or a
+// shared-memory link to a simulated device (shm_link.h).
+//
+// With a page CRC table in the options, START_SESSION carries its Merkle
+// root (merkle.h) and the table follows it. Pages reported bad at
+// END_SESSION are rewritten in repair sessions, a run at a time, until
+// every page passes or options->retries repair sessions in a row leave as
+// many bad pages.
+//
+// host_link_flash() runs one session to the end. Underneath, a session is
+// a state machine - responses in, packets out when the protocol allows -
+// so host_link_flash_all() can drive many links from one thread.
+
+#define HOST_RESPONSE_MAX_SIZE (4 + GAP_REPORT_MAX_RANGES * 4)
+#define HOST_RX_CHUNK_SIZE 4096
+
+typedef struct {
+    uint32_t window;         // Max packets in flight
+    uint32_t timeout_us;     // Retransmit after this long without progress
+    uint32_t retries;        // Timeouts in a row before giving up
+    uint16_t image_crc;
+    const uint32_t *page_crcs; // CRC-32 of each FLASH_PAGE_SIZE page, or NULL
+} host_flash_options_t;
+
+typedef enum {
+    HOST_PHASE_PING,
+    HOST_PHASE_START,
+    HOST_PHASE_TABLE,
+    HOST_PHASE_DATA,
+    HOST_PHASE_END,
+    HOST_PHASE_REPAIR,
+    HOST_PHASE_DONE,
+    HOST_PHASE_FAILED
+} host_phase_t;
+
+typedef struct {
+    int fd;                  // Byte stream, or -1
+    shm_link_t *shm;         // Shared-memory link, or NULL
+    bool closed;
+    uint8_t in[HOST_RX_CHUNK_SIZE];
+    size_t in_pos;
+    size_t in_length;
+    uint8_t frame[FRAME_MAX_ENCODED_SIZE(HOST_RESPONSE_MAX_SIZE)];
+    size_t frame_length;     // May exceed the buffer; such a frame is dropped
+    uint8_t last_nack;
+    char error[96];          // Why host_link_flash() failed
+    
+    // Session in progress
+    const uint8_t *image;
+    uint32_t image_size;
+    const host_flash_options_t *options;
+    host_phase_t phase;
+    uint8_t control[MAX_PACKET_SIZE]; // Control packet until acknowledged
+    size_t control_length;
+    uint32_t table_next;     // First page CRC still to send
+    uint32_t data_offset;    // Image span the DATA packets cover: all of
+    uint32_t data_size;      // it, or the run a repair session rewrites
+    uint32_t total_packets;
+    uint32_t base;           // Oldest unacknowledged DATA packet
+    uint32_t next;
+    uint32_t highest_sent;
+    uint32_t credits;
+    uint32_t stalls;         // Timeouts in a row
+    uint32_t last_progress;  // Tick of the last ACK or control packet sent
+    uint32_t started_at;
+    uint32_t finished_at;    // Tick the END_SESSION ACK arrived, or it failed
+    uint16_t repair_first;   // Bad pages the next repair session rewrites
+    uint16_t repair_count;
+    uint32_t bad_pages;      // As last reported
+    uint32_t repair_stalls;  // Repair sessions in a row that fixed nothing
+    
+    uint32_t packets_sent;
+    uint32_t retransmissions;
+    uint32_t acks;
+    uint32_t nacks;
+    uint32_t timeouts;
+    uint32_t frame_errors;
+    uint64_t bytes_out;      // Encoded, or packet bytes on shared memory
+    uint32_t repair_sessions;
+    uint64_t repair_bytes_out; // Part of bytes_out sent from the first repair on
+} host_link_t;
+
+void host_link_init_stream(host_link_t *link, int fd);
+void host_link_init_shm(host_link_t *link, shm_link_t *shm);
+
+// Sends the image in one session. Returns true once the device has
+// acknowledged its end; otherwise link->error says what went wrong.
+bool host_link_flash(host_link_t *link, const uint8_t *image, uint32_t size,
+                     const host_flash_options_t *options);
+
+// The same image to every link, each a byte stream, concurrently: one
+// epoll loop waits on all of them and on the earliest retransmit timeout.
+// Returns true if every session ended; each link says how its own went.
+bool host_link_flash_all(host_link_t *links, int count, const uint8_t *image,
+                         uint32_t size, const host_flash_options_t *options);
+
+// Session steps, for a caller with its own event loop: begin sends the
+// PING; each response goes to on_response; service sends what the window
+// and credits allow and retransmits on timeout. Call service after every
+// batch of responses and once wait_us has passed without one.
+void host_link_begin(host_link_t *link, const uint8_t *image, uint32_t size,
+                     const host_flash_options_t *options);
+void host_link_on_response(host_link_t *link, const uint8_t *response, size_t length);
+void host_link_service(host_link_t *link);
+uint32_t host_link_wait_us(const host_link_t *link);
+
+// Hands every complete response already read, or readable without
+// blocking, to host_link_on_response()
+void host_link_poll_input(host_link_t *link);
+
+#endif
@@ -0,0 +1,325 @@
+#include "image_format.h"
+#include "crc32.h"
+#include "merkle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define IMAGE_PACK_MAX_THREADS 16
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t image_rle_encode(const uint8_t *in, size_t length, uint8_t *out, size_t out_size) {
+    size_t pos = 0, written = 0;
+    while (pos < length) {
+        size_t run = 1;
+        while (pos + run < length && in[pos + run] == in[pos] && run < 130) {
+            run++;
+        }
+        if (run >= 3) {
+            if (written + 2 > out_size) {
+                return 0;
+            }
+            out[written++] = (uint8_t)(run + 125);
+            out[written++] = in[pos];
+            pos += run;
+            continue;
+        }
+        
+        // Literals up to the next run worth encoding
+        size_t start = pos;
+        while (pos < length && pos - start < 128 &&
+               !(pos + 2 < length && in[pos] == in[pos + 1] && in[pos] == in[pos + 2])) {
+            pos++;
+        }
+        size_t count = pos - start;
+        if (written + 1 + count > out_size) {
+            return 0;
+        }
+        out[written++] = (uint8_t)(count - 1);
+        memcpy(&out[written], &in[start], count);
+        written += count;
+    }
+    return written;
+}
+
+size_t image_rle_decode(const uint8_t *in, size_t length, uint8_t *out, size_t out_size) {
+    size_t pos = 0, written = 0;
+    while (pos < length) {
+        uint8_t control = in[pos++];
+        if (control < 128) {
+            size_t count = control + 1u;
+            if (pos + count > length || written + count > out_size) {
+                return 0;
+            }
+            memcpy(&out[written], &in[pos], count);
+            pos += count;
+            written += count;
+        } else {
+            size_t count = control - 125u;
+            if (pos >= length || written + count > out_size) {
+                return 0;
+            }
+            memset(&out[written], in[pos++], count);
+            written += count;
+        }
+    }
+    return written;
+}
+
+// ---- Packing ----
+
+// Chunks are packed into their own IMAGE_CHUNK_SIZE scratch areas in any
+// order, then laid out one after another
+typedef struct {
+    const uint8_t *image;
+    uint32_t size;
+    bool compress;
+    uint32_t chunk_count;
+    uint32_t next;           // Next chunk to take, shared by the workers
+    image_chunk_t *chunks;
+    uint8_t *stored;
+} pack_job_t;
+
+static uint32_t chunk_length(uint32_t image_size, uint32_t index) {
+    uint32_t remaining = image_size - index * IMAGE_CHUNK_SIZE;
+    return remaining < IMAGE_CHUNK_SIZE ? remaining : IMAGE_CHUNK_SIZE;
+}
+
+static bool is_erased(const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void pack_chunk(pack_job_t *job, uint32_t index) {
+    const uint8_t *data = &job->image[index * IMAGE_CHUNK_SIZE];
+    uint32_t length = chunk_length(job->size, index);
+    image_chunk_t *chunk = &job->chunks[index];
+    uint8_t *stored = &job->stored[index * IMAGE_CHUNK_SIZE];
+    chunk->crc = crc32_update(0, data, length);
+    
+    if (is_erased(data, length)) {
+        chunk->flags = IMAGE_CHUNK_ERASED;
+        chunk->stored_size = 0;
+        return;
+    }
+    // Stored encoded only if that saves at least a byte
+    size_t encoded = job->compress ? image_rle_encode(data, length, stored, length - 1) : 0;
+    if (encoded > 0) {
+        chunk->flags = IMAGE_CHUNK_RLE;
+        chunk->stored_size = (uint32_t)encoded;
+    } else {
+        chunk->flags = 0;
+        chunk->stored_size = length;
+        memcpy(stored, data, length);
+    }
+}
+
+static void *pack_worker(void *arg) {
+    pack_job_t *job = arg;
+    for (;;) {
+        uint32_t index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->chunk_count) {
+            return NULL;
+        }
+        pack_chunk(job, index);
+    }
+}
+
+size_t image_pack(const uint8_t *image, uint32_t size, uint8_t *out,
+                  const image_pack_options_t *options, image_pack_stats_t *stats) {
+    if (size == 0 || size > MAX_APPLICATION_SIZE) {
+        return 0;
+    }
+    static image_chunk_t chunks[IMAGE_MAX_CHUNKS];
+    pack_job_t job = { image, size, options->compress,
+                       (size + IMAGE_CHUNK_SIZE - 1) / IMAGE_CHUNK_SIZE, 0, chunks, NULL };
+    job.stored = malloc((size_t)job.chunk_count * IMAGE_CHUNK_SIZE);
+    if (!job.stored) {
+        return 0;
+    }
+    
+    // The calling thread is one of the workers
+    pthread_t workers[IMAGE_PACK_MAX_THREADS];
+    int started = 0;
+    int threads = options->threads < IMAGE_PACK_MAX_THREADS ? options->threads :
+                  IMAGE_PACK_MAX_THREADS;
+    while (started < threads - 1 &&
+           pthread_create(&workers[started], NULL, pack_worker, &job) == 0) {
+        started++;
+    }
+    pack_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    // The leaves are the chunk CRCs the workers computed, so the root costs
+    // a few hundred 9-byte CRCs rather than a serial pass over the image
+    uint32_t crcs[IMAGE_MAX_CHUNKS];
+    for (uint32_t i = 0; i < job.chunk_count; i++) {
+        crcs[i] = chunks[i].crc;
+    }
+    
+    size_t table_size = (size_t)job.chunk_count * IMAGE_CHUNK_ENTRY_SIZE;
+    size_t offset = IMAGE_HEADER_SIZE + table_size;
+    memset(stats, 0, sizeof(*stats));
+    for (uint32_t i = 0; i < job.chunk_count; i++) {
+        image_chunk_t *chunk = &chunks[i];
+        chunk->offset = (uint32_t)offset;
+        memcpy(&out[offset], &job.stored[i * IMAGE_CHUNK_SIZE], chunk->stored_size);
+        offset += chunk->stored_size;
+        
+        uint8_t *entry = &out[IMAGE_HEADER_SIZE + i * IMAGE_CHUNK_ENTRY_SIZE];
+        put_le32(&entry[0], chunk->offset);
+        put_le32(&entry[4], chunk->stored_size);
+        put_le32(&entry[8], chunk->crc);
+        put_le32(&entry[12], chunk->flags);
+        stats->chunks_rle += (chunk->flags & IMAGE_CHUNK_RLE) != 0;
+        stats->chunks_erased += (chunk->flags & IMAGE_CHUNK_ERASED) != 0;
+    }
+    free(job.stored);
+    
+    put_le32(&out[0], IMAGE_MAGIC);
+    out[4] = (uint8_t)IMAGE_FORMAT_VERSION;
+    out[5] = (uint8_t)(IMAGE_FORMAT_VERSION >> 8);
+    out[6] = (uint8_t)IMAGE_HEADER_SIZE;
+    out[7] = (uint8_t)(IMAGE_HEADER_SIZE >> 8);
+    put_le32(&out[8], APPLICATION_START);
+    put_le32(&out[12], size);
+    put_le32(&out[16], IMAGE_CHUNK_SIZE);
+    put_le32(&out[20], job.chunk_count);
+    put_le32(&out[24], merkle_root(crcs, job.chunk_count));
+    uint32_t table_crc = crc32_update(0, out, 28);
+    put_le32(&out[28], crc32_update(table_crc, &out[IMAGE_HEADER_SIZE], table_size));
+    return offset;
+}
+
+// ---- Reading ----
+
+bool image_read_header(const uint8_t *container, size_t size, image_header_t *header) {
+    if (size < IMAGE_HEADER_SIZE || get_le32(&container[0]) != IMAGE_MAGIC ||
+        (container[4] | (container[5] << 8)) != IMAGE_FORMAT_VERSION ||
+        (container[6] | (container[7] << 8)) != IMAGE_HEADER_SIZE) {
+        return false;
+    }
+    header->load_address = get_le32(&container[8]);
+    header->image_size = get_le32(&container[12]);
+    header->chunk_size = get_le32(&container[16]);
+    header->chunk_count = get_le32(&container[20]);
+    header->root = get_le32(&container[24]);
+    
+    // The image must fit the application area
+    if (header->chunk_size != IMAGE_CHUNK_SIZE || header->image_size == 0 ||
+        header->image_size > MAX_APPLICATION_SIZE ||
+        header->load_address < APPLICATION_START ||
+        header->load_address - APPLICATION_START > MAX_APPLICATION_SIZE - header->image_size ||
+        header->chunk_count != (header->image_size + IMAGE_CHUNK_SIZE - 1) / IMAGE_CHUNK_SIZE) {
+        return false;
+    }
+    size_t table_size = (size_t)header->chunk_count * IMAGE_CHUNK_ENTRY_SIZE;
+    if (size - IMAGE_HEADER_SIZE < table_size) {
+        return false;
+    }
+    uint32_t table_crc = crc32_update(0, container, 28);
+    table_crc = crc32_update(table_crc, &container[IMAGE_HEADER_SIZE], table_size);
+    return table_crc == get_le32(&container[28]);
+}
+
+void image_read_chunk(const uint8_t *container, uint32_t index, image_chunk_t *chunk) {
+    const uint8_t *entry = &container[IMAGE_HEADER_SIZE + index * IMAGE_CHUNK_ENTRY_SIZE];
+    chunk->offset = get_le32(&entry[0]);
+    chunk->stored_size = get_le32(&entry[4]);
+    chunk->crc = get_le32(&entry[8]);
+    chunk->flags = get_le32(&entry[12]);
+}
+
+size_t image_unpack_chunk(const uint8_t *container, size_t size,
+                          const image_header_t *header, uint32_t index, uint8_t *out) {
+    image_chunk_t chunk;
+    image_read_chunk(container, index, &chunk);
+    uint32_t length = chunk_length(header->image_size, index);
+    size_t data_start = IMAGE_HEADER_SIZE + (size_t)header->chunk_count * IMAGE_CHUNK_ENTRY_SIZE;
+    if (chunk.offset < data_start || chunk.offset > size || chunk.stored_size > size - chunk.offset) {
+        return 0;
+    }
+    
+    const uint8_t *stored = &container[chunk.offset];
+    size_t unpacked;
+    if (chunk.flags & IMAGE_CHUNK_ERASED) {
+        memset(out, 0xFF, length);
+        unpacked = chunk.stored_size == 0 ? length : 0;
+    } else if (chunk.flags & IMAGE_CHUNK_RLE) {
+        unpacked = image_rle_decode(stored, chunk.stored_size, out, length);
+    } else {
+        unpacked = chunk.stored_size == length ? length : 0;
+        memcpy(out, stored, unpacked);
+    }
+    if (unpacked != length || crc32_update(0, out, length) != chunk.crc) {
+        return 0;
+    }
+    return length;
+}
+
+typedef struct {
+    const uint8_t *container;
+    size_t size;
+    const image_header_t *header;
+    uint8_t *out;
+    uint32_t next;           // Next chunk to take, shared by the workers
+    uint8_t *damaged;        // One flag per chunk
+} unpack_job_t;
+
+static void *unpack_worker(void *arg) {
+    unpack_job_t *job = arg;
+    for (;;) {
+        uint32_t index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->header->chunk_count) {
+            return NULL;
+        }
+        job->damaged[index] = image_unpack_chunk(job->container, job->size, job->header, index,
+                                                 &job->out[index * IMAGE_CHUNK_SIZE]) == 0;
+    }
+}
+
+bool image_unpack_all(const uint8_t *container, size_t size, const image_header_t *header,
+                      uint8_t *out, int threads, uint32_t *bad_chunk) {
+    static uint8_t damaged[IMAGE_MAX_CHUNKS];
+    unpack_job_t job = { container, size, header, out, 0, damaged };
+    pthread_t workers[IMAGE_PACK_MAX_THREADS];
+    int started = 0;
+    while (started < threads - 1 && started < IMAGE_PACK_MAX_THREADS &&
+           pthread_create(&workers[started], NULL, unpack_worker, &job) == 0) {
+        started++;
+    }
+    unpack_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    // Each chunk matched its table CRC, so the table's leaves are the image's
+    uint32_t crcs[IMAGE_MAX_CHUNKS];
+    for (uint32_t i = 0; i < header->chunk_count; i++) {
+        if (damaged[i]) {
+            *bad_chunk = i;
+            return false;
+        }
+        image_chunk_t chunk;
+        image_read_chunk(container, i, &chunk);
+        crcs[i] = chunk.crc;
+    }
+    *bad_chunk = header->chunk_count;
+    return merkle_root(crcs, header->chunk_count) == header->root;
+}
@@ -0,0 +1,91 @@
+#ifndef IMAGE_FORMAT_H
+#define IMAGE_FORMAT_H
+
+#include "bootloader.h"
+
+// Firmware container, as dfu_pack writes it: a header, a table with one
+// entry per IMAGE_CHUNK_SIZE chunk of the image, then the stored chunks.
+// Every chunk carries its own CRC-32, so a damaged container is caught
+// chunk by chunk before anything is sent, and a chunk that is all 0xFF -
+// erased flash - is stored as a table entry only. A chunk that shrinks
+// under run-length encoding is stored encoded. A chunk is one flash page,
+// so the table's CRCs are the ones the bootloader checks its pages against.
+//
+// All fields are little-endian.
+//   header [IMAGE_HEADER_SIZE]: magic:4 version:2 header size:2
+//       load address:4 image size:4 chunk size:4 chunk count:4
+//       root:4 table CRC:4 - the Merkle root of the chunk CRCs (merkle.h),
+//       then a CRC over the header before it and the whole table
+//   table [chunk count * IMAGE_CHUNK_ENTRY_SIZE]: offset:4 stored size:4
+//       CRC:4 flags:4 - offset from the start of the container, CRC of
+//       the chunk unpacked
+//
+// Run-length encoding: a control byte n < 128 is followed by n + 1 literal
+// bytes; n >= 128 by one byte to repeat n - 125 times.
+
+#define IMAGE_MAGIC 0x43554644u // "DFUC"
+#define IMAGE_FORMAT_VERSION 2 // 1 kept a whole-image CRC where the root is
+#define IMAGE_HEADER_SIZE 32
+#define IMAGE_CHUNK_ENTRY_SIZE 16
+#define IMAGE_CHUNK_SIZE FLASH_PAGE_SIZE // The table doubles as the page CRCs
+#define IMAGE_MAX_CHUNKS (MAX_APPLICATION_SIZE / IMAGE_CHUNK_SIZE)
+#define IMAGE_MAX_CONTAINER_SIZE \
+    (IMAGE_HEADER_SIZE + IMAGE_MAX_CHUNKS * (IMAGE_CHUNK_ENTRY_SIZE + IMAGE_CHUNK_SIZE))
+
+#define IMAGE_CHUNK_RLE 0x01    // Stored run-length encoded
+#define IMAGE_CHUNK_ERASED 0x02 // All 0xFF; nothing stored
+
+typedef struct {
+    uint32_t load_address;
+    uint32_t image_size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint32_t root;
+} image_header_t;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t stored_size;
+    uint32_t crc;
+    uint32_t flags;
+} image_chunk_t;
+
+typedef struct {
+    int threads;             // Workers packing chunks in parallel
+    bool compress;
+} image_pack_options_t;
+
+typedef struct {
+    uint32_t chunks_rle;
+    uint32_t chunks_erased;
+} image_pack_stats_t;
+
+// Both return the output length, or 0 if it does not fit in out_size.
+// Decoding also returns 0 for malformed input.
+size_t image_rle_encode(const uint8_t *in, size_t length, uint8_t *out, size_t out_size);
+size_t image_rle_decode(const uint8_t *in, size_t length, uint8_t *out, size_t out_size);
+
+// Builds the container for an image loaded at APPLICATION_START. out needs
+// IMAGE_MAX_CONTAINER_SIZE bytes at most. Returns the container length, or
+// 0 if the image is empty or too large.
+size_t image_pack(const uint8_t *image, uint32_t size, uint8_t *out,
+                  const image_pack_options_t *options, image_pack_stats_t *stats);
+
+// Checks the header and table of a container. Returns false if it is not
+// one, is truncated, or fails the table CRC.
+bool image_read_header(const uint8_t *container, size_t size, image_header_t *header);
+void image_read_chunk(const uint8_t *container, uint32_t index, image_chunk_t *chunk);
+
+// Unpacks one chunk of a container image_read_header() accepted into out,
+// IMAGE_CHUNK_SIZE bytes. Returns its length, or 0 if it is damaged.
+size_t image_unpack_chunk(const uint8_t *container, size_t size,
+                          const image_header_t *header, uint32_t index, uint8_t *out);
+
+// Unpacks every chunk into out, chunk count * IMAGE_CHUNK_SIZE bytes, on up
+// to threads workers, then checks the chunk CRCs against the root. Returns
+// false with *bad_chunk set to the first damaged chunk, or to the chunk
+// count if only the root does not match.
+bool image_unpack_all(const uint8_t *container, size_t size, const image_header_t *header,
+                      uint8_t *out, int threads, uint32_t *bad_chunk);
+
+#endif
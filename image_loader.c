@@ -0,0 +1,293 @@
+#include "image_loader.h"
+#include <string.h>
+#include <stdarg.h>
+
+#define APPLICATION_END ((uint64_t)APPLICATION_START + MAX_APPLICATION_SIZE)
+#define RECORD_MAX_BYTES 260 // A HEX record: count, address, type, 255 data, checksum
+
+static bool fail(image_load_t *load, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(load->error, sizeof(load->error), format, args);
+    va_end(args);
+    return false;
+}
+
+static bool store(image_load_t *load, uint64_t address, const uint8_t *data, size_t length) {
+    if (length == 0) {
+        return true;
+    }
+    if (address < APPLICATION_START || address + length > APPLICATION_END) {
+        return fail(load, "0x%08llX-0x%08llX: outside the application area 0x%08X-0x%08llX",
+                    (unsigned long long)address, (unsigned long long)(address + length - 1),
+                    APPLICATION_START, (unsigned long long)APPLICATION_END - 1);
+    }
+    uint32_t offset = (uint32_t)(address - APPLICATION_START);
+    for (uint32_t i = offset; i < offset + length; i++) {
+        if (load->written[i / 8] & (1u << (i % 8))) {
+            return fail(load, "0x%08X: loaded twice", APPLICATION_START + i);
+        }
+        load->written[i / 8] |= (uint8_t)(1u << (i % 8));
+    }
+    memcpy(&load->data[offset], data, length);
+    if (offset + length > load->size) {
+        load->size = offset + (uint32_t)length;
+    }
+    load->loaded += (uint32_t)length;
+    return true;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Hex digit pairs to bytes. Returns the byte count, or -1 if malformed.
+static int parse_hex(const char *text, size_t length, uint8_t *out) {
+    if (length % 2 != 0 || length / 2 > RECORD_MAX_BYTES) {
+        return -1;
+    }
+    for (size_t i = 0; i < length; i += 2) {
+        int high = hex_value(text[i]);
+        int low = hex_value(text[i + 1]);
+        if (high < 0 || low < 0) {
+            return -1;
+        }
+        out[i / 2] = (uint8_t)(high << 4 | low);
+    }
+    return (int)(length / 2);
+}
+
+// Text formats are parsed a line at a time, straight from the input
+typedef struct {
+    const char *text;
+    size_t length;
+    size_t pos;
+    uint32_t number;
+} line_reader_t;
+
+static bool next_line(line_reader_t *reader, const char **line, size_t *length) {
+    while (reader->pos < reader->length) {
+        const char *start = &reader->text[reader->pos];
+        const char *end = memchr(start, '\n', reader->length - reader->pos);
+        size_t span = end ? (size_t)(end - start) : reader->length - reader->pos;
+        reader->pos += span + (end ? 1 : 0);
+        reader->number++;
+        while (span > 0 && (start[span - 1] == '\r' || start[span - 1] == ' ' ||
+                            start[span - 1] == '\t')) {
+            span--;
+        }
+        if (span > 0) {
+            *line = start;
+            *length = span;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool load_hex(const uint8_t *input, size_t length, image_load_t *load) {
+    line_reader_t reader = { (const char *)input, length, 0, 0 };
+    const char *line;
+    size_t line_length;
+    uint64_t base = 0;
+    while (next_line(&reader, &line, &line_length)) {
+        uint8_t record[RECORD_MAX_BYTES];
+        int count = line[0] == ':' ? parse_hex(line + 1, line_length - 1, record) : -1;
+        if (count < 5 || record[0] != count - 5) {
+            return fail(load, "line %u: malformed HEX record", reader.number);
+        }
+        uint8_t sum = 0;
+        for (int i = 0; i < count; i++) {
+            sum += record[i];
+        }
+        if (sum != 0) {
+            return fail(load, "line %u: checksum mismatch", reader.number);
+        }
+        
+        uint16_t address = (uint16_t)(record[1] << 8 | record[2]);
+        switch (record[3]) {
+            case 0x00: // Data
+                if (!store(load, base + address, &record[4], record[0])) {
+                    return false;
+                }
+                break;
+            
+            case 0x01: // End of file
+                return true;
+            
+            case 0x02: // Extended segment address
+            case 0x04: // Extended linear address
+                if (record[0] != 2) {
+                    return fail(load, "line %u: malformed address record", reader.number);
+                }
+                base = (uint64_t)(record[4] << 8 | record[5]) << (record[3] == 0x02 ? 4 : 16);
+                break;
+            
+            case 0x03: // Start addresses: nothing to load
+            case 0x05:
+                break;
+            
+            default:
+                return fail(load, "line %u: unknown record type %02X", reader.number, record[3]);
+        }
+    }
+    return fail(load, "no end-of-file record - truncated?");
+}
+
+static bool load_srec(const uint8_t *input, size_t length, image_load_t *load) {
+    // Address bytes of S0 to S9
+    static const int address_sizes[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+    line_reader_t reader = { (const char *)input, length, 0, 0 };
+    const char *line;
+    size_t line_length;
+    while (next_line(&reader, &line, &line_length)) {
+        uint8_t record[RECORD_MAX_BYTES];
+        int type = line_length >= 2 && line[0] == 'S' ? line[1] - '0' : -1;
+        int count = type >= 0 && type <= 9 && type != 4 ?
+                    parse_hex(line + 2, line_length - 2, record) : -1;
+        if (count < 1 || record[0] != count - 1 || record[0] < address_sizes[type] + 1) {
+            return fail(load, "line %u: malformed S-record", reader.number);
+        }
+        uint8_t sum = 0;
+        for (int i = 0; i < count; i++) {
+            sum += record[i];
+        }
+        if (sum != 0xFF) {
+            return fail(load, "line %u: checksum mismatch", reader.number);
+        }
+        
+        if (type >= 1 && type <= 3) {
+            uint64_t address = 0;
+            for (int i = 0; i < address_sizes[type]; i++) {
+                address = address << 8 | record[1 + i];
+            }
+            if (!store(load, address, &record[1 + address_sizes[type]],
+                       (size_t)(record[0] - address_sizes[type] - 1))) {
+                return false;
+            }
+        } else if (type >= 7) {
+            return true; // Termination, with the start address
+        }
+    }
+    return fail(load, "no termination record - truncated?");
+}
+
+static uint32_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool load_elf(const uint8_t *input, size_t length, image_load_t *load) {
+    if (length < 52) {
+        return fail(load, "truncated ELF header");
+    }
+    if (input[4] != 1 || input[5] != 1) {
+        return fail(load, "only 32-bit little-endian ELF files are supported");
+    }
+    uint64_t phoff = le32(&input[0x1C]);
+    uint32_t phentsize = le16(&input[0x2A]);
+    uint32_t phnum = le16(&input[0x2C]);
+    if (phentsize < 32 || phoff + (uint64_t)phnum * phentsize > length) {
+        return fail(load, "truncated program headers");
+    }
+    
+    // Segments go to their load address (p_paddr); .bss and the like have
+    // no file data to load
+    for (uint32_t i = 0; i < phnum; i++) {
+        const uint8_t *ph = &input[phoff + (uint64_t)i * phentsize];
+        uint64_t offset = le32(&ph[4]);
+        uint32_t filesz = le32(&ph[16]);
+        if (le32(&ph[0]) != 1 || filesz == 0) { // PT_LOAD
+            continue;
+        }
+        if (offset + filesz > length) {
+            return fail(load, "segment %u: truncated", i);
+        }
+        if (!store(load, le32(&ph[12]), &input[offset], filesz)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A text record format if the first line is all record: a marker, then
+// hex digits only
+static bool is_text_records(const uint8_t *input, size_t length, char marker) {
+    if (length < 2 || input[0] != marker) {
+        return false;
+    }
+    size_t i = 1;
+    while (i < length && hex_value((char)input[i]) >= 0) {
+        i++;
+    }
+    return i > 2 && (i == length || input[i] == '\r' || input[i] == '\n');
+}
+
+// Lists the loaded runs in address order
+static void find_regions(image_load_t *load) {
+    load->region_count = 0;
+    uint32_t i = 0;
+    while (i < load->size) {
+        if (load->written[i / 8] == 0 && i % 8 == 0) {
+            i += 8;
+            continue;
+        }
+        if (!(load->written[i / 8] & (1u << (i % 8)))) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < load->size && (load->written[i / 8] & (1u << (i % 8)))) {
+            i++;
+        }
+        if (load->region_count < IMAGE_MAX_REGIONS) {
+            image_region_t *region = &load->regions[load->region_count];
+            region->address = APPLICATION_START + start;
+            region->length = i - start;
+        }
+        load->region_count++;
+    }
+}
+
+bool image_load(const uint8_t *input, size_t length, image_load_t *load) {
+    memset(load->data, 0xFF, sizeof(load->data));
+    memset(load->written, 0, sizeof(load->written));
+    load->size = 0;
+    load->loaded = 0;
+    load->region_count = 0;
+    load->error[0] = '\0';
+    
+    bool ok;
+    if (length >= 4 && memcmp(input, "\x7F" "ELF", 4) == 0) {
+        load->input = IMAGE_INPUT_ELF;
+        ok = load_elf(input, length, load);
+    } else if (is_text_records(input, length, ':')) {
+        load->input = IMAGE_INPUT_HEX;
+        ok = load_hex(input, length, load);
+    } else if (is_text_records(input, length, 'S')) {
+        load->input = IMAGE_INPUT_SREC;
+        ok = load_srec(input, length, load);
+    } else {
+        load->input = IMAGE_INPUT_BINARY;
+        ok = store(load, APPLICATION_START, input, length);
+    }
+    if (ok && load->loaded == 0) {
+        ok = fail(load, "no data to load");
+    }
+    if (ok) {
+        find_regions(load);
+    }
+    return ok;
+}
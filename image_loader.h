@@ -0,0 +1,44 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include "bootloader.h"
+
+// Build outputs to a flat image of the application area: Intel HEX,
+// Motorola S-records, ELF32 (little-endian; PT_LOAD segments at their load
+// address) or a raw binary, told apart by their first bytes. Records are
+// written where their address says, one at a time as they are parsed, so
+// data[0] is APPLICATION_START whatever order they come in. Anything
+// outside the application area, or loaded twice, is an error. Holes are
+// 0xFF, as erased flash reads, and the regions actually loaded are listed
+// in address order.
+
+#define IMAGE_MAX_REGIONS 32
+
+typedef struct {
+    uint32_t address;
+    uint32_t length;
+} image_region_t;
+
+typedef enum {
+    IMAGE_INPUT_BINARY = 0,
+    IMAGE_INPUT_HEX,
+    IMAGE_INPUT_SREC,
+    IMAGE_INPUT_ELF
+} image_input_t;
+
+typedef struct {
+    image_input_t input;
+    uint32_t size;                   // Up to the end of the last region
+    uint32_t loaded;                 // Bytes loaded; the rest are holes
+    uint32_t region_count;           // May exceed IMAGE_MAX_REGIONS
+    image_region_t regions[IMAGE_MAX_REGIONS];
+    char error[96];                  // Why image_load() failed
+    uint8_t data[MAX_APPLICATION_SIZE];
+    uint8_t written[MAX_APPLICATION_SIZE / 8];
+} image_load_t;
+
+// Returns false, with load->error set, if the input is malformed, out of
+// bounds, overlaps itself or loads nothing
+bool image_load(const uint8_t *input, size_t length, image_load_t *load);
+
+#endif
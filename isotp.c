@@ -0,0 +1,224 @@
+#include "isotp.h"
+#include <string.h>
+
+#define ISOTP_PADDING 0xCC
+
+size_t canfd_padded_length(size_t length) {
+    static const uint8_t sizes[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    if (length <= 8) {
+        return length;
+    }
+    for (size_t i = 0; i < sizeof(sizes); i++) {
+        if (length <= sizes[i]) {
+            return sizes[i];
+        }
+    }
+    return CANFD_MAX_DLEN;
+}
+
+// 0x00-0x7F: milliseconds, 0xF1-0xF9: 100-900 us, anything else: 127 ms
+uint32_t isotp_st_min_us(uint8_t st_min) {
+    if (st_min <= 0x7F) {
+        return st_min * 1000u;
+    }
+    if (st_min >= 0xF1 && st_min <= 0xF9) {
+        return (st_min - 0xF0) * 100u;
+    }
+    return 127000;
+}
+
+void isotp_receiver_init(isotp_receiver_t *rx, transport_t transport, uint8_t block_size,
+                         uint8_t st_min, isotp_send_frame_t send, void *send_ctx) {
+    memset(rx, 0, sizeof(*rx));
+    rx->transport = transport;
+    rx->block_size = block_size;
+    rx->st_min = st_min;
+    rx->send = send;
+    rx->send_ctx = send_ctx;
+}
+
+static void send_flow_control(isotp_receiver_t *rx, uint8_t flow_status) {
+    uint8_t frame[3] = { (ISOTP_PCI_FC << 4) | flow_status, rx->block_size, rx->st_min };
+    rx->send(frame, sizeof(frame), rx->send_ctx);
+}
+
+static void receive_first_frame(isotp_receiver_t *rx, const uint8_t *frame, size_t length) {
+    size_t expected = ((size_t)(frame[0] & 0x0F) << 8) | frame[1];
+    if (length < 8 || expected <= length - 2) {
+        return; // Malformed: would have fit a Single Frame
+    }
+    
+    // Packets never exceed MAX_PACKET_SIZE, so the 32-bit length escape
+    // (expected == 0) is refused as well
+    rx->out = expected <= MAX_PACKET_SIZE ? bootloader_rx_reserve(rx->transport) : NULL;
+    if (!rx->out) {
+        rx->overflows++;
+        if (expected <= MAX_PACKET_SIZE) {
+            bootloader_rx_overrun(rx->transport);
+        }
+        send_flow_control(rx, ISOTP_FS_OVFLW);
+        return;
+    }
+    
+    memcpy(rx->out, &frame[2], length - 2);
+    rx->expected = expected;
+    rx->received = length - 2;
+    rx->next_sn = 1;
+    rx->block_count = 0;
+    rx->active = true;
+    send_flow_control(rx, ISOTP_FS_CTS);
+}
+
+static void receive_consecutive_frame(isotp_receiver_t *rx, const uint8_t *frame, size_t length) {
+    if (!rx->active) {
+        return;
+    }
+    if ((frame[0] & 0x0F) != rx->next_sn) {
+        // A lost or repeated CF: the message is abandoned and the slot,
+        // never committed, is reused
+        rx->sequence_errors++;
+        rx->active = false;
+        return;
+    }
+    
+    size_t chunk = rx->expected - rx->received;
+    if (chunk > length - 1) {
+        chunk = length - 1;
+    }
+    memcpy(&rx->out[rx->received], &frame[1], chunk);
+    rx->received += chunk;
+    rx->next_sn = (rx->next_sn + 1) & 0x0F;
+    
+    if (rx->received == rx->expected) {
+        rx->active = false;
+        rx->messages_ok++;
+        bootloader_rx_commit(rx->transport, rx->expected);
+    } else if (rx->block_size != 0 && ++rx->block_count == rx->block_size) {
+        rx->block_count = 0;
+        send_flow_control(rx, ISOTP_FS_CTS);
+    }
+}
+
+void isotp_receive_frame(isotp_receiver_t *rx, const uint8_t *frame, size_t length) {
+    if (length < 1 || length > CANFD_MAX_DLEN) {
+        return;
+    }
+    
+    uint32_t now = get_system_tick();
+    if (rx->active && now - rx->last_frame_time > ISOTP_N_CR_US) {
+        rx->timeouts++;
+        rx->active = false;
+    }
+    rx->last_frame_time = now;
+    
+    switch (frame[0] >> 4) {
+        case ISOTP_PCI_SF: {
+            // Classic SF: length in the low nibble. CAN-FD SF: low nibble
+            // 0, length in the next byte. A frame longer than 8 bytes with
+            // a nibble length is malformed, not a classic SF.
+            size_t sf_length = frame[0] & 0x0F;
+            const uint8_t *data = &frame[1];
+            if (sf_length != 0 && length > 8) {
+                return;
+            }
+            if (sf_length == 0 && length > 8) {
+                sf_length = frame[1];
+                data = &frame[2];
+            }
+            if (sf_length == 0 || (size_t)(data - frame) + sf_length > length) {
+                return;
+            }
+            rx->active = false; // A new message replaces one in progress
+            if (bootloader_receive_packet_from(rx->transport, data, sf_length)) {
+                rx->messages_ok++;
+            }
+            break;
+        }
+        
+        case ISOTP_PCI_FF:
+            rx->active = false;
+            receive_first_frame(rx, frame, length);
+            break;
+            
+        case ISOTP_PCI_CF:
+            receive_consecutive_frame(rx, frame, length);
+            break;
+            
+        default:
+            break; // Flow Control is for senders
+    }
+}
+
+void isotp_sender_start(isotp_sender_t *tx, const uint8_t *data, size_t length) {
+    memset(tx, 0, sizeof(*tx));
+    tx->data = data;
+    tx->length = length;
+    tx->state = ISOTP_TX_SENDING;
+}
+
+size_t isotp_sender_next_frame(isotp_sender_t *tx, uint8_t *frame) {
+    if (tx->state != ISOTP_TX_SENDING) {
+        return 0;
+    }
+    
+    size_t length;
+    if (tx->offset == 0 && tx->length <= 7) {
+        frame[0] = (uint8_t)((ISOTP_PCI_SF << 4) | tx->length);
+        memcpy(&frame[1], tx->data, tx->length);
+        length = 1 + tx->length;
+        tx->offset = tx->length;
+    } else if (tx->offset == 0 && tx->length <= CANFD_MAX_DLEN - 2) {
+        frame[0] = ISOTP_PCI_SF << 4;
+        frame[1] = (uint8_t)tx->length;
+        memcpy(&frame[2], tx->data, tx->length);
+        length = 2 + tx->length;
+        tx->offset = tx->length;
+    } else if (tx->offset == 0) {
+        frame[0] = (uint8_t)((ISOTP_PCI_FF << 4) | ((tx->length >> 8) & 0x0F));
+        frame[1] = (uint8_t)tx->length;
+        memcpy(&frame[2], tx->data, CANFD_MAX_DLEN - 2);
+        tx->offset = CANFD_MAX_DLEN - 2;
+        tx->next_sn = 1;
+        tx->state = ISOTP_TX_WAIT_FC;
+        return CANFD_MAX_DLEN;
+    } else {
+        size_t chunk = tx->length - tx->offset;
+        if (chunk > CANFD_MAX_DLEN - 1) {
+            chunk = CANFD_MAX_DLEN - 1;
+        }
+        frame[0] = (uint8_t)((ISOTP_PCI_CF << 4) | tx->next_sn);
+        memcpy(&frame[1], &tx->data[tx->offset], chunk);
+        length = 1 + chunk;
+        tx->offset += chunk;
+        tx->next_sn = (tx->next_sn + 1) & 0x0F;
+        if (tx->offset < tx->length && tx->block_size != 0 && --tx->block_remaining == 0) {
+            tx->state = ISOTP_TX_WAIT_FC;
+        }
+    }
+    
+    if (tx->offset == tx->length) {
+        tx->state = ISOTP_TX_DONE;
+    }
+    size_t padded = canfd_padded_length(length);
+    memset(&frame[length], ISOTP_PADDING, padded - length);
+    return padded;
+}
+
+void isotp_sender_on_flow_control(isotp_sender_t *tx, const uint8_t *frame, size_t length) {
+    if (tx->state != ISOTP_TX_WAIT_FC || length < 3 || (frame[0] >> 4) != ISOTP_PCI_FC) {
+        return;
+    }
+    switch (frame[0] & 0x0F) {
+        case ISOTP_FS_CTS:
+            tx->block_size = frame[1];
+            tx->block_remaining = frame[1];
+            tx->st_min_us = isotp_st_min_us(frame[2]);
+            tx->state = ISOTP_TX_SENDING;
+            break;
+        case ISOTP_FS_WAIT:
+            break;
+        default:
+            tx->state = ISOTP_TX_ABORTED;
+            break;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef ISOTP_H
+#define ISOTP_H
+
+#include "bootloader.h"
+
+// ISO 15765-2 (ISO-TP) segmentation for CAN-FD. A packet that fits in one
+// frame goes as a Single Frame; longer ones as a First Frame followed by
+// Consecutive Frames, paced by the receiver's Flow Control frames (block
+// size, minimum separation time). The receiver reassembles straight into
+// the CAN transport's next ingress slot.
+
+#define CANFD_MAX_DLEN 64
+#define ISOTP_N_CR_US 1000000 // Receiver gives up on a message after 1 s of silence
+
+// Protocol control information, high nibble of the first byte
+#define ISOTP_PCI_SF 0x0
+#define ISOTP_PCI_FF 0x1
+#define ISOTP_PCI_CF 0x2
+#define ISOTP_PCI_FC 0x3
+
+// Flow status of a Flow Control frame
+#define ISOTP_FS_CTS 0x0
+#define ISOTP_FS_WAIT 0x1
+#define ISOTP_FS_OVFLW 0x2
+
+// Sends one CAN frame on the bus
+typedef void (*isotp_send_frame_t)(const uint8_t *frame, size_t length, void *ctx);
+
+// Device side
+typedef struct {
+    transport_t transport;
+    uint8_t block_size;      // CFs per FC, 0 = the whole message
+    uint8_t st_min;          // Encoded as on the wire
+    isotp_send_frame_t send;
+    void *send_ctx;
+    
+    uint8_t *out;            // Reserved ingress slot
+    size_t expected;
+    size_t received;
+    uint8_t next_sn;
+    uint8_t block_count;
+    bool active;
+    uint32_t last_frame_time;
+    
+    uint32_t messages_ok;
+    uint32_t sequence_errors;
+    uint32_t overflows;      // Too long, or no slot free
+    uint32_t timeouts;
+} isotp_receiver_t;
+
+void isotp_receiver_init(isotp_receiver_t *rx, transport_t transport, uint8_t block_size,
+                         uint8_t st_min, isotp_send_frame_t send, void *send_ctx);
+void isotp_receive_frame(isotp_receiver_t *rx, const uint8_t *frame, size_t length);
+
+// Host side
+typedef enum {
+    ISOTP_TX_IDLE = 0,
+    ISOTP_TX_WAIT_FC,
+    ISOTP_TX_SENDING,
+    ISOTP_TX_DONE,
+    ISOTP_TX_ABORTED
+} isotp_tx_state_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    uint8_t next_sn;
+    uint8_t block_size;
+    uint8_t block_remaining;
+    uint32_t st_min_us;
+    isotp_tx_state_t state;
+} isotp_sender_t;
+
+void isotp_sender_start(isotp_sender_t *tx, const uint8_t *data, size_t length);
+// Next frame to put on the bus, or 0 while waiting for Flow Control or done
+size_t isotp_sender_next_frame(isotp_sender_t *tx, uint8_t *frame);
+void isotp_sender_on_flow_control(isotp_sender_t *tx, const uint8_t *frame, size_t length);
+
+// CAN-FD frames carry 0-8, 12, 16, 20, 24, 32, 48 or 64 bytes
+size_t canfd_padded_length(size_t length);
+uint32_t isotp_st_min_us(uint8_t st_min);
+
+#endif
@@ -0,0 +1,488 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "link_sim.h"
+#include "isotp.h"
+#include "fec.h"
+#include "crc32.h"
+#include <string.h>
+
+#define RESPONSE_QUEUE_SIZE 64
+#define RESPONSE_FRAME_MAX 4
+#define CONTROL_RETRIES 10
+#define TRANSFER_TIME_LIMIT_US 20000000
+#define MAX_DATA_PACKETS ((MAX_APPLICATION_SIZE + CONFIG_SIZE + COPROCESSOR_SIZE) / \
+                          REGION_DATA_SIZE + REGION_COUNT)
+#define LINK_FRAME_OVERHEAD 8 // Preamble, sync word, length and CRC
+
+static uint32_t sent_at[MAX_DATA_PACKETS + 1];
+
+// Responses the host has seen since it last looked
+typedef struct {
+    uint8_t frames[RESPONSE_QUEUE_SIZE][RESPONSE_FRAME_MAX];
+    uint8_t lengths[RESPONSE_QUEUE_SIZE];
+    int count;
+    uint32_t rng;
+    double loss_rate;
+    transport_t transport;
+    const can_bus_config_t *can;
+    uint32_t bitrate;
+    uint32_t bus_debt_us;      // Bus time of responses not yet waited out
+    bool line_busy;            // Half-duplex: a host frame is on the line
+    uint32_t can_frames;
+    uint32_t frames_sent;      // By the device, lost or not
+    uint32_t bytes_sent;
+} response_queue_t;
+
+typedef struct {
+    const link_config_t *config;
+    uint32_t rng;
+    response_queue_t responses;
+    dfu_transfer_result_t *result;
+    
+    // CAN-FD: the device's ISO-TP receiver and its latest Flow Control
+    isotp_receiver_t isotp;
+    uint8_t flow_control[CANFD_MAX_DLEN];
+    size_t flow_control_length;
+    
+    // FEC: host-side encoder, device-side decoder in front of the ring
+    fec_encoder_t fec_tx;
+    fec_decoder_t fec_rx;
+} link_t;
+
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+bool link_sim_frame_lost(uint32_t *rng, double loss_rate) {
+    return loss_rate > 0.0 && xorshift32(rng) < loss_rate * 4294967296.0;
+}
+
+// Estimated CAN-FD frame time with bit-rate switching: arbitration, ACK and
+// EOF at the nominal rate; DLC, data and CRC at the data rate with ~10% bit
+// stuffing
+static uint32_t canfd_frame_time_us(const can_bus_config_t *bus, size_t length) {
+    uint32_t nominal_bits = 30;
+    uint32_t data_bits = 4 + (uint32_t)length * 8 + (length > 16 ? 21 : 17) + 6;
+    return nominal_bits * 1000000u / bus->nominal_bitrate +
+           data_bits * 1100000u / bus->data_bitrate;
+}
+
+static uint32_t serial_frame_time_us(uint32_t bitrate, size_t length) {
+    return (uint32_t)((length + LINK_FRAME_OVERHEAD) * 8 * 1000000ull / bitrate);
+}
+
+static void on_response(transport_t transport, const uint8_t *frame, size_t length,
+                        void *ctx) {
+    response_queue_t *queue = ctx;
+    if (transport != queue->transport) {
+        return; // Meant for another host
+    }
+    if (length < 2 || length > RESPONSE_FRAME_MAX || queue->count >= RESPONSE_QUEUE_SIZE) {
+        return;
+    }
+    queue->frames_sent++;
+    queue->bytes_sent += (uint32_t)length + LINK_FRAME_OVERHEAD;
+    if (link_sim_frame_lost(&queue->rng, queue->loss_rate)) {
+        return;
+    }
+    memcpy(queue->frames[queue->count], frame, length);
+    queue->lengths[queue->count++] = (uint8_t)length;
+    if (queue->can) {
+        // Single Frame carrying the response
+        queue->bus_debt_us += canfd_frame_time_us(queue->can, length + 1);
+        queue->can_frames++;
+    } else if (queue->bitrate) {
+        queue->bus_debt_us += serial_frame_time_us(queue->bitrate, length);
+    }
+}
+
+// The device may only answer while the host is not sending
+static bool on_tx_ready(transport_t transport, void *ctx) {
+    const response_queue_t *queue = ctx;
+    return transport != queue->transport || !queue->line_busy;
+}
+
+// Lets the device run while the bus is busy for duration_us
+static void bus_wait(uint32_t duration_us) {
+    uint32_t start = get_system_tick();
+    while (get_system_tick() - start < duration_us) {
+        bootloader_process_cycle();
+    }
+}
+
+static void on_flow_control(const uint8_t *frame, size_t length, void *ctx) {
+    link_t *link = ctx;
+    memcpy(link->flow_control, frame, length);
+    link->flow_control_length = length;
+    link->result->flow_controls++;
+    link->responses.bus_debt_us += canfd_frame_time_us(link->config->can, length);
+    link->responses.can_frames++;
+}
+
+// Carries one packet over the CAN-FD bus as ISO-TP frames, honouring the
+// device's block size and separation time
+static void can_send(link_t *link, const uint8_t *data, size_t length) {
+    const can_bus_config_t *bus = link->config->can;
+    uint8_t frame[CANFD_MAX_DLEN];
+    isotp_sender_t tx;
+    isotp_sender_start(&tx, data, length);
+    
+    for (;;) {
+        size_t frame_length = isotp_sender_next_frame(&tx, frame);
+        if (frame_length == 0) {
+            if (tx.state != ISOTP_TX_WAIT_FC || link->flow_control_length == 0) {
+                break; // Sent, aborted by the device, or no Flow Control
+            }
+            isotp_sender_on_flow_control(&tx, link->flow_control, link->flow_control_length);
+            link->flow_control_length = 0;
+            continue;
+        }
+        
+        // Responses and Flow Control already queued go first, then this
+        // frame; the device sees it once fully received
+        bus_wait(link->responses.bus_debt_us);
+        link->responses.bus_debt_us = 0;
+        bus_wait(canfd_frame_time_us(bus, frame_length));
+        link->responses.can_frames++;
+        isotp_receive_frame(&link->isotp, frame, frame_length);
+        
+        if (tx.state == ISOTP_TX_SENDING && tx.offset > 0) {
+            bus_wait(tx.st_min_us);
+        }
+    }
+}
+
+// One frame on a plain link: it holds the link for its air time, after
+// any responses queued ahead of it, and then reaches the device unless lost
+static void serial_send(link_t *link, const uint8_t *frame, size_t length) {
+    if (link->config->bitrate) {
+        bus_wait(link->responses.bus_debt_us);
+        link->responses.bus_debt_us = 0;
+        link->responses.line_busy = true;
+        bus_wait(serial_frame_time_us(link->config->bitrate, length));
+        link->responses.line_busy = false;
+    }
+    if (link_sim_frame_lost(&link->rng, link->config->loss_rate)) {
+        return;
+    }
+    if (link->config->fec_parity) {
+        fec_receive_frame(&link->fec_rx, frame, length);
+    } else {
+        bootloader_receive_packet_from(link->config->transport, frame, length);
+    }
+}
+
+static void link_send(link_t *link, const uint8_t *data, size_t length) {
+    link->result->packets_sent++;
+    if (link->config->can) {
+        if (!link_sim_frame_lost(&link->rng, link->config->loss_rate)) {
+            can_send(link, data, length);
+        }
+    } else if (link->config->fec_parity) {
+        uint8_t frames[1 + FEC_MAX_PARITY][FEC_MAX_FRAME_SIZE];
+        size_t lengths[1 + FEC_MAX_PARITY];
+        int count = fec_encode(&link->fec_tx, data, length, frames, lengths);
+        for (int i = 0; i < count; i++) {
+            serial_send(link, frames[i], lengths[i]);
+        }
+        link->result->parity_frames += count - 1;
+    } else {
+        serial_send(link, data, length);
+    }
+}
+
+// Sends the parity of a partly filled FEC group, so losses in it can be
+// repaired before the host has to time out
+static void link_flush(link_t *link) {
+    if (!link->config->fec_parity || link->config->can) {
+        return;
+    }
+    uint8_t frames[FEC_MAX_PARITY][FEC_MAX_FRAME_SIZE];
+    size_t lengths[FEC_MAX_PARITY];
+    int count = fec_flush(&link->fec_tx, frames, lengths);
+    for (int i = 0; i < count; i++) {
+        serial_send(link, frames[i], lengths[i]);
+    }
+    link->result->parity_frames += count;
+}
+
+// Stop-and-wait exchange for session start/end. Returns the ACK's credits,
+// or -1 if the device never acknowledged.
+static int link_exchange(link_t *link, const uint8_t *data, size_t length,
+                         uint32_t timeout_us) {
+    for (int attempt = 0; attempt < CONTROL_RETRIES; attempt++) {
+        link->responses.count = 0;
+        link_send(link, data, length);
+        link_flush(link);
+        uint32_t sent_at = get_system_tick();
+        while (get_system_tick() - sent_at < timeout_us) {
+            bootloader_process_cycle();
+            for (int i = 0; i < link->responses.count; i++) {
+                if (link->responses.frames[i][0] == RSP_ACK) {
+                    link->result->acks++;
+                    int credits = link->responses.frames[i][1];
+                    link->responses.count = 0;
+                    return credits;
+                }
+                link->result->nacks++;
+            }
+            link->responses.count = 0;
+        }
+        link->result->timeouts++;
+    }
+    return -1;
+}
+
+// The byte at offset in a region, made up from the two
+static uint8_t image_byte(const dfu_host_config_t *host, uint8_t region, uint32_t offset) {
+    return host->region_count > 0 ? (uint8_t)(offset * 7 + region * 37 + 1) : (uint8_t)offset;
+}
+
+// The START packet: plain, its CRC matching the simulated validation, or a
+// manifest with each region's CRC-32
+static size_t build_start(const dfu_host_config_t *host, uint8_t *packet) {
+    packet[0] = 0x00;
+    packet[1] = PKT_START_SESSION;
+    if (host->region_count == 0) {
+        const uint8_t plain[] = {(uint8_t)(host->image_size >> 24), (uint8_t)(host->image_size >> 16),
+                                 (uint8_t)(host->image_size >> 8), (uint8_t)host->image_size,
+                                 0x12, 0x34};
+        memcpy(&packet[PACKET_HEADER_SIZE], plain, sizeof(plain));
+        return PACKET_HEADER_SIZE + sizeof(plain);
+    }
+    uint8_t *p = &packet[PACKET_HEADER_SIZE];
+    *p++ = SESSION_MANIFEST;
+    *p++ = 0x12;
+    *p++ = 0x34;
+    *p++ = host->region_count;
+    for (uint8_t i = 0; i < host->region_count; i++) {
+        const dfu_region_t *region = &host->regions[i];
+        uint8_t chunk[REGION_DATA_SIZE];
+        uint32_t crc = 0;
+        for (uint32_t offset = 0; offset < region->size; offset += sizeof(chunk)) {
+            uint32_t length = region->size - offset < sizeof(chunk) ? region->size - offset :
+                                                                      sizeof(chunk);
+            for (uint32_t j = 0; j < length; j++) {
+                chunk[j] = image_byte(host, (uint8_t)region->region, offset + j);
+            }
+            crc = crc32_update(crc, chunk, length);
+        }
+        const uint8_t entry[9] = {(uint8_t)region->region,
+                                  (uint8_t)(region->size >> 24), (uint8_t)(region->size >> 16),
+                                  (uint8_t)(region->size >> 8), (uint8_t)region->size,
+                                  (uint8_t)(crc >> 24), (uint8_t)(crc >> 16),
+                                  (uint8_t)(crc >> 8), (uint8_t)crc};
+        memcpy(p, entry, sizeof(entry));
+        p += sizeof(entry);
+    }
+    return (size_t)(p - packet);
+}
+
+// Data packet number n, from 1: the next payload of the image, or of the
+// manifest's regions one after the other
+static size_t build_data(const dfu_host_config_t *host, uint32_t n, uint8_t *packet) {
+    packet[0] = (uint8_t)n;
+    if (host->region_count == 0) {
+        uint32_t offset = (n - 1) * MAX_PAYLOAD_SIZE;
+        uint32_t length = host->image_size - offset < MAX_PAYLOAD_SIZE ?
+                          host->image_size - offset : MAX_PAYLOAD_SIZE;
+        packet[1] = PKT_DATA;
+        for (uint32_t i = 0; i < length; i++) {
+            packet[PACKET_HEADER_SIZE + i] = image_byte(host, 0, offset + i);
+        }
+        return PACKET_HEADER_SIZE + length;
+    }
+    uint32_t index = n - 1;
+    for (uint8_t i = 0; i < host->region_count; i++) {
+        const dfu_region_t *region = &host->regions[i];
+        uint32_t packets = (region->size + REGION_DATA_SIZE - 1) / REGION_DATA_SIZE;
+        if (index >= packets) {
+            index -= packets;
+            continue;
+        }
+        uint32_t offset = index * REGION_DATA_SIZE;
+        uint32_t length = region->size - offset < REGION_DATA_SIZE ?
+                          region->size - offset : REGION_DATA_SIZE;
+        packet[1] = PKT_REGION_DATA;
+        packet[2] = (uint8_t)region->region;
+        packet[3] = (uint8_t)(offset >> 16);
+        packet[4] = (uint8_t)(offset >> 8);
+        packet[5] = (uint8_t)offset;
+        for (uint32_t j = 0; j < length; j++) {
+            packet[PACKET_HEADER_SIZE + 4 + j] = image_byte(host, (uint8_t)region->region, offset + j);
+        }
+        return PACKET_HEADER_SIZE + 4 + length;
+    }
+    return 0;
+}
+
+void link_sim_run_dfu(const link_config_t *config, const dfu_host_config_t *host,
+                      dfu_transfer_result_t *result) {
+    link_t link;
+    memset(&link, 0, sizeof(link));
+    memset(result, 0, sizeof(*result));
+    link.config = config;
+    link.result = result;
+    link.rng = config->seed ? config->seed : 1;
+    link.responses.rng = link.rng ^ 0x9E3779B9u;
+    link.responses.loss_rate = config->response_loss_rate;
+    link.responses.transport = config->transport;
+    link.responses.can = config->can;
+    link.responses.bitrate = config->can ? 0 : config->bitrate;
+    fec_encoder_init(&link.fec_tx, config->fec_parity);
+    fec_decoder_init(&link.fec_rx, config->transport);
+    if (config->can) {
+        isotp_receiver_init(&link.isotp, config->transport, config->can->block_size,
+                            config->can->st_min, on_flow_control, &link);
+    }
+    
+    platform_set_response_hook(on_response, &link.responses);
+    platform_set_tx_ready_hook(on_tx_ready, &link.responses);
+    bootloader_init();
+    bootloader_set_ack_coalescing(!config->ack_per_packet);
+    bootloader_set_erase_ahead(!config->erase_on_demand);
+    
+    uint32_t total_bytes = host->image_size;
+    uint32_t total_packets = (host->image_size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    if (host->region_count > 0) {
+        total_bytes = total_packets = 0;
+        for (uint8_t i = 0; i < host->region_count; i++) {
+            total_bytes += host->regions[i].size;
+            total_packets += (host->regions[i].size + REGION_DATA_SIZE - 1) / REGION_DATA_SIZE;
+        }
+    }
+    if (total_packets > MAX_DATA_PACKETS) {
+        return;
+    }
+    uint32_t start_time = get_system_tick();
+    
+    uint8_t start[MAX_PACKET_SIZE];
+    size_t start_length = build_start(host, start);
+    int credits = link_exchange(&link, start, start_length, host->retransmit_timeout_us);
+    
+    // Go-back-N data transfer; each ACK covers every packet up to the
+    // sequence it echoes
+    uint32_t base = 1, next = 1, highest_sent = 0;
+    uint32_t last_progress = get_system_tick();
+    uint64_t ack_latency_total = 0;
+    uint32_t ack_latency_count = 0;
+    uint32_t fec_flush_us = config->bitrate ?
+                            2 * serial_frame_time_us(config->bitrate, FEC_MAX_FRAME_SIZE) :
+                            host->retransmit_timeout_us / 4;
+    while (credits >= 0 && base <= total_packets) {
+        if (get_system_tick() - start_time > TRANSFER_TIME_LIMIT_US) {
+            break;
+        }
+        
+        while (next <= total_packets && next - base < host->window &&
+               (!host->use_credits || credits > 0)) {
+            uint8_t packet[MAX_PACKET_SIZE];
+            size_t length = build_data(host, next, packet);
+            
+            if (next <= highest_sent) {
+                result->retransmissions++;
+            } else {
+                highest_sent = next;
+            }
+            sent_at[next] = get_system_tick();
+            link_send(&link, packet, length);
+            if (host->use_credits) {
+                credits--;
+            }
+            next++;
+        }
+        
+        bootloader_process_cycle();
+        
+        for (int i = 0; i < link.responses.count; i++) {
+            uint8_t type = link.responses.frames[i][0];
+            uint8_t value = link.responses.frames[i][1];
+            if (type == RSP_ACK) {
+                result->acks++;
+                // Stale ACKs, for packets already covered, map past highest_sent
+                uint8_t seq = link.responses.lengths[i] >= 3 ? link.responses.frames[i][2]
+                                                             : (uint8_t)base;
+                uint32_t acked = base + (uint8_t)(seq - (uint8_t)base);
+                for (; base <= acked && acked <= highest_sent; base++) {
+                    ack_latency_total += get_system_tick() - sent_at[base];
+                    ack_latency_count++;
+                }
+                if (next < base) {
+                    next = base; // Acknowledged while being resent
+                }
+                credits = value;
+                last_progress = get_system_tick();
+            } else if (value == 0x02 && link.responses.lengths[i] >= 3) {
+                // Resync NACK: the device names the sequence it expects,
+                // which may be ahead of base if ACKs were lost
+                result->nacks++;
+                uint8_t expected = link.responses.frames[i][2];
+                uint32_t resync = base + (uint8_t)(expected - (uint8_t)base);
+                if (resync <= next) {
+                    base = resync;
+                    next = resync;
+                }
+                if (host->use_credits && credits == 0) {
+                    credits = 1; // Resend the gap; its ACK carries real credits
+                }
+            } else {
+                result->nacks++;
+                next = base; // Go back and resend everything unacknowledged
+            }
+        }
+        link.responses.count = 0;
+        
+        bootloader_stats_t stats;
+        bootloader_get_stats(&stats);
+        if (stats.state == STATE_EMERGENCY_RECOVERY) {
+            result->recovery_entered = true;
+            break;
+        }
+        
+        // ACKs stalling for longer than their usual spacing mean a loss:
+        // the open FEC group's parity may repair it before the timeout
+        if (get_system_tick() - last_progress > fec_flush_us) {
+            link_flush(&link);
+        }
+        
+        if (get_system_tick() - last_progress > host->retransmit_timeout_us) {
+            result->timeouts++;
+            next = base;
+            credits = 1; // Probe; the next ACK restores the real credit count
+            last_progress = get_system_tick();
+        }
+    }
+    
+    if (credits >= 0 && base > total_packets && !result->recovery_entered) {
+        uint8_t end[] = {(uint8_t)(total_packets + 1), PKT_END_SESSION};
+        if (link_exchange(&link, end, sizeof(end), host->retransmit_timeout_us) >= 0) {
+            result->completed = true;
+        }
+    }
+    
+    result->seconds = (get_system_tick() - start_time) / 1e6;
+    if (ack_latency_count > 0) {
+        result->avg_ack_latency_us = (double)ack_latency_total / ack_latency_count;
+    }
+    if (result->completed && result->seconds > 0) {
+        result->goodput_kib_s = total_bytes / 1024.0 / result->seconds;
+    }
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    result->packets_dropped = stats.packets_dropped;
+    result->can_frames = link.responses.can_frames;
+    result->fec_recovered = link.fec_rx.recovered;
+    result->response_frames = link.responses.frames_sent;
+    result->response_bytes = link.responses.bytes_sent;
+    if (stats.state == STATE_EMERGENCY_RECOVERY) {
+        result->recovery_entered = true;
+    }
+    
+    platform_set_response_hook(NULL, NULL);
+    platform_set_tx_ready_hook(NULL, NULL);
+}
@@ -0,0 +1,71 @@
+#ifndef LINK_SIM_H
+#define LINK_SIM_H
+
+#include "bootloader.h"
+
+// Host-side link emulator: drives a complete DFU transfer into the
+// bootloader through a lossy link and reports what it cost
+
+// Simulated CAN-FD bus. Packets are carried by ISO-TP; every frame, in
+// either direction, holds the bus for its estimated transmission time.
+typedef struct {
+    uint32_t nominal_bitrate;  // Arbitration phase, bit/s
+    uint32_t data_bitrate;     // Data phase, bit/s
+    uint8_t block_size;        // Device's ISO-TP block size, 0 = unlimited
+    uint8_t st_min;            // Device's ISO-TP STmin, as on the wire
+} can_bus_config_t;
+
+typedef struct {
+    double loss_rate;          // Probability a host -> device frame is lost
+    double response_loss_rate; // Probability a device -> host frame is lost
+    uint32_t seed;
+    transport_t transport;     // Interface the host is attached to
+    const can_bus_config_t *can; // Non-NULL: send over a simulated CAN-FD bus
+    uint32_t bitrate;          // Otherwise: half-duplex link rate in bit/s, 0 = unlimited
+    uint8_t fec_parity;        // FEC parity frames per group (fec.h), 0 = no FEC
+    bool ack_per_packet;       // Baseline: the device does not coalesce ACKs
+    bool erase_on_demand;      // Baseline: no erase-ahead of manifest regions
+} link_config_t;
+
+// One target of a manifest session
+typedef struct {
+    region_t region;
+    uint32_t size;
+} dfu_region_t;
+
+typedef struct {
+    uint32_t image_size;
+    uint32_t window;              // Max packets in flight
+    bool use_credits;             // Also limit in-flight packets to ACK credits
+    uint32_t retransmit_timeout_us;
+    uint8_t region_count;         // Non-zero: one manifest session over these
+    const dfu_region_t *regions;  // regions, in order, instead of image_size bytes
+} dfu_host_config_t;
+
+typedef struct {
+    bool completed;
+    bool recovery_entered;
+    uint32_t packets_sent;
+    uint32_t retransmissions;
+    uint32_t packets_dropped;     // Device-side buffer overflows
+    uint32_t acks;
+    uint32_t nacks;
+    uint32_t timeouts;
+    double avg_ack_latency_us;   // Data packet sent -> its ACK seen
+    uint32_t can_frames;         // Frames on the bus, both directions
+    uint32_t flow_controls;
+    uint32_t parity_frames;      // FEC overhead
+    uint32_t fec_recovered;      // Lost data frames rebuilt from parity
+    uint32_t response_frames;    // Sent by the device, lost or not
+    uint32_t response_bytes;     // Including serial link framing
+    double seconds;
+    double goodput_kib_s;
+} dfu_transfer_result_t;
+
+// Seeded loss model: true if the next frame is lost
+bool link_sim_frame_lost(uint32_t *rng, double loss_rate);
+
+void link_sim_run_dfu(const link_config_t *link, const dfu_host_config_t *host,
+                      dfu_transfer_result_t *result);
+
+#endif
@@ -0,0 +1,23 @@
+#include "merkle.h"
+#include "crc32.h"
+
+static uint32_t merkle_node(uint32_t left, uint32_t right) {
+    uint8_t node[9] = { 0x01,
+                        (uint8_t)(left >> 24), (uint8_t)(left >> 16), (uint8_t)(left >> 8),
+                        (uint8_t)left,
+                        (uint8_t)(right >> 24), (uint8_t)(right >> 16), (uint8_t)(right >> 8),
+                        (uint8_t)right };
+    return crc32_update(0, node, sizeof(node));
+}
+
+// Recursion depth is log2 of the leaf count: 9 for a full application area
+uint32_t merkle_root(const uint32_t *leaves, uint32_t count) {
+    if (count <= 1) {
+        return count == 1 ? leaves[0] : 0;
+    }
+    uint32_t split = 1;
+    while (split * 2 < count) {
+        split *= 2;
+    }
+    return merkle_node(merkle_root(leaves, split), merkle_root(&leaves[split], count - split));
+}
@@ -0,0 +1,17 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+
+// Merkle tree over the CRC-32s of an image's flash pages, the leaves. An
+// inner node is the CRC-32 of 0x01 then its children, each big-endian; a
+// run of n > 1 leaves splits where the left part is the largest power of
+// two below n (as RFC 6962 does), so a lone last leaf is carried up
+// unchanged and no leaf is ever paired with itself. The root stands for the
+// whole table: one value at the session start catches accidental
+// corruption of any page CRC that follows, and any subtree can be computed
+// on its own. Every node is a CRC-32, which is linear, so anyone can build
+// a table that matches a chosen root: this is not an authenticity check.
+uint32_t merkle_root(const uint32_t *leaves, uint32_t count);
+
+#endif
@@ -1,26 +1,70 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "bootloader.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLASH_OPERATION_TIME_US 2000 // 2ms flash write time
+#define MOCK_FLASH_SIZE (2*1024*1024) // Application, config and co-processor regions
 
-static uint8_t mock_flash[1024*1024] = {0xFF};
+static uint8_t flash_memory[MOCK_FLASH_SIZE] = {0xFF};
+static uint8_t *mock_flash = flash_memory; // Or a mapped flash file
+static uint32_t flash_operation_time_us = FLASH_OPERATION_TIME_US;
 static bool flash_busy = false;
 static struct timespec flash_start_time;
+static uint32_t flash_fault_threshold = 0; // Of 2^32: the odds a write flips a bit
+static uint32_t flash_fault_state;
+
+// Event flag behind platform_wait_for_event(). On target this is the
+// interrupt controller's pending state and the wait is a WFI.
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static bool event_pending = false;
+
+static response_hook_t response_hook = NULL;
+static void *response_hook_ctx = NULL;
+static tx_ready_hook_t tx_ready_hook = NULL;
+static void *tx_ready_hook_ctx = NULL;
+
+// Stands in for masking the RX interrupt around ring buffer updates
+static pthread_mutex_t critical_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t elapsed_us_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
 
 bool start_flash_write(uint32_t address, const uint8_t *data, size_t length) {
     if (flash_busy) {
-        printf("[FLASH] Busy - rejected\n");
+        BOOT_LOG("[FLASH] Busy - rejected\n");
         return false;
     }
     
-    printf("[FLASH] Writing %zu bytes to 0x%08X\n", length, address);
+    BOOT_LOG("[FLASH] Writing %zu bytes to 0x%08X\n", length, address);
     
     // Copy to mock flash
-    uint32_t offset = address & 0xFFFFF; // Mask to 1MB
+    uint32_t offset = address & (MOCK_FLASH_SIZE - 1);
     memcpy(&mock_flash[offset], data, length);
     
+    // A weak cell: one bit of the write does not take
+    if (flash_fault_threshold > 0 && length > 0) {
+        flash_fault_state = flash_fault_state * 1664525u + 1013904223u;
+        if (flash_fault_state < flash_fault_threshold) {
+            flash_fault_state = flash_fault_state * 1664525u + 1013904223u;
+            uint32_t bit = (flash_fault_state >> 8) % (uint32_t)(length * 8);
+            mock_flash[offset + bit / 8] ^= (uint8_t)(1u << (bit % 8));
+        }
+    }
+    
     // Simulate flash delay
     flash_busy = true;
     clock_gettime(CLOCK_MONOTONIC, &flash_start_time);
@@ -29,14 +73,14 @@ bool start_flash_write(uint32_t address, const uint8_t *data, size_t length) {
 }
 bool start_flash_erase(uint32_t address) {
     if (flash_busy) {
-        printf("[FLASH] Erase busy - rejected\n");
+        BOOT_LOG("[FLASH] Erase busy - rejected\n");
         return false;
     }
     
-    printf("[FLASH] Erasing page at 0x%08X\n", address);
+    BOOT_LOG("[FLASH] Erasing page at 0x%08X\n", address);
     
     // Simulate page erase - set page to 0xFF
-    uint32_t offset = address & 0xFFFFF;
+    uint32_t offset = address & (MOCK_FLASH_SIZE - 1);
     uint32_t page_start = (offset / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
     memset(&mock_flash[page_start], 0xFF, FLASH_PAGE_SIZE);
     
@@ -45,27 +89,198 @@ bool start_flash_erase(uint32_t address) {
     
     return true;
 }
+// Flash is memory-mapped: reads need no flash controller
+const uint8_t *flash_memory_at(uint32_t address) {
+    return &mock_flash[address & (MOCK_FLASH_SIZE - 1)];
+}
+
 bool is_flash_operation_complete(void) {
     if (!flash_busy) return true;
     
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    
-    uint64_t elapsed_us = (now.tv_sec - flash_start_time.tv_sec) * 1000000 +
-                         (now.tv_nsec - flash_start_time.tv_nsec) / 1000;
-    
-    if (elapsed_us > 2000) { // 2ms flash write time
+    if (elapsed_us_since(&flash_start_time) > flash_operation_time_us) {
         flash_busy = false;
-        printf("[FLASH] Write complete\n");
+        BOOT_LOG("[FLASH] Write complete\n");
     }
     
     return !flash_busy;
 }
 
-void send_ack_packet(void) {
-    printf("[COMM] -> ACK\n");
+#ifndef BOOTLOADER_QUIET
+static const char *const transport_names[TRANSPORT_COUNT] = { "UART", "USB", "CAN" };
+#endif
+
+static void send_response(transport_t transport, uint8_t type, uint8_t value) {
+    if (response_hook) {
+        uint8_t frame[2] = {type, value};
+        response_hook(transport, frame, sizeof(frame), response_hook_ctx);
+    }
+}
+
+void send_ack_packet(transport_t transport, uint8_t credits, uint8_t seq) {
+    BOOT_LOG("[COMM] %s -> ACK (seq %d, credits %d)\n", transport_names[transport], seq, credits);
+    if (response_hook) {
+        uint8_t frame[3] = {RSP_ACK, credits, seq};
+        response_hook(transport, frame, sizeof(frame), response_hook_ctx);
+    }
+}
+
+void send_nack_packet(transport_t transport, uint8_t error_code) {
+    BOOT_LOG("[COMM] %s -> NACK (0x%02X)\n", transport_names[transport], error_code);
+    send_response(transport, RSP_NACK, error_code);
+}
+
+void send_seq_nack_packet(transport_t transport, uint8_t expected_seq) {
+    BOOT_LOG("[COMM] %s -> NACK (0x02, expected seq %d)\n", transport_names[transport], expected_seq);
+    if (response_hook) {
+        uint8_t frame[3] = {RSP_NACK, 0x02, expected_seq};
+        response_hook(transport, frame, sizeof(frame), response_hook_ctx);
+    }
+}
+
+// ranges holds range_count {first, count} pairs: chunks for RSP_GAPS,
+// pages for RSP_BAD_PAGES
+void send_range_report_packet(transport_t transport, uint8_t type, uint16_t missing,
+                              const uint16_t *ranges, uint8_t range_count) {
+    BOOT_LOG("[COMM] %s -> %s (%d %s, %d ranges)\n", transport_names[transport],
+             type == RSP_GAPS ? "GAPS" : "BAD PAGES", missing,
+             type == RSP_GAPS ? "chunks missing" : "pages bad", range_count);
+    if (response_hook) {
+        uint8_t frame[4 + GAP_REPORT_MAX_RANGES * 4] = {type, range_count,
+                                                        (uint8_t)(missing >> 8), (uint8_t)missing};
+        for (int i = 0; i < range_count * 2; i++) {
+            frame[4 + i * 2] = (uint8_t)(ranges[i] >> 8);
+            frame[5 + i * 2] = (uint8_t)ranges[i];
+        }
+        response_hook(transport, frame, 4 + (size_t)range_count * 4, response_hook_ctx);
+    }
+}
+
+// 0 takes flash programming time out of benchmarks of everything else
+void platform_set_flash_time_us(uint32_t time_us) {
+    flash_operation_time_us = time_us;
 }
 
-void send_nack_packet(uint8_t error_code) {
-    printf("[COMM] -> NACK (0x%02X)\n", error_code);
-}
\ No newline at end of file
+// Each write then flips one bit with this probability, picked by a fixed
+// pseudo-random sequence so a run can be repeated. 0 turns faults off.
+void platform_set_flash_fault_rate(double per_write) {
+    flash_fault_threshold = per_write <= 0 ? 0 : per_write >= 1 ? UINT32_MAX :
+                            (uint32_t)(per_write * 4294967296.0);
+    flash_fault_state = 12345;
+}
+
+// Flips one bit of programmed flash in place, as bit rot would
+void platform_flip_flash_bit(uint32_t address, uint8_t bit) {
+    mock_flash[address & (MOCK_FLASH_SIZE - 1)] ^= (uint8_t)(1u << (bit % 8));
+}
+
+// The file holds the whole 2 MB flash, byte for byte at address & 0x1FFFFF.
+// A new or short file is extended with erased (0xFF) bytes. Writes reach
+// the file through the shared mapping, even if the process is killed.
+bool platform_map_flash_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    if (st.st_size < MOCK_FLASH_SIZE) {
+        uint8_t erased[4096];
+        memset(erased, 0xFF, sizeof(erased));
+        off_t offset = st.st_size;
+        while (offset < MOCK_FLASH_SIZE) {
+            size_t chunk = MOCK_FLASH_SIZE - offset < (off_t)sizeof(erased) ?
+                           (size_t)(MOCK_FLASH_SIZE - offset) : sizeof(erased);
+            ssize_t n = pwrite(fd, erased, chunk, offset);
+            if (n <= 0) {
+                close(fd);
+                return false;
+            }
+            offset += n;
+        }
+    }
+    void *memory = mmap(NULL, MOCK_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    mock_flash = memory;
+    return true;
+}
+
+void platform_set_response_hook(response_hook_t hook, void *ctx) {
+    response_hook = hook;
+    response_hook_ctx = ctx;
+}
+
+// On target: the transmitter is idle and, on a half-duplex bus, no frame
+// from the host is in progress
+bool platform_tx_ready(transport_t transport) {
+    return !tx_ready_hook || tx_ready_hook(transport, tx_ready_hook_ctx);
+}
+
+void platform_set_tx_ready_hook(tx_ready_hook_t hook, void *ctx) {
+    tx_ready_hook = hook;
+    tx_ready_hook_ctx = ctx;
+}
+
+uint32_t get_system_tick(void) {
+    // Microsecond tick; wraps every ~71 minutes, callers compare by subtraction
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+void platform_enter_critical(void) {
+    pthread_mutex_lock(&critical_lock);
+}
+
+void platform_exit_critical(void) {
+    pthread_mutex_unlock(&critical_lock);
+}
+
+void platform_wait_for_event(uint32_t timeout_us) {
+    // A pending flash operation raises its completion interrupt, so never
+    // sleep past it
+    if (flash_busy) {
+        uint64_t elapsed = elapsed_us_since(&flash_start_time);
+        uint32_t remaining = elapsed > flash_operation_time_us ? 0 :
+                             (uint32_t)(flash_operation_time_us - elapsed) + 1;
+        if (remaining < timeout_us) {
+            timeout_us = remaining;
+        }
+    }
+    
+    pthread_mutex_lock(&event_lock);
+    if (!event_pending && timeout_us > 0) {
+        if (timeout_us == WAIT_FOREVER) {
+            while (!event_pending) {
+                pthread_cond_wait(&event_cond, &event_lock);
+            }
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_us / 1000000;
+            deadline.tv_nsec += (long)(timeout_us % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!event_pending) {
+                if (pthread_cond_timedwait(&event_cond, &event_lock, &deadline) != 0) {
+                    break; // Timer deadline reached
+                }
+            }
+        }
+    }
+    event_pending = false;
+    pthread_mutex_unlock(&event_lock);
+}
+
+void platform_signal_event(void) {
+    pthread_mutex_lock(&event_lock);
+    event_pending = true;
+    pthread_cond_signal(&event_cond);
+    pthread_mutex_unlock(&event_lock);
+}
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "shm_link.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static shm_link_t *map_link(int fd) {
+    void *memory = mmap(NULL, sizeof(shm_link_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+shm_link_t *shm_link_create(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(shm_link_t)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    shm_link_t *link = map_link(fd);
+    if (link) {
+        __atomic_store_n(&link->magic, SHM_LINK_MAGIC, __ATOMIC_RELEASE);
+    }
+    return link;
+}
+
+shm_link_t *shm_link_attach(const char *path) {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shm_link_t)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    shm_link_t *link = map_link(fd);
+    if (link && __atomic_load_n(&link->magic, __ATOMIC_ACQUIRE) != SHM_LINK_MAGIC) {
+        munmap(link, sizeof(shm_link_t));
+        return NULL;
+    }
+    if (link) {
+        // The host is the only consumer of to_host
+        uint32_t head = __atomic_load_n(&link->to_host.head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&link->to_host.tail, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&link->host_attached, 1, __ATOMIC_RELEASE);
+    }
+    return link;
+}
+
+void shm_link_detach(shm_link_t *link) {
+    __atomic_store_n(&link->host_attached, 0, __ATOMIC_RELEASE);
+    munmap(link, sizeof(shm_link_t));
+}
+
+bool shm_ring_send(shm_ring_t *ring, const uint8_t *data, size_t length) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == SHM_RING_SLOTS || length > MAX_PACKET_SIZE) {
+        return false;
+    }
+    shm_slot_t *slot = &ring->slots[head % SHM_RING_SLOTS];
+    memcpy(slot->data, data, length);
+    slot->length = (uint32_t)length;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+const shm_slot_t *shm_ring_peek(shm_ring_t *ring) {
+    uint32_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return NULL;
+    }
+    return &ring->slots[tail % SHM_RING_SLOTS];
+}
+
+void shm_ring_consume(shm_ring_t *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+size_t shm_ring_receive(shm_ring_t *ring, uint8_t *out, size_t out_size) {
+    const shm_slot_t *slot = shm_ring_peek(ring);
+    if (!slot) {
+        return 0;
+    }
+    size_t length = slot->length <= out_size ? slot->length : 0;
+    memcpy(out, slot->data, length);
+    shm_ring_consume(ring);
+    return length;
+}
@@ -0,0 +1,58 @@
+#ifndef SHM_LINK_H
+#define SHM_LINK_H
+
+#include "bootloader.h"
+
+// Shared-memory link for throughput benchmarks: a host and a simulated
+// device exchange whole packets through two single-producer single-consumer
+// rings in one mapped file, e.g. under /dev/shm. Each index is written by
+// one side only, published with a release store and read with an acquire
+// load, so sending and receiving take no syscall and no lock. A side with
+// nothing to do polls, yielding the CPU between polls.
+
+#define SHM_RING_SLOTS 64 // Power of two
+#define SHM_LINK_MAGIC 0x444D4853u
+
+typedef struct {
+    uint32_t length;
+    uint8_t data[MAX_PACKET_SIZE];
+} shm_slot_t;
+
+// Producer and consumer indices sit on their own cache lines
+typedef struct {
+    uint32_t head;            // Free-running; written by the producer
+    uint8_t head_pad[60];
+    uint32_t tail;            // Free-running; written by the consumer
+    uint8_t tail_pad[60];
+    shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t host_attached;   // Set by the host while it uses the link
+    uint8_t pad[56];
+    shm_ring_t to_device;
+    shm_ring_t to_host;
+} shm_link_t;
+
+// Device side: creates or resets the file with empty rings
+shm_link_t *shm_link_create(const char *path);
+
+// Host side: maps a link a device created, skipping responses left for an
+// earlier host, and marks it attached until shm_link_detach()
+shm_link_t *shm_link_attach(const char *path);
+void shm_link_detach(shm_link_t *link);
+
+// Returns false if the ring is full or the packet too long
+bool shm_ring_send(shm_ring_t *ring, const uint8_t *data, size_t length);
+
+// Returns the next packet's length, or 0 if the ring is empty. A packet
+// longer than out_size is dropped.
+size_t shm_ring_receive(shm_ring_t *ring, uint8_t *out, size_t out_size);
+
+// Zero-copy receive: the next packet in place, or NULL if the ring is
+// empty. It stays valid until shm_ring_consume() hands the slot back.
+const shm_slot_t *shm_ring_peek(shm_ring_t *ring);
+void shm_ring_consume(shm_ring_t *ring);
+
+#endif
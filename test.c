@@ -1,8 +1,76 @@
+#define _DEFAULT_SOURCE
+
 #include "bootloader.h"
+#include "crc32.h"
+#include "merkle.h"
+#include "framer.h"
+#include "isotp.h"
+#include "fec.h"
+#include "image_format.h"
+#include "image_loader.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+
+// A test stops the whole run at the first observation that differs from
+// what it expects, so make test fails on a regression
+#define EXPECT(cond) expect_true((cond), #cond, __LINE__)
+#define EXPECT_EQ(actual, expected) expect_eq((long)(actual), (long)(expected), #actual, __LINE__)
+
+static void expect_true(bool ok, const char *what, int line) {
+    if (!ok) {
+        printf("✗ test.c:%d: expected %s\n", line, what);
+        exit(1);
+    }
+}
+
+static void expect_eq(long actual, long expected, const char *what, int line) {
+    if (actual != expected) {
+        printf("✗ test.c:%d: %s is %ld, expected %ld\n", line, what, actual, expected);
+        exit(1);
+    }
+}
+
+// Latest response frame of any length, the latest on each transport, and
+// how many frames and ACKs there were
+static uint8_t last_frame[64];
+static size_t last_frame_length;
+static uint8_t last_response[TRANSPORT_COUNT][2];
+static int frames_seen;
+static int acks_seen;
+
+static void record_frames(transport_t transport, const uint8_t *frame, size_t length, void *ctx) {
+    (void)ctx;
+    memcpy(last_frame, frame, length);
+    last_frame_length = length;
+    memcpy(last_response[transport], frame, length < 2 ? length : 2);
+    frames_seen++;
+    acks_seen += frame[0] == RSP_ACK;
+}
+
+// Fresh bootloader for one test, with every response recorded and the
+// idle scrub off. fast_flash makes flash operations complete at once.
+static void begin_test(bool fast_flash) {
+    bootloader_init();
+    bootloader_set_scrub(0, 0);
+    platform_set_flash_time_us(fast_flash ? 0 : 2000);
+    memset(last_frame, 0, sizeof(last_frame));
+    memset(last_response, 0, sizeof(last_response));
+    last_frame_length = 0;
+    frames_seen = acks_seen = 0;
+    platform_set_response_hook(record_frames, NULL);
+}
+
+// Puts the platform back as begin_test() found it
+static void end_test(const char *name) {
+    platform_set_response_hook(NULL, NULL);
+    platform_set_tx_ready_hook(NULL, NULL);
+    platform_set_flash_time_us(2000);
+    platform_set_flash_fault_rate(0.0);
+    printf("✓ %s test passed\n\n", name);
+}
 
 void test_basic_commands(void) {
     printf("=== Test 1: Basic Command Handling ===\n");
@@ -178,6 +246,1298 @@ void test_concurrent_with_state_transitions(void) {
     printf("error recovery, and application validation workflows.\n\n");
 }
 
+static void *run_loop_thread(void *arg) {
+    (void)arg;
+    bootloader_run();
+    return NULL;
+}
+
+void test_event_driven_run_loop(void) {
+    printf("=== Test 5: Event-Driven Run Loop ===\n");
+    
+    begin_test(false);
+    
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_loop_thread, NULL);
+    
+    // Let the loop go to sleep, then wake it with packets
+    usleep(100000);
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    uint32_t wakeups_asleep = stats.wakeups;
+    uint8_t ping[] = {0x00, 0x05};
+    uint8_t status[] = {0x01, 0x06};
+    printf("Sending PING and GET_STATUS to sleeping run loop...\n");
+    bootloader_receive_packet(ping, sizeof(ping));
+    bootloader_receive_packet(status, sizeof(status));
+    usleep(100000);
+    
+    bootloader_stop();
+    pthread_join(thread, NULL);
+    
+    bootloader_get_stats(&stats);
+    printf("Processed %d packets in %d wakeups\n", stats.packets_processed, stats.wakeups);
+    EXPECT(wakeups_asleep <= 2); // No polling while idle
+    EXPECT_EQ(stats.packets_processed, 2);
+    EXPECT(stats.wakeups <= wakeups_asleep + 2);
+    EXPECT_EQ(acks_seen, 2);
+    
+    bootloader_print_stats();
+    end_test("Event-driven run loop");
+}
+
+void test_control_priority_lane(void) {
+    printf("=== Test 6: Control Packets Bypass Full Data Queue ===\n");
+    
+    begin_test(false);
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x20, 0x00, 0x12, 0x34}; // 8 KB
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(last_frame[1], BUFFER_SIZE); // START's own slot is free again
+    
+    // Fill the data FIFO completely: it holds 16 full-size packets
+    for (int i = 1; i <= 16; i++) {
+        uint8_t data_packet[258];
+        data_packet[0] = i;
+        data_packet[1] = 0x02; // PKT_DATA
+        memset(&data_packet[2], i, 256);
+        EXPECT(bootloader_receive_packet(data_packet, sizeof(data_packet)));
+    }
+    EXPECT(bootloader_rx_reserve(TRANSPORT_UART) == NULL);
+    
+    printf("Data queue full, sending PING and GET_STATUS...\n");
+    uint8_t ping[] = {0x20, 0x05};
+    uint8_t status[] = {0x21, 0x06};
+    bool ping_queued = bootloader_receive_packet(ping, sizeof(ping));
+    bool status_queued = bootloader_receive_packet(status, sizeof(status));
+    int acks_before = acks_seen;
+    bootloader_process_cycle();
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("Control packets queued: %s, handled: %d, max latency: %d us, dropped: %d\n",
+           (ping_queued && status_queued) ? "yes" : "no",
+           stats.control_packets, stats.control_latency_max_us, stats.packets_dropped);
+    EXPECT(ping_queued && status_queued);
+    EXPECT_EQ(stats.control_packets, 2);
+    EXPECT_EQ(stats.packets_dropped, 0);
+    EXPECT_EQ(acks_seen - acks_before, 2); // Data ACKs wait for their writes
+    
+    end_test("Control priority lane");
+}
+
+void test_duplicate_retransmissions(void) {
+    printf("=== Test 7: Duplicate Retransmissions After Lost ACKs ===\n");
+    
+    begin_test(false);
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x12, 0x34}; // 512 bytes
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    
+    uint8_t data_packet[258];
+    data_packet[0] = 1;
+    data_packet[1] = 0x02; // PKT_DATA
+    memset(&data_packet[2], 0xA5, 256);
+    bootloader_receive_packet(data_packet, sizeof(data_packet));
+    for (int i = 0; i < 50 && acks_seen < 2; i++) {
+        usleep(1000);
+        bootloader_process_cycle();
+    }
+    EXPECT_EQ(acks_seen, 2); // The session's and packet 1's, once written
+    
+    // The host never saw our ACK and keeps retransmitting packet 1
+    printf("Retransmitting packet 1 eight times...\n");
+    for (int i = 0; i < 8; i++) {
+        int acks_before = acks_seen;
+        bootloader_receive_packet(data_packet, sizeof(data_packet));
+        bootloader_process_cycle();
+        EXPECT_EQ(acks_seen - acks_before, 1);
+        EXPECT_EQ(last_frame[2], 1);
+    }
+    
+    // A gap: packet 3 before packet 2 gets a NACK naming seq 2
+    printf("Sending packet 3 before packet 2...\n");
+    data_packet[0] = 3;
+    bootloader_receive_packet(data_packet, sizeof(data_packet));
+    bootloader_process_cycle();
+    EXPECT_EQ(last_frame_length, 3);
+    EXPECT_EQ(last_frame[0], RSP_NACK);
+    EXPECT_EQ(last_frame[1], 0x02);
+    EXPECT_EQ(last_frame[2], 2);
+    
+    data_packet[0] = 2;
+    bootloader_receive_packet(data_packet, sizeof(data_packet));
+    usleep(3000);
+    bootloader_process_cycle();
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("State: %d, bytes: %d, duplicates re-ACKed: %d, errors: %d\n",
+           stats.state, stats.bytes_received, stats.duplicate_packets, stats.error_count);
+    EXPECT_EQ(stats.state, STATE_DFU_ACTIVE);
+    EXPECT_EQ(stats.bytes_received, 512);
+    EXPECT_EQ(stats.duplicate_packets, 8);
+    EXPECT_EQ(stats.error_count, 1);
+    
+    end_test("Duplicate retransmission");
+}
+
+void test_write_behind_queue(void) {
+    printf("=== Test 8: Write-Behind Queue and End-Session Barrier ===\n");
+    
+    begin_test(false);
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x04, 0x00, 0x12, 0x34}; // 1024 bytes
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    
+    // Back-to-back data followed immediately by END_SESSION: nothing is
+    // NACKed for flash busy and END waits for the queued writes
+    uint8_t image[1024];
+    for (int i = 1; i <= 4; i++) {
+        uint8_t data_packet[258];
+        data_packet[0] = i;
+        data_packet[1] = 0x02; // PKT_DATA
+        memset(&data_packet[2], 0x10 * i, 256);
+        memcpy(&image[(i - 1) * 256], &data_packet[2], 256);
+        bootloader_receive_packet(data_packet, sizeof(data_packet));
+    }
+    uint8_t end[] = {0x05, 0x03};
+    bootloader_receive_packet(end, sizeof(end));
+    
+    printf("Processing until the session completes...\n");
+    bootloader_stats_t stats;
+    for (int i = 0; i < 50; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("State after END_SESSION: %d, bytes: %d\n", stats.state, stats.bytes_received);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 1024);
+    EXPECT_EQ(frames_seen, acks_seen); // No NACK, for flash busy or otherwise
+    EXPECT_EQ(last_frame[2], 5);       // The END's ACK came last
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), image, sizeof(image)) == 0);
+    
+    end_test("Write-behind queue");
+}
+
+void test_zero_copy_slot_release(void) {
+    printf("=== Test 9: Flash Programmed From Held Ring Slots ===\n");
+    
+    begin_test(false);
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x04, 0x03, 0x12, 0x34}; // 1027 bytes
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    acks_seen = 0;
+    
+    // Word-aligned payloads are programmed in place: each slot - and its
+    // ACK - is only given back once its write completes
+    uint8_t image[1027];
+    for (int i = 1; i <= 4; i++) {
+        uint8_t data_packet[258];
+        data_packet[0] = i;
+        data_packet[1] = 0x02; // PKT_DATA
+        memset(&data_packet[2], 0x20 * i, 256);
+        memcpy(&image[(i - 1) * 256], &data_packet[2], 256);
+        bootloader_receive_packet(data_packet, sizeof(data_packet));
+    }
+    bootloader_process_cycle();
+    printf("ACKs right after queueing 4 aligned packets: %d\n", acks_seen);
+    EXPECT_EQ(acks_seen, 0);
+    
+    // A 3-byte tail goes through the staging copy; its ACK still waits
+    // behind the others, since ACKs are cumulative
+    uint8_t tail[] = {0x05, 0x02, 0xAA, 0xBB, 0xCC};
+    memcpy(&image[1024], &tail[2], 3);
+    bootloader_receive_packet(tail, sizeof(tail));
+    bootloader_process_cycle();
+    
+    for (int i = 0; i < 50 && acks_seen < 5; i++) {
+        usleep(1000);
+        bootloader_process_cycle();
+    }
+    
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("ACKs after the writes completed: %d, bytes: %d, dropped: %d\n",
+           acks_seen, stats.bytes_received, stats.packets_dropped);
+    EXPECT_EQ(acks_seen, 5);
+    EXPECT_EQ(last_frame[2], 5);
+    EXPECT_EQ(stats.bytes_received, 1027);
+    EXPECT_EQ(stats.packets_dropped, 0);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), image, sizeof(image)) == 0);
+    
+    end_test("Zero-copy slot release");
+}
+
+void test_transport_binding(void) {
+    printf("=== Test 10: Sessions Stay on Their Transport ===\n");
+    
+    begin_test(false);
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x01, 0x00, 0x12, 0x34}; // 256 bytes
+    bootloader_receive_packet_from(TRANSPORT_USB, start, sizeof(start));
+    bootloader_process_cycle();
+    
+    // Another host on UART tries to join the USB session, while CAN pings
+    uint8_t data_packet[258];
+    data_packet[0] = 1;
+    data_packet[1] = 0x02; // PKT_DATA
+    memset(&data_packet[2], 0x5A, 256);
+    bootloader_receive_packet_from(TRANSPORT_UART, data_packet, sizeof(data_packet));
+    uint8_t ping[] = {0x10, 0x05};
+    bootloader_receive_packet_from(TRANSPORT_CAN, ping, sizeof(ping));
+    bootloader_process_cycle();
+    printf("UART response: 0x%02X/0x%02X, CAN response: 0x%02X\n",
+           last_response[TRANSPORT_UART][0], last_response[TRANSPORT_UART][1],
+           last_response[TRANSPORT_CAN][0]);
+    EXPECT_EQ(last_response[TRANSPORT_UART][0], RSP_NACK);
+    EXPECT_EQ(last_response[TRANSPORT_UART][1], 0x13); // Bound to another transport
+    EXPECT_EQ(last_response[TRANSPORT_CAN][0], RSP_ACK);
+    
+    // The owner finishes the session over USB
+    bootloader_receive_packet_from(TRANSPORT_USB, data_packet, sizeof(data_packet));
+    uint8_t end[] = {0x02, 0x03};
+    bootloader_receive_packet_from(TRANSPORT_USB, end, sizeof(end));
+    bootloader_stats_t stats;
+    for (int i = 0; i < 20; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("State: %d, bytes: %d, session transport: %d, USB response: 0x%02X\n",
+           stats.state, stats.bytes_received, stats.session_transport,
+           last_response[TRANSPORT_USB][0]);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 256);
+    EXPECT_EQ(stats.session_transport, TRANSPORT_USB);
+    EXPECT_EQ(last_response[TRANSPORT_USB][0], RSP_ACK);
+    
+    end_test("Transport binding");
+}
+
+// Appends the frame for a packet to a byte stream
+static size_t append_frame(uint8_t *stream, size_t offset, const uint8_t *packet, size_t length) {
+    return offset + framer_encode(packet, length, &stream[offset], FRAME_MAX_ENCODED_SIZE(length));
+}
+
+void test_framed_byte_stream(void) {
+    printf("=== Test 11: DFU Session Over a Raw Byte Stream ===\n");
+    
+    begin_test(false);
+    framer_t framer;
+    framer_init(&framer, TRANSPORT_UART);
+    
+    static uint8_t stream[2048];
+    size_t length = 0;
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x12, 0x34}; // 512 bytes
+    length = append_frame(stream, length, start, sizeof(start));
+    
+    // Line noise, then a data frame with a flipped bit, then the real ones.
+    // Payloads full of zeros exercise the COBS encoding.
+    uint8_t noise[] = {0x42, 0x13, 0x37, 0x00};
+    memcpy(&stream[length], noise, sizeof(noise));
+    length += sizeof(noise);
+    
+    uint8_t data_packet[258];
+    data_packet[0] = 1;
+    data_packet[1] = 0x02; // PKT_DATA
+    for (int i = 0; i < 256; i++) {
+        data_packet[2 + i] = (i % 3 == 0) ? 0x00 : (uint8_t)i;
+    }
+    size_t corrupt_at = length;
+    length = append_frame(stream, length, data_packet, sizeof(data_packet));
+    stream[corrupt_at + 100] ^= 0x04;
+    length = append_frame(stream, length, data_packet, sizeof(data_packet));
+    data_packet[0] = 2;
+    length = append_frame(stream, length, data_packet, sizeof(data_packet));
+    uint8_t end[] = {0x03, 0x03};
+    length = append_frame(stream, length, end, sizeof(end));
+    
+    // Arrives in uneven DMA chunks
+    printf("Feeding %zu bytes in 7-byte chunks...\n", length);
+    for (size_t offset = 0; offset < length; offset += 7) {
+        size_t chunk = length - offset < 7 ? length - offset : 7;
+        framer_feed(&framer, &stream[offset], chunk);
+        bootloader_process_cycle();
+    }
+    
+    bootloader_stats_t stats;
+    for (int i = 0; i < 20; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("Frames ok: %u, CRC errors: %u, framing errors: %u\n",
+           framer.frames_ok, framer.crc_errors, framer.framing_errors);
+    printf("State: %d, bytes: %d\n", stats.state, stats.bytes_received);
+    EXPECT_EQ(framer.frames_ok, 4);
+    EXPECT_EQ(framer.crc_errors, 1);
+    EXPECT_EQ(framer.framing_errors, 1);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 512);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), &data_packet[2], 256) == 0);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START + 256), &data_packet[2], 256) == 0);
+    
+    end_test("Framed byte stream");
+}
+
+// Flow Control frames the device sends back to the tester
+static uint8_t flow_control[CANFD_MAX_DLEN];
+static size_t flow_control_length;
+static int flow_controls_seen;
+
+static void capture_flow_control(const uint8_t *frame, size_t length, void *ctx) {
+    (void)ctx;
+    memcpy(flow_control, frame, length);
+    flow_control_length = length;
+    flow_controls_seen++;
+}
+
+// Segments a packet into CAN-FD frames and feeds them to the receiver,
+// answering each wait with the device's latest Flow Control
+static void isotp_transfer(isotp_receiver_t *rx, const uint8_t *packet, size_t length) {
+    isotp_sender_t tx;
+    uint8_t frame[CANFD_MAX_DLEN];
+    isotp_sender_start(&tx, packet, length);
+    while (tx.state == ISOTP_TX_SENDING || tx.state == ISOTP_TX_WAIT_FC) {
+        size_t frame_length = isotp_sender_next_frame(&tx, frame);
+        if (frame_length > 0) {
+            isotp_receive_frame(rx, frame, frame_length);
+        } else if (flow_control_length > 0) {
+            isotp_sender_on_flow_control(&tx, flow_control, flow_control_length);
+            flow_control_length = 0;
+        } else {
+            break;
+        }
+    }
+}
+
+void test_isotp_segmentation(void) {
+    printf("=== Test 12: DFU Session Over ISO-TP on CAN-FD ===\n");
+    
+    begin_test(false);
+    isotp_receiver_t rx;
+    isotp_receiver_init(&rx, TRANSPORT_CAN, 2, 0, capture_flow_control, NULL);
+    flow_controls_seen = 0;
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x12, 0x34}; // 512 bytes
+    isotp_transfer(&rx, start, sizeof(start)); // CAN-FD Single Frame
+    bootloader_process_cycle();
+    
+    // 258-byte packets: First Frame + 4 Consecutive Frames, block size 2
+    uint8_t data_packet[258];
+    data_packet[0] = 1;
+    data_packet[1] = 0x02; // PKT_DATA
+    for (int i = 0; i < 256; i++) {
+        data_packet[2 + i] = (uint8_t)i;
+    }
+    isotp_transfer(&rx, data_packet, sizeof(data_packet));
+    bootloader_process_cycle();
+    printf("Flow Controls after first packet: %d\n", flow_controls_seen);
+    EXPECT_EQ(flow_controls_seen, 2); // 4 Consecutive Frames in blocks of 2
+    
+    // A 12-byte Single Frame with a nibble length is dropped, not read as
+    // a classic SF carrying a PING
+    uint8_t malformed[12] = {(ISOTP_PCI_SF << 4) | 2, 0x00, 0x05};
+    int acks_before = acks_seen;
+    isotp_receive_frame(&rx, malformed, sizeof(malformed));
+    bootloader_process_cycle();
+    printf("Malformed CAN-FD Single Frame: %u messages, %d ACKs\n",
+           rx.messages_ok, acks_seen - acks_before);
+    EXPECT_EQ(rx.messages_ok, 2);
+    EXPECT_EQ(acks_seen, acks_before);
+    
+    // A Consecutive Frame with the wrong sequence number aborts the message
+    uint8_t frame[CANFD_MAX_DLEN];
+    data_packet[0] = 2;
+    isotp_sender_t tx;
+    isotp_sender_start(&tx, data_packet, sizeof(data_packet));
+    isotp_receive_frame(&rx, frame, isotp_sender_next_frame(&tx, frame));
+    isotp_sender_on_flow_control(&tx, flow_control, flow_control_length);
+    flow_control_length = 0;
+    size_t frame_length = isotp_sender_next_frame(&tx, frame);
+    frame[0] = (uint8_t)((ISOTP_PCI_CF << 4) | 5);
+    isotp_receive_frame(&rx, frame, frame_length);
+    printf("Sequence errors: %u\n", rx.sequence_errors);
+    EXPECT_EQ(rx.sequence_errors, 1);
+    
+    // Retransmitted whole, then the session ends
+    isotp_transfer(&rx, data_packet, sizeof(data_packet));
+    uint8_t end[] = {0x03, 0x03};
+    isotp_transfer(&rx, end, sizeof(end));
+    
+    bootloader_stats_t stats;
+    for (int i = 0; i < 20; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("Messages: %u, Flow Controls: %d\n", rx.messages_ok, flow_controls_seen);
+    printf("State: %d, bytes: %d\n", stats.state, stats.bytes_received);
+    EXPECT_EQ(rx.messages_ok, 4);
+    EXPECT_EQ(flow_controls_seen, 5);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 512);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START + 256), &data_packet[2], 256) == 0);
+    
+    end_test("ISO-TP segmentation");
+}
+
+// Multicast data packet for one chunk of a pattern image
+static size_t multicast_chunk(uint8_t *packet, uint32_t chunk, uint32_t image_size) {
+    uint32_t offset = chunk * MULTICAST_CHUNK_SIZE;
+    uint32_t length = image_size - offset < MULTICAST_CHUNK_SIZE ? image_size - offset
+                                                                 : MULTICAST_CHUNK_SIZE;
+    packet[0] = 0;
+    packet[1] = 0x0B; // PKT_MULTICAST_DATA
+    packet[2] = (uint8_t)(offset >> 24);
+    packet[3] = (uint8_t)(offset >> 16);
+    packet[4] = (uint8_t)(offset >> 8);
+    packet[5] = (uint8_t)offset;
+    memset(&packet[6], (uint8_t)chunk, length);
+    return 6 + length;
+}
+
+static bool line_free;
+
+static bool test_tx_ready(transport_t transport, void *ctx) {
+    (void)transport;
+    (void)ctx;
+    return line_free;
+}
+
+void test_multicast_session(void) {
+    printf("=== Test 13: Multicast Session With Gap Repair ===\n");
+    
+    begin_test(false);
+    bootloader_set_node_id(7);
+    
+    // 4 chunks, the last one short; chunk 1 is lost on the way
+    uint32_t image_size = 3 * MULTICAST_CHUNK_SIZE + 100;
+    uint8_t start[] = {0x00, 0x0A, 0x00, 0x00, (uint8_t)(image_size >> 8), (uint8_t)image_size,
+                       0x12, 0x34};
+    bootloader_receive_packet_from(TRANSPORT_CAN, start, sizeof(start));
+    uint8_t packet[MAX_PACKET_SIZE];
+    const uint32_t first_pass[] = {0, 2, 3, 2};
+    for (int i = 0; i < 4; i++) {
+        bootloader_receive_packet_from(TRANSPORT_CAN, packet, multicast_chunk(packet, first_pass[i], image_size));
+        bootloader_process_cycle();
+    }
+    printf("Responses to the broadcast: %d\n", frames_seen);
+    EXPECT_EQ(frames_seen, 0);
+    
+    // Another node is asked first; only node 7 answers. The line is busy,
+    // so the report waits behind the ACK of an earlier PING.
+    uint8_t ping[] = {0x00, 0x05};
+    uint8_t query_other[] = {0x00, 0x0C, 3, 0x00, 0x00};
+    uint8_t query[] = {0x00, 0x0C, 7, 0x00, 0x00};
+    platform_set_tx_ready_hook(test_tx_ready, NULL);
+    line_free = false;
+    bootloader_receive_packet_from(TRANSPORT_CAN, ping, sizeof(ping));
+    bootloader_receive_packet_from(TRANSPORT_CAN, query_other, sizeof(query_other));
+    bootloader_receive_packet_from(TRANSPORT_CAN, query, sizeof(query));
+    bootloader_process_cycle();
+    printf("Responses while the line is busy: %d\n", frames_seen);
+    EXPECT_EQ(frames_seen, 0);
+    line_free = true;
+    bootloader_process_cycle();
+    EXPECT_EQ(acks_seen, 1); // The PING's, sent before the report
+    printf("Gap report: type 0x%02X, %d range(s), %d missing, first gap chunk %d x%d\n",
+           last_frame[0], last_frame[1], (last_frame[2] << 8) | last_frame[3],
+           (last_frame[4] << 8) | last_frame[5], (last_frame[6] << 8) | last_frame[7]);
+    const uint8_t gaps[] = {RSP_GAPS, 1, 0x00, 1, 0x00, 1, 0x00, 1};
+    EXPECT_EQ(frames_seen, 2); // Node 3's query goes unanswered
+    EXPECT_EQ(last_frame_length, sizeof(gaps));
+    EXPECT(memcmp(last_frame, gaps, sizeof(gaps)) == 0);
+    
+    // Repair round
+    bootloader_receive_packet_from(TRANSPORT_CAN, packet, multicast_chunk(packet, 1, image_size));
+    bootloader_receive_packet_from(TRANSPORT_CAN, query, sizeof(query));
+    bootloader_process_cycle();
+    printf("After repair: %d missing, %zu-byte report\n",
+           (last_frame[2] << 8) | last_frame[3], last_frame_length);
+    const uint8_t no_gaps[] = {RSP_GAPS, 0, 0x00, 0};
+    EXPECT_EQ(last_frame_length, sizeof(no_gaps));
+    EXPECT(memcmp(last_frame, no_gaps, sizeof(no_gaps)) == 0);
+    
+    uint8_t end[] = {0x00, 0x03};
+    bootloader_receive_packet_from(TRANSPORT_CAN, end, sizeof(end));
+    bootloader_stats_t stats;
+    for (int i = 0; i < 50; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("State: %d, bytes: %d, duplicates: %d, responses: %d\n",
+           stats.state, stats.bytes_received, stats.duplicate_packets, frames_seen);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, image_size);
+    EXPECT_EQ(stats.duplicate_packets, 1);
+    EXPECT_EQ(frames_seen, 3); // The END is not answered either
+    for (uint32_t chunk = 0; chunk < 4; chunk++) {
+        EXPECT_EQ(*flash_memory_at(APPLICATION_START + chunk * MULTICAST_CHUNK_SIZE), chunk);
+    }
+    
+    end_test("Multicast session");
+}
+
+void test_fec_recovery(void) {
+    printf("=== Test 14: Lost Frames Rebuilt by FEC ===\n");
+    
+    begin_test(false);
+    fec_encoder_t enc;
+    fec_decoder_t dec;
+    fec_encoder_init(&enc, 2);
+    fec_decoder_init(&dec, TRANSPORT_UART);
+    
+    // One group: start, four data packets and the end, then two parity
+    // frames. Data packets 2 and 4 never arrive.
+    uint8_t packets[6][MAX_PACKET_SIZE];
+    size_t lengths[6];
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x04, 0x00, 0x12, 0x34}; // 1024 bytes
+    memcpy(packets[0], start, sizeof(start));
+    lengths[0] = sizeof(start);
+    for (int p = 1; p <= 4; p++) {
+        packets[p][0] = (uint8_t)p;
+        packets[p][1] = 0x02; // PKT_DATA
+        memset(&packets[p][2], p * 0x11, 256);
+        lengths[p] = 258;
+    }
+    packets[5][0] = 0x05;
+    packets[5][1] = 0x03; // PKT_END_SESSION
+    lengths[5] = 2;
+    
+    uint8_t frames[1 + FEC_MAX_PARITY][FEC_MAX_FRAME_SIZE];
+    size_t frame_lengths[1 + FEC_MAX_PARITY];
+    for (int p = 0; p < 6; p++) {
+        fec_encode(&enc, packets[p], lengths[p], frames, frame_lengths);
+        if (p != 2 && p != 4) {
+            fec_receive_frame(&dec, frames[0], frame_lengths[0]);
+        }
+        bootloader_process_cycle();
+    }
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("Before parity: bytes %d\n", stats.bytes_received);
+    EXPECT_EQ(stats.bytes_received, 256); // Only packet 1 arrived in order
+    
+    int parity = fec_flush(&enc, frames, frame_lengths);
+    for (int j = 0; j < parity; j++) {
+        fec_receive_frame(&dec, frames[j], frame_lengths[j]);
+    }
+    for (int i = 0; i < 50; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("Frames: %u, recovered: %u, lost: %u\n", dec.frames, dec.recovered, dec.lost);
+    printf("State: %d, bytes: %d, dropped: %d\n",
+           stats.state, stats.bytes_received, stats.packets_dropped);
+    EXPECT_EQ(dec.recovered, 2);
+    EXPECT_EQ(dec.lost, 0);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 1024);
+    EXPECT_EQ(stats.packets_dropped, 0);
+    for (int p = 1; p <= 4; p++) {
+        EXPECT(memcmp(flash_memory_at(APPLICATION_START + (p - 1) * 256), &packets[p][2], 256) == 0);
+    }
+    
+    // The same group with parity frame 1 damaged: the first rebuild fails,
+    // and when packet 2 turns up late, parity frame 0 alone rebuilds packet 4
+    begin_test(false);
+    fec_encoder_init(&enc, 2);
+    fec_decoder_init(&dec, TRANSPORT_UART);
+    uint8_t late[FEC_MAX_FRAME_SIZE];
+    size_t late_length = 0;
+    for (int p = 0; p < 6; p++) {
+        fec_encode(&enc, packets[p], lengths[p], frames, frame_lengths);
+        if (p == 2) {
+            memcpy(late, frames[0], frame_lengths[0]);
+            late_length = frame_lengths[0];
+        } else if (p != 4) {
+            fec_receive_frame(&dec, frames[0], frame_lengths[0]);
+        }
+        bootloader_process_cycle();
+    }
+    parity = fec_flush(&enc, frames, frame_lengths);
+    frames[1][FEC_HEADER_SIZE] ^= 0x5A; // Length of the rebuilt packets
+    for (int j = 0; j < parity; j++) {
+        fec_receive_frame(&dec, frames[j], frame_lengths[j]);
+    }
+    printf("Damaged parity: recovered %u\n", dec.recovered);
+    EXPECT_EQ(dec.recovered, 0);
+    fec_receive_frame(&dec, late, late_length);
+    for (int i = 0; i < 50; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.state != STATE_DFU_ACTIVE) break;
+        usleep(1000);
+    }
+    printf("Packet 2 late: recovered %u, lost %u, state %d, bytes %d\n",
+           dec.recovered, dec.lost, stats.state, stats.bytes_received);
+    EXPECT_EQ(dec.recovered, 1);
+    EXPECT_EQ(dec.lost, 0);
+    EXPECT_EQ(stats.state, STATE_DFU_VERIFY);
+    EXPECT_EQ(stats.bytes_received, 1024);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START + 3 * 256), &packets[4][2], 256) == 0);
+    
+    end_test("FEC recovery");
+}
+
+void test_ack_coalescing(void) {
+    printf("=== Test 15: ACKs Coalesced While the Line Is Busy ===\n");
+    
+    begin_test(false);
+    platform_set_tx_ready_hook(test_tx_ready, NULL);
+    line_free = true;
+    
+    uint8_t start[] = {0x00, 0x01, 0x00, 0x00, 0x04, 0x00, 0x12, 0x34}; // 1024 bytes
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    
+    // The host keeps the half-duplex line busy while the writes complete
+    line_free = false;
+    for (int i = 1; i <= 4; i++) {
+        uint8_t data_packet[258];
+        data_packet[0] = i;
+        data_packet[1] = 0x02; // PKT_DATA
+        memset(&data_packet[2], i, 256);
+        bootloader_receive_packet(data_packet, sizeof(data_packet));
+    }
+    bootloader_stats_t stats;
+    for (int i = 0; i < 50; i++) {
+        usleep(1000);
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.acks_coalesced == 3) break;
+    }
+    printf("Responses while busy: %d\n", frames_seen - 1);
+    EXPECT_EQ(frames_seen, 1); // The session's ACK
+    EXPECT_EQ(stats.acks_coalesced, 3);
+    
+    line_free = true;
+    bootloader_process_cycle();
+    bootloader_get_stats(&stats);
+    printf("After the line frees: %d response(s), ACK seq %d, credits %d, %d coalesced\n",
+           frames_seen - 1, last_frame[2], last_frame[1], stats.acks_coalesced);
+    EXPECT_EQ(frames_seen, 2);
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(last_frame[2], 4);           // Covers packets 1 to 4
+    EXPECT_EQ(last_frame[1], BUFFER_SIZE); // Credits as of sending: all free
+    
+    end_test("ACK coalescing");
+}
+
+void test_response_decoding(void) {
+    printf("=== Test 16: Host Decodes Framed Responses ===\n");
+    
+    // A gap report full of zero bytes, an ACK, and the ACK again with a
+    // flipped bit
+    uint8_t gaps[] = {RSP_GAPS, 0x02, 0x00, 0x05, 0x00, 0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x02};
+    uint8_t ack[] = {RSP_ACK, 0x10, 0x07};
+    uint8_t frames[3][FRAME_MAX_ENCODED_SIZE(sizeof(gaps))];
+    size_t lengths[3];
+    lengths[0] = framer_encode(gaps, sizeof(gaps), frames[0], sizeof(frames[0]));
+    lengths[1] = framer_encode(ack, sizeof(ack), frames[1], sizeof(frames[1]));
+    memcpy(frames[2], frames[1], lengths[1]);
+    lengths[2] = lengths[1];
+    frames[2][2] ^= 0x01;
+    
+    for (int i = 0; i < 3; i++) {
+        uint8_t out[sizeof(gaps) + FRAME_CRC_SIZE];
+        // Without the trailing delimiter, as a host splits the stream
+        size_t length = framer_decode(frames[i], lengths[i] - 1, out, sizeof(out));
+        bool match = length == (i == 0 ? sizeof(gaps) : sizeof(ack)) &&
+                     memcmp(out, i == 0 ? gaps : ack, length) == 0;
+        printf("Frame %d: %zu encoded bytes -> %zu decoded, %s\n", i, lengths[i], length,
+               match ? "intact" : "rejected");
+        EXPECT(i < 2 ? match : length == 0); // Only the damaged copy is rejected
+    }
+    
+    printf("✓ Response decoding test passed\n\n");
+}
+
+void test_image_container(void) {
+    printf("=== Test 17: Image Container Round Trip ===\n");
+    
+    // Code-like bytes, an erased gap, zero padding and a short last chunk
+    static uint8_t image[5 * IMAGE_CHUNK_SIZE + 100];
+    static uint8_t container[IMAGE_MAX_CONTAINER_SIZE];
+    static uint8_t chunk[IMAGE_CHUNK_SIZE];
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 31 + (i >> 7));
+    }
+    memset(&image[IMAGE_CHUNK_SIZE], 0xFF, 2 * IMAGE_CHUNK_SIZE);
+    memset(&image[3 * IMAGE_CHUNK_SIZE + 512], 0x00, 3000);
+    
+    image_pack_options_t options = { 2, true };
+    image_pack_stats_t stats;
+    size_t length = image_pack(image, sizeof(image), container, &options, &stats);
+    printf("Packed %zu bytes into %zu: %u run-length encoded, %u erased\n",
+           sizeof(image), length, stats.chunks_rle, stats.chunks_erased);
+    EXPECT_EQ(stats.chunks_rle, 2);
+    EXPECT_EQ(stats.chunks_erased, 2);
+    EXPECT(length < sizeof(image) / 2);
+    
+    image_header_t header;
+    bool intact = image_read_header(container, length, &header) &&
+                  header.image_size == sizeof(image) && header.chunk_count == 6;
+    for (uint32_t i = 0; intact && i < header.chunk_count; i++) {
+        size_t unpacked = image_unpack_chunk(container, length, &header, i, chunk);
+        intact = unpacked > 0 && memcmp(chunk, &image[i * IMAGE_CHUNK_SIZE], unpacked) == 0;
+    }
+    printf("Unpacked: %s\n", intact ? "identical" : "DIFFERENT");
+    EXPECT(intact);
+    
+    // A flipped bit in a stored chunk fails that chunk alone; one in the
+    // table fails the header
+    image_chunk_t entry;
+    image_read_chunk(container, 3, &entry);
+    container[entry.offset + 10] ^= 0x01;
+    bool chunk3 = image_unpack_chunk(container, length, &header, 3, chunk) > 0;
+    bool chunk4 = image_unpack_chunk(container, length, &header, 4, chunk) > 0;
+    printf("Chunk 3 damaged: %s, chunk 4: %s\n", chunk3 ? "accepted" : "rejected",
+           chunk4 ? "accepted" : "rejected");
+    EXPECT(!chunk3 && chunk4);
+    container[IMAGE_HEADER_SIZE + 5] ^= 0x01;
+    bool table = image_read_header(container, length, &header);
+    printf("Table damaged: header %s\n", table ? "accepted" : "rejected");
+    EXPECT(!table);
+    
+    printf("✓ Image container test passed\n\n");
+}
+
+static image_load_t hex_load, srec_load;
+
+static bool load_text(const char *text, image_load_t *load) {
+    if (!image_load((const uint8_t *)text, strlen(text), load)) {
+        printf("Load failed: %s\n", load->error);
+        return false;
+    }
+    return true;
+}
+
+void test_image_loader(void) {
+    printf("=== Test 18: HEX and S-Records Loaded as a Sparse Image ===\n");
+    
+    // The same two regions, 0x1000 apart, in both formats
+    EXPECT(load_text(":020000040800F2\r\n"
+                     ":048000000102030472\r\n"
+                     ":02900000AABB09\r\n"
+                     ":00000001FF\r\n", &hex_load));
+    EXPECT(load_text("S309080080000102030464\n"
+                     "S30708009000AABBFB\n"
+                     "S7050800800072\n", &srec_load));
+    printf("HEX: %u bytes loaded, %u regions, image %u bytes, hole reads 0x%02X\n",
+           hex_load.loaded, hex_load.region_count, hex_load.size, hex_load.data[4]);
+    printf("S-records: %s\n", srec_load.size == hex_load.size &&
+           memcmp(srec_load.data, hex_load.data, hex_load.size) == 0 ? "same image" : "DIFFERENT");
+    EXPECT_EQ(hex_load.loaded, 6);
+    EXPECT_EQ(hex_load.region_count, 2);
+    EXPECT_EQ(hex_load.size, 0x1002);
+    EXPECT_EQ(hex_load.data[4], 0xFF); // Holes read as erased flash
+    EXPECT_EQ(hex_load.data[0x1001], 0xBB);
+    EXPECT(srec_load.size == hex_load.size &&
+           memcmp(srec_load.data, hex_load.data, hex_load.size) == 0);
+    
+    // Overlapping records and data past the application area are refused
+    EXPECT(!load_text(":020000040800F2\n:048000000102030472\n:0280020009096A\n:00000001FF\n", &hex_load));
+    EXPECT(!load_text(":020000040900F1\n:048000000102030472\n:00000001FF\n", &hex_load));
+    
+    printf("✓ Image loader test passed\n\n");
+}
+
+static uint8_t repair_image[4 * FLASH_PAGE_SIZE + 100];
+
+static void send_and_process(const uint8_t *packet, size_t length) {
+    bootloader_receive_packet_from(TRANSPORT_UART, packet, length);
+    for (int i = 0; i < 10; i++) {
+        bootloader_process_cycle();
+        usleep(20);
+    }
+}
+
+// DATA packets over part of the image, numbered from 1, then the END.
+// Packets faulty_from to faulty_to are programmed with a bit flipped.
+static void send_image_span(uint32_t offset, uint32_t size, uint32_t faulty_from,
+                            uint32_t faulty_to) {
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t seq = 1;
+    for (uint32_t pos = offset; pos < offset + size; pos += MAX_PAYLOAD_SIZE, seq++) {
+        uint32_t length = offset + size - pos < MAX_PAYLOAD_SIZE ? offset + size - pos :
+                          MAX_PAYLOAD_SIZE;
+        packet[0] = (uint8_t)seq;
+        packet[1] = PKT_DATA;
+        memcpy(&packet[2], &repair_image[pos], length);
+        platform_set_flash_fault_rate(seq >= faulty_from && seq <= faulty_to ? 1.0 : 0.0);
+        send_and_process(packet, 2 + length);
+    }
+    platform_set_flash_fault_rate(0.0);
+    uint8_t end[] = {(uint8_t)seq, PKT_END_SESSION};
+    send_and_process(end, sizeof(end));
+}
+
+void test_page_repair(void) {
+    printf("=== Test 19: Bad Pages Found by Their CRCs and Rewritten ===\n");
+    
+    begin_test(true);
+    for (size_t i = 0; i < sizeof(repair_image); i++) {
+        repair_image[i] = (uint8_t)(i * 7 + (i >> 9));
+    }
+    uint32_t size = sizeof(repair_image);
+    uint32_t pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x00, (uint8_t)(size >> 8), (uint8_t)size,
+                       0x12, 0x34};
+    send_and_process(start, sizeof(start));
+    uint8_t table[4 + 4 * 5] = {0x01, PKT_PAGE_CRCS, 0x00, 0x00};
+    for (uint32_t page = 0; page < pages; page++) {
+        uint32_t offset = page * FLASH_PAGE_SIZE;
+        uint32_t crc = crc32_update(0, &repair_image[offset],
+                                    size - offset < FLASH_PAGE_SIZE ? size - offset : FLASH_PAGE_SIZE);
+        table[4 + page * 4] = (uint8_t)(crc >> 24);
+        table[5 + page * 4] = (uint8_t)(crc >> 16);
+        table[6 + page * 4] = (uint8_t)(crc >> 8);
+        table[7 + page * 4] = (uint8_t)crc;
+    }
+    send_and_process(table, sizeof(table));
+    printf("Page CRC table: %s\n", last_frame[0] == RSP_ACK ? "ACKed" : "refused");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    
+    // Packet 18, in page 2, does not program right
+    send_image_span(0, size, 18, 18);
+    printf("Bad page report: type 0x%02X, %d range(s), %d bad, first page %d x%d\n",
+           last_frame[0], last_frame[1], (last_frame[2] << 8) | last_frame[3],
+           (last_frame[4] << 8) | last_frame[5], (last_frame[6] << 8) | last_frame[7]);
+    const uint8_t bad_pages[] = {RSP_BAD_PAGES, 1, 0x00, 1, 0x00, 2, 0x00, 1};
+    EXPECT_EQ(last_frame_length, sizeof(bad_pages));
+    EXPECT(memcmp(last_frame, bad_pages, sizeof(bad_pages)) == 0);
+    
+    // Only the page reported is sent again
+    uint8_t repair[] = {0x00, PKT_REPAIR_START, 0x00, last_frame[5], 0x00, last_frame[7]};
+    send_and_process(repair, sizeof(repair));
+    printf("Repair session: %s\n", last_frame[0] == RSP_ACK ? "ACKed" : "refused");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    send_image_span(2 * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, 0, 0);
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    bool matches = memcmp(flash_memory_at(APPLICATION_START), repair_image, size) == 0;
+    printf("After repair: response 0x%02X, state %d, %d launch(es), flash %s\n",
+           last_frame[0], stats.state, stats.app_launch_attempts,
+           matches ? "matches the image" : "DIFFERS");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(stats.state, STATE_IDLE); // Launched, and back in the simulation
+    EXPECT_EQ(stats.app_launch_attempts, 1);
+    EXPECT(matches);
+    
+    uint8_t stray[] = {0x00, PKT_REPAIR_START, 0x00, 0x00, 0x00, 0x01};
+    send_and_process(stray, sizeof(stray));
+    printf("Repair start with nothing to repair: NACK 0x%02X\n", last_frame[1]);
+    EXPECT_EQ(last_frame[0], RSP_NACK);
+    EXPECT_EQ(last_frame[1], 0x15);
+    
+    end_test("Page repair");
+}
+
+// START_SESSION with a Merkle root, then the page CRC table
+static uint8_t start_with_root(const uint32_t *leaves, uint32_t pages, uint32_t root) {
+    uint32_t size = sizeof(repair_image);
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x00, (uint8_t)(size >> 8), (uint8_t)size,
+                       0x12, 0x34, (uint8_t)(root >> 24), (uint8_t)(root >> 16),
+                       (uint8_t)(root >> 8), (uint8_t)root};
+    send_and_process(start, sizeof(start));
+    uint8_t table[4 + 4 * 5] = {0x01, PKT_PAGE_CRCS, 0x00, 0x00};
+    for (uint32_t page = 0; page < pages; page++) {
+        table[4 + page * 4] = (uint8_t)(leaves[page] >> 24);
+        table[5 + page * 4] = (uint8_t)(leaves[page] >> 16);
+        table[6 + page * 4] = (uint8_t)(leaves[page] >> 8);
+        table[7 + page * 4] = (uint8_t)leaves[page];
+    }
+    send_and_process(table, sizeof(table));
+    return last_frame[0] == RSP_ACK ? 0 : last_frame[1];
+}
+
+void test_merkle_verification(void) {
+    printf("=== Test 20: Pages Checked As Programmed Against a Merkle Root ===\n");
+    
+    begin_test(true);
+    uint32_t size = sizeof(repair_image);
+    uint32_t pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    uint32_t leaves[5];
+    for (uint32_t page = 0; page < pages; page++) {
+        uint32_t offset = page * FLASH_PAGE_SIZE;
+        leaves[page] = crc32_update(0, &repair_image[offset],
+                                    size - offset < FLASH_PAGE_SIZE ? size - offset : FLASH_PAGE_SIZE);
+    }
+    uint32_t root = merkle_root(leaves, pages);
+    uint32_t left = merkle_root(leaves, 4);
+    printf("Root 0x%08X: 4-page subtree 0x%08X, lone last page carried up: %s\n", root, left,
+           merkle_root(&leaves[4], 1) == leaves[4] ? "yes" : "no");
+    EXPECT_EQ(merkle_root(&leaves[4], 1), leaves[4]);
+    EXPECT(root != left);
+    
+    // A table that does not add up to the root is refused
+    uint8_t nack = start_with_root(leaves, pages, root ^ 1);
+    printf("Table against the wrong root: NACK 0x%02X\n", nack);
+    EXPECT_EQ(nack, 0x16);
+    uint8_t abort_session[] = {0x00, PKT_ABORT};
+    send_and_process(abort_session, sizeof(abort_session));
+    
+    // Packet 5 ends page 0 with a flipped bit; the page fails as soon as
+    // it is programmed, before the session ends
+    nack = start_with_root(leaves, pages, root);
+    printf("Table against the right root: %s\n", nack == 0 ? "ACKed" : "refused");
+    EXPECT_EQ(nack, 0);
+    uint8_t packet[MAX_PACKET_SIZE];
+    for (uint32_t seq = 1; seq <= 8; seq++) {
+        packet[0] = (uint8_t)seq;
+        packet[1] = PKT_DATA;
+        memcpy(&packet[2], &repair_image[(seq - 1) * MAX_PAYLOAD_SIZE], MAX_PAYLOAD_SIZE);
+        platform_set_flash_fault_rate(seq == 5 ? 1.0 : 0.0);
+        send_and_process(packet, 2 + MAX_PAYLOAD_SIZE);
+    }
+    platform_set_flash_fault_rate(0.0);
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("Page 0 programmed: %d bad page(s)\n", stats.bad_pages);
+    EXPECT_EQ(stats.bad_pages, 1);
+    
+    // The rest of the image, then the repair of page 0; verification only
+    // looks at the results
+    for (uint32_t seq = 9; seq <= (size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE; seq++) {
+        uint32_t offset = (seq - 1) * MAX_PAYLOAD_SIZE;
+        uint32_t length = size - offset < MAX_PAYLOAD_SIZE ? size - offset : MAX_PAYLOAD_SIZE;
+        packet[0] = (uint8_t)seq;
+        packet[1] = PKT_DATA;
+        memcpy(&packet[2], &repair_image[offset], length);
+        send_and_process(packet, 2 + length);
+    }
+    uint8_t end[] = {(uint8_t)((size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE + 1), PKT_END_SESSION};
+    send_and_process(end, sizeof(end));
+    printf("End: type 0x%02X, first bad page %d\n", last_frame[0], (last_frame[4] << 8) | last_frame[5]);
+    EXPECT_EQ(last_frame[0], RSP_BAD_PAGES);
+    EXPECT_EQ((last_frame[4] << 8) | last_frame[5], 0);
+    uint8_t repair[] = {0x00, PKT_REPAIR_START, 0x00, 0x00, 0x00, 0x01};
+    send_and_process(repair, sizeof(repair));
+    send_image_span(0, FLASH_PAGE_SIZE, 0, 0);
+    bootloader_get_stats(&stats);
+    printf("After repair: state %d, %d launch(es), %d bad page(s)\n",
+           stats.state, stats.app_launch_attempts, stats.bad_pages);
+    EXPECT_EQ(stats.app_launch_attempts, 1);
+    EXPECT_EQ(stats.bad_pages, 0);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), repair_image, size) == 0);
+    
+    // A container is checked chunk by chunk on several threads
+    static uint8_t container[IMAGE_MAX_CONTAINER_SIZE];
+    static uint8_t unpacked[sizeof(repair_image) + IMAGE_CHUNK_SIZE];
+    image_pack_options_t options = { 2, true };
+    image_pack_stats_t pack_stats;
+    size_t length = image_pack(repair_image, size, container, &options, &pack_stats);
+    image_header_t header;
+    uint32_t bad_chunk;
+    bool intact = image_read_header(container, length, &header) &&
+                  image_unpack_all(container, length, &header, unpacked, 4, &bad_chunk);
+    printf("Container root %s the session's, unpacked on 4 threads: %s\n",
+           header.root == root ? "matches" : "differs from",
+           intact && memcmp(unpacked, repair_image, size) == 0 ? "identical" : "DIFFERENT");
+    EXPECT_EQ(header.root, root);
+    EXPECT(intact && memcmp(unpacked, repair_image, size) == 0);
+    image_chunk_t entry;
+    image_read_chunk(container, 3, &entry);
+    container[entry.offset] ^= 0x80;
+    intact = image_unpack_all(container, length, &header, unpacked, 4, &bad_chunk);
+    printf("Chunk 3 damaged: %s, bad chunk %u\n", intact ? "accepted" : "rejected", bad_chunk);
+    EXPECT(!intact);
+    EXPECT_EQ(bad_chunk, 3);
+    
+    end_test("Merkle verification");
+}
+
+// Cycles the idle bootloader until the scrub has finished one more pass.
+// Returns the cycles taken; *longest_us is the slowest of them.
+static uint32_t scrub_pass(uint32_t *longest_us) {
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    uint32_t passes = stats.scrub_passes + 1;
+    uint32_t cycles = 0;
+    *longest_us = 0;
+    do {
+        uint32_t start = get_system_tick();
+        bootloader_process_cycle();
+        uint32_t elapsed = get_system_tick() - start;
+        *longest_us = elapsed > *longest_us ? elapsed : *longest_us;
+        cycles++;
+        bootloader_get_stats(&stats);
+    } while (stats.scrub_passes < passes && cycles < 100000);
+    return cycles;
+}
+
+void test_idle_scrub(void) {
+    printf("=== Test 21: Idle Scrub Finds Bit Rot Before Launch ===\n");
+    
+    begin_test(true);
+    uint32_t size = sizeof(repair_image);
+    
+    // No page CRC table: the first pass records one
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x00, (uint8_t)(size >> 8), (uint8_t)size,
+                       0x12, 0x34};
+    send_and_process(start, sizeof(start));
+    send_image_span(0, size, 0, 0);
+    bootloader_set_scrub(5, 0);
+    uint32_t longest_us;
+    uint32_t cycles = scrub_pass(&longest_us);
+    printf("First pass over %u bytes at 5 us a cycle: %s\n", size,
+           cycles > 1 ? "spread over several cycles" : "one cycle");
+    EXPECT(cycles > 1);
+    
+    // A bit of page 3 rots; the next pass finds it
+    platform_flip_flash_bit(APPLICATION_START + 3 * FLASH_PAGE_SIZE + 10, 2);
+    scrub_pass(&longest_us);
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("Second pass: %d bad page(s), state %d\n", stats.bad_pages, stats.state);
+    EXPECT_EQ(stats.bad_pages, 1);
+    
+    uint8_t repair[] = {0x00, PKT_REPAIR_START, 0x00, 0x03, 0x00, 0x01};
+    send_and_process(repair, sizeof(repair));
+    printf("Repair of page 3: %s\n", last_frame[0] == RSP_ACK ? "ACKed" : "refused");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    send_image_span(3 * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE, 0, 0);
+    scrub_pass(&longest_us);
+    bootloader_get_stats(&stats);
+    printf("After repair and a pass: %d launch(es), %d bad page(s)\n",
+           stats.app_launch_attempts, stats.bad_pages);
+    EXPECT_EQ(stats.app_launch_attempts, 2); // The session's and the repair's
+    EXPECT_EQ(stats.bad_pages, 0);
+    
+    // The launch takes the clean pass's word for the image
+    uint8_t jump[] = {0x00, PKT_JUMP_APP};
+    send_and_process(jump, sizeof(jump));
+    bootloader_get_stats(&stats);
+    printf("Launch after a clean pass: %d launch(es)\n", stats.app_launch_attempts);
+    EXPECT_EQ(stats.app_launch_attempts, 3);
+    
+    end_test("Idle scrub");
+}
+
+void test_rx_arena(void) {
+    printf("=== Test 22: Variable-Length Records in the RX Arena ===\n");
+    
+    begin_test(true);
+    
+    // Long-form pings are too long for the control lane, but each takes a
+    // 16-byte record rather than a packet-sized slot
+    uint8_t ping[10] = {0x00, PKT_PING};
+    int queued = 0;
+    while (bootloader_rx_reserve(TRANSPORT_UART)) {
+        bootloader_receive_packet(ping, sizeof(ping));
+        queued++;
+    }
+    for (int i = 0; i < 10; i++) {
+        bootloader_process_cycle();
+    }
+    printf("%zu-byte packets queued at once: %d (fixed slots: %d), answered: %d\n",
+           sizeof(ping), queued, BUFFER_SIZE, frames_seen);
+    EXPECT_EQ(queued, (RX_ARENA_SIZE - RX_RECORD_MAX) / RX_RECORD_SIZE(sizeof(ping)) + 1);
+    EXPECT_EQ(acks_seen, queued);
+    
+    // Data packets of every length: records wrap at every point of the
+    // arena while earlier ones are still held by the write queue
+    static uint8_t image[16 * 1024];
+    uint32_t size = sizeof(image);
+    for (uint32_t i = 0; i < size; i++) {
+        image[i] = (uint8_t)(i * 11 + (i >> 8));
+    }
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x00, (uint8_t)(size >> 8), (uint8_t)size,
+                       0x12, 0x34};
+    bootloader_receive_packet(start, sizeof(start));
+    bootloader_process_cycle();
+    uint32_t x = 1, seq = 1, offset = 0;
+    while (offset < size) {
+        uint8_t *slot = bootloader_rx_reserve(TRANSPORT_UART);
+        if (!slot) {
+            bootloader_process_cycle();
+            continue;
+        }
+        x = x * 1103515245u + 12345u;
+        uint32_t length = 1 + (x >> 16) % MAX_PAYLOAD_SIZE;
+        length = size - offset < length ? size - offset : length;
+        slot[0] = (uint8_t)seq++;
+        slot[1] = PKT_DATA;
+        memcpy(&slot[2], &image[offset], length);
+        bootloader_rx_commit(TRANSPORT_UART, 2 + length);
+        offset += length;
+    }
+    while (!bootloader_rx_reserve(TRANSPORT_UART)) {
+        bootloader_process_cycle();
+    }
+    uint8_t end[] = {(uint8_t)seq, PKT_END_SESSION};
+    bootloader_receive_packet(end, sizeof(end));
+    bootloader_stats_t stats;
+    for (int i = 0; i < 10000; i++) {
+        bootloader_process_cycle();
+        bootloader_get_stats(&stats);
+        if (stats.app_launch_attempts > 0) {
+            break;
+        }
+        usleep(20);
+    }
+    printf("%u packets of 1-%d bytes: %d launch(es), %d dropped, flash %s\n", seq - 1,
+           MAX_PAYLOAD_SIZE, stats.app_launch_attempts, stats.packets_dropped,
+           memcmp(flash_memory_at(APPLICATION_START), image, size) == 0 ?
+           "matches the image" : "DIFFERS");
+    EXPECT_EQ(stats.app_launch_attempts, 1);
+    EXPECT_EQ(stats.packets_dropped, 0);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), image, size) == 0);
+    
+    end_test("RX arena");
+}
+
+// Manifest START over regions of the given sizes, in the given order,
+// with the CRC-32 of each
+static void start_manifest(const region_t *regions, const uint8_t *const *data,
+                           const uint32_t *sizes, int count, uint32_t crc_flip) {
+    uint8_t start[PACKET_HEADER_SIZE + 4 + REGION_COUNT * 9] = {0x00, PKT_START_SESSION,
+                                                                SESSION_MANIFEST, 0x12, 0x34};
+    start[5] = (uint8_t)count;
+    for (int i = 0; i < count; i++) {
+        uint32_t crc = crc32_update(0, data[i], sizes[i]) ^ crc_flip;
+        uint8_t *entry = &start[6 + i * 9];
+        entry[0] = (uint8_t)regions[i];
+        for (int b = 0; b < 4; b++) {
+            entry[1 + b] = (uint8_t)(sizes[i] >> (24 - 8 * b));
+            entry[5 + b] = (uint8_t)(crc >> (24 - 8 * b));
+        }
+    }
+    send_and_process(start, 6 + count * 9);
+}
+
+// REGION_DATA packets over one region, numbered on from *seq
+static void send_region(region_t region, const uint8_t *data, uint32_t size, uint32_t *seq) {
+    uint8_t packet[MAX_PACKET_SIZE];
+    for (uint32_t offset = 0; offset < size; offset += REGION_DATA_SIZE) {
+        uint32_t length = size - offset < REGION_DATA_SIZE ? size - offset : REGION_DATA_SIZE;
+        uint8_t header[] = {(uint8_t)(*seq)++, PKT_REGION_DATA, (uint8_t)region,
+                            (uint8_t)(offset >> 16), (uint8_t)(offset >> 8), (uint8_t)offset};
+        memcpy(packet, header, sizeof(header));
+        memcpy(&packet[sizeof(header)], &data[offset], length);
+        send_and_process(packet, sizeof(header) + length);
+    }
+}
+
+void test_multi_region_session(void) {
+    printf("=== Test 23: Application, Config and Co-processor in One Session ===\n");
+    
+    static uint8_t app[4100], config[3000], coprocessor[5000];
+    for (uint32_t i = 0; i < sizeof(app); i++) app[i] = (uint8_t)(i * 3);
+    for (uint32_t i = 0; i < sizeof(config); i++) config[i] = (uint8_t)(i * 5 + 1);
+    for (uint32_t i = 0; i < sizeof(coprocessor); i++) coprocessor[i] = (uint8_t)(i * 7 + 2);
+    const region_t regions[] = { REGION_COPROCESSOR, REGION_CONFIG, REGION_APPLICATION };
+    const uint8_t *const data[] = { coprocessor, config, app };
+    const uint32_t sizes[] = { sizeof(coprocessor), sizeof(config), sizeof(app) };
+    
+    begin_test(true);
+    
+    // The flash is idle until the first data packet, so every page of the
+    // three regions is erased ahead of it
+    start_manifest(regions, data, sizes, 3, 0);
+    printf("Manifest of 3 regions: %s\n", last_frame[0] == RSP_ACK ? "ACKed" : "refused");
+    bootloader_stats_t stats;
+    bootloader_get_stats(&stats);
+    printf("Pages erased before any data: %u\n", stats.pages_erased_ahead);
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(stats.pages_erased_ahead, 3 + 2 + 3); // 5000, 3000 and 4100 bytes in 2 KiB pages
+    
+    // Regions go in manifest order
+    uint32_t seq = 1;
+    send_region(REGION_APPLICATION, app, REGION_DATA_SIZE, &seq);
+    printf("Application data before the co-processor's: NACK 0x%02X\n", last_frame[1]);
+    EXPECT_EQ(last_frame[0], RSP_NACK);
+    EXPECT_EQ(last_frame[1], 0x01);
+    seq = 1;
+    for (int i = 0; i < 3; i++) {
+        send_region(regions[i], data[i], sizes[i], &seq);
+    }
+    uint8_t end[] = {(uint8_t)seq, PKT_END_SESSION};
+    send_and_process(end, sizeof(end));
+    bootloader_get_stats(&stats);
+    printf("End: %s, %d launch(es); application %s, config %s, co-processor %s\n",
+           last_frame[0] == RSP_ACK ? "ACK" : "NACK", stats.app_launch_attempts,
+           memcmp(flash_memory_at(APPLICATION_START), app, sizeof(app)) == 0 ? "written" : "DIFFERS",
+           memcmp(flash_memory_at(CONFIG_START), config, sizeof(config)) == 0 ? "written" : "DIFFERS",
+           memcmp(flash_memory_at(COPROCESSOR_START), coprocessor, sizeof(coprocessor)) == 0 ?
+           "written" : "DIFFERS");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(stats.app_launch_attempts, 1);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), app, sizeof(app)) == 0);
+    EXPECT(memcmp(flash_memory_at(CONFIG_START), config, sizeof(config)) == 0);
+    EXPECT(memcmp(flash_memory_at(COPROCESSOR_START), coprocessor, sizeof(coprocessor)) == 0);
+    
+    // A region that reads back wrong fails the session
+    begin_test(true);
+    start_manifest(&regions[1], &data[1], &sizes[1], 1, 0x01);
+    seq = 1;
+    send_region(REGION_CONFIG, config, sizeof(config), &seq);
+    end[0] = (uint8_t)seq;
+    send_and_process(end, sizeof(end));
+    bootloader_get_stats(&stats);
+    printf("Config with the wrong CRC-32: NACK 0x%02X, state %d\n", last_frame[1], stats.state);
+    EXPECT_EQ(last_frame[0], RSP_NACK);
+    EXPECT_EQ(last_frame[1], 0x17);
+    EXPECT_EQ(stats.state, STATE_ERROR);
+    
+    // The config partition alone: nothing to verify or launch
+    begin_test(true);
+    config[0] ^= 0xFF;
+    start_manifest(&regions[1], &data[1], &sizes[1], 1, 0);
+    seq = 1;
+    send_region(REGION_CONFIG, config, sizeof(config), &seq);
+    end[0] = (uint8_t)seq;
+    send_and_process(end, sizeof(end));
+    bootloader_get_stats(&stats);
+    printf("Config alone: %s, state %d, %d launch(es), application %s\n",
+           last_frame[0] == RSP_ACK ? "ACK" : "NACK", stats.state, stats.app_launch_attempts,
+           memcmp(flash_memory_at(APPLICATION_START), app, sizeof(app)) == 0 ?
+           "untouched" : "DIFFERS");
+    EXPECT_EQ(last_frame[0], RSP_ACK);
+    EXPECT_EQ(stats.state, STATE_IDLE);
+    EXPECT_EQ(stats.app_launch_attempts, 0);
+    EXPECT(memcmp(flash_memory_at(APPLICATION_START), app, sizeof(app)) == 0);
+    
+    // A plain session takes nothing past its declared size: the fourth
+    // full packet of a 1000-byte image would overrun it
+    begin_test(true);
+    uint8_t start[] = {0x00, PKT_START_SESSION, 0x00, 0x00, 0x03, 0xE8, 0x12, 0x34};
+    send_and_process(start, sizeof(start));
+    for (int p = 1; p <= 4; p++) {
+        uint8_t data_packet[2 + 256] = {(uint8_t)p, PKT_DATA};
+        memcpy(&data_packet[2], &app[(p - 1) * 256], 256);
+        send_and_process(data_packet, sizeof(data_packet));
+    }
+    bootloader_get_stats(&stats);
+    printf("Packet past the declared size: NACK 0x%02X, %d bytes taken\n",
+           last_frame[1], stats.bytes_received);
+    EXPECT_EQ(last_frame[0], RSP_NACK);
+    EXPECT_EQ(last_frame[1], 0x01);
+    EXPECT_EQ(stats.bytes_received, 3 * 256);
+    EXPECT_EQ(*flash_memory_at(APPLICATION_START + 3 * 256), 0xFF);
+    
+    end_test("Multi-region session");
+}
+
 int main(void) {
     printf("========================================\n");
     printf("  Advanced Bootloader Test Suite\n");
@@ -188,6 +1548,25 @@ int main(void) {
     test_complete_dfu_workflow();
     test_emergency_reset_command();
     test_concurrent_with_state_transitions();
+    test_event_driven_run_loop();
+    test_control_priority_lane();
+    test_duplicate_retransmissions();
+    test_write_behind_queue();
+    test_zero_copy_slot_release();
+    test_transport_binding();
+    test_framed_byte_stream();
+    test_isotp_segmentation();
+    test_multicast_session();
+    test_fec_recovery();
+    test_ack_coalescing();
+    test_response_decoding();
+    test_image_container();
+    test_image_loader();
+    test_page_repair();
+    test_merkle_verification();
+    test_idle_scrub();
+    test_rx_arena();
+    test_multi_region_session();
     
     printf("========================================\n");
     printf("  All Advanced Tests Completed!\n");